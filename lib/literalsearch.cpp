@@ -0,0 +1,178 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "literalsearch.h"
+
+#include <QVector>
+#include <QtAlgorithms>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define LITERALSEARCH_SSE2
+#   include <emmintrin.h>
+#endif
+
+static const char16_t NoBreakSpace = 0x00A0;
+
+/* Returns the text characters that normalize to ch, if there are at most
+ * two of them.  Only ASCII is considered for case insensitive searches, and
+ * 'k' and 's' are excluded since they are also the case folding of the
+ * Kelvin sign and the long s.
+ */
+static bool filterVariants(char16_t ch, Qt::CaseSensitivity cs, char16_t variants[2])
+{
+    if (ch == u' ') {
+        variants[0] = u' ';
+        variants[1] = NoBreakSpace;
+        return true;
+    }
+    if (cs == Qt::CaseSensitive) {
+        variants[0] = variants[1] = ch;
+        return true;
+    }
+    if (ch >= 0x80 || ch == u'k' || ch == u's')
+        return false;
+    variants[0] = ch;
+    variants[1] = (ch >= u'a' && ch <= u'z') ? char16_t(ch - u'a' + u'A') : ch;
+    return true;
+}
+
+LiteralSearch::LiteralSearch(const QString &needle, Qt::CaseSensitivity cs, bool wholeWord)
+    : m_needle(needle), m_caseSensitivity(cs), m_wholeWord(wholeWord), m_canOverlap(),
+      m_filter()
+{
+    m_pattern.resize(needle.size());
+    for (int i = 0; i < needle.size(); ++i)
+        m_pattern[i] = QChar(normalize(needle.at(i).unicode()));
+
+    // The longest proper prefix of the pattern which is also a suffix (the
+    // KMP failure function of the last character).  It is only empty if
+    // matches can't overlap.
+    QVector<int> border(m_pattern.size(), 0);
+    for (int i = 1; i < m_pattern.size(); ++i) {
+        int k = border.at(i - 1);
+        while (k > 0 && m_pattern.at(i) != m_pattern.at(k))
+            k = border.at(k - 1);
+        if (m_pattern.at(i) == m_pattern.at(k))
+            ++k;
+        border[i] = k;
+    }
+    m_canOverlap = !border.isEmpty() && border.last() > 0;
+
+    if (!m_pattern.isEmpty()) {
+        m_filter = filterVariants(m_pattern.front().unicode(), cs, m_first)
+                && filterVariants(m_pattern.back().unicode(), cs, m_last);
+    }
+}
+
+char16_t LiteralSearch::normalize(char16_t ch) const
+{
+    if (ch == NoBreakSpace)
+        return u' ';
+    if (m_caseSensitivity == Qt::CaseSensitive)
+        return ch;
+    if (ch < 0x80)
+        return (ch >= u'A' && ch <= u'Z') ? char16_t(ch - u'A' + u'a') : ch;
+    return QChar(ch).toCaseFolded().unicode();
+}
+
+bool LiteralSearch::matchesAt(const char16_t *text, int size, int pos) const
+{
+    const int length = int(m_pattern.size());
+    const char16_t *pattern = reinterpret_cast<const char16_t *>(m_pattern.utf16());
+    for (int i = 0; i < length; ++i) {
+        if (normalize(text[pos + i]) != pattern[i])
+            return false;
+    }
+
+    if (m_wholeWord) {
+        // Same word boundary rules as QTextDocument::find()
+        if (pos > 0 && QChar(text[pos - 1]).isLetterOrNumber())
+            return false;
+        if (pos + length < size && QChar(text[pos + length]).isLetterOrNumber())
+            return false;
+    }
+    return true;
+}
+
+int LiteralSearch::indexIn(QStringView text, int from) const
+{
+    const int length = int(m_pattern.size());
+    const int size = int(text.size());
+    if (length == 0 || from < 0)
+        return -1;
+
+    const char16_t *data = text.utf16();
+    const int lastStart = size - length;
+    int pos = from;
+
+#ifdef LITERALSEARCH_SSE2
+    if (m_filter) {
+        const __m128i first0 = _mm_set1_epi16(short(m_first[0]));
+        const __m128i first1 = _mm_set1_epi16(short(m_first[1]));
+        const __m128i last0 = _mm_set1_epi16(short(m_last[0]));
+        const __m128i last1 = _mm_set1_epi16(short(m_last[1]));
+        for ( ; pos + 7 <= lastStart; pos += 8) {
+            const __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+            const __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos + length - 1));
+            const __m128i headMatch = _mm_or_si128(_mm_cmpeq_epi16(head, first0),
+                                                   _mm_cmpeq_epi16(head, first1));
+            const __m128i tailMatch = _mm_or_si128(_mm_cmpeq_epi16(tail, last0),
+                                                   _mm_cmpeq_epi16(tail, last1));
+            // Two mask bits per UTF-16 code unit
+            uint mask = uint(_mm_movemask_epi8(_mm_and_si128(headMatch, tailMatch)));
+            while (mask) {
+                const int bit = int(qCountTrailingZeroBits(mask));
+                if (matchesAt(data, size, pos + bit / 2))
+                    return pos + bit / 2;
+                mask &= ~(3u << bit);
+            }
+        }
+    }
+#endif
+
+    const char16_t first = m_pattern.front().unicode();
+    const char16_t last = m_pattern.back().unicode();
+    for ( ; pos <= lastStart; ++pos) {
+        if (normalize(data[pos]) == first && normalize(data[pos + length - 1]) == last
+                && matchesAt(data, size, pos))
+            return pos;
+    }
+    return -1;
+}
+
+int LiteralSearch::lastIndexIn(QStringView text, int from) const
+{
+    const int length = int(m_pattern.size());
+    const int size = int(text.size());
+    if (length == 0)
+        return -1;
+
+    const char16_t *data = text.utf16();
+    const char16_t first = m_pattern.front().unicode();
+    for (int pos = qMin(from, size - length); pos >= 0; --pos) {
+        if (normalize(data[pos]) == first && matchesAt(data, size, pos))
+            return pos;
+    }
+    return -1;
+}
+
+bool LiteralSearch::matchesAt(QStringView text, int pos) const
+{
+    const int size = int(text.size());
+    if (m_pattern.isEmpty() || pos < 0 || pos > size - int(m_pattern.size()))
+        return false;
+    return matchesAt(text.utf16(), size, pos);
+}
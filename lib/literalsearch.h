@@ -0,0 +1,74 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_LITERALSEARCH_H
+#define QTEXTPAD_LITERALSEARCH_H
+
+#include <QString>
+#include <QStringView>
+
+/* A plain (non-regex) string search over UTF-16 text.
+ *
+ * Candidate positions are found by comparing the first and last characters
+ * of the search string against 8 positions at a time (using SSE2 where it
+ * is available), and only the candidates are verified in full.  Case
+ * insensitive searches compare case folded characters, and whole word
+ * matching is checked inline, so neither needs a copy of the text.  As with
+ * QTextDocument::find(), a non-breaking space in the text matches a space.
+ */
+class LiteralSearch
+{
+public:
+    LiteralSearch()
+        : m_caseSensitivity(Qt::CaseSensitive), m_wholeWord(), m_canOverlap(), m_filter() { }
+    LiteralSearch(const QString &needle, Qt::CaseSensitivity cs, bool wholeWord);
+
+    const QString &needle() const { return m_needle; }
+    Qt::CaseSensitivity caseSensitivity() const { return m_caseSensitivity; }
+    bool wholeWord() const { return m_wholeWord; }
+    int length() const { return int(m_needle.size()); }
+
+    // Returns the start of the first match at or after from, or -1
+    int indexIn(QStringView text, int from = 0) const;
+
+    // Returns the start of the last match starting at or before from, or -1
+    int lastIndexIn(QStringView text, int from) const;
+
+    // Returns true if there is a match starting exactly at pos
+    bool matchesAt(QStringView text, int pos) const;
+
+    // True if two matches can overlap, i.e. the search string starts with
+    // one of its own suffixes.  Since searches continue after the end of
+    // each match, they don't find every occurrence of such a string.
+    bool canOverlap() const { return m_canOverlap; }
+
+private:
+    QString m_needle;
+    QString m_pattern;      // m_needle with normalize() applied
+    Qt::CaseSensitivity m_caseSensitivity;
+    bool m_wholeWord;
+    bool m_canOverlap;
+
+    // Text characters which can match the first and last characters of the
+    // pattern, for the vectorized candidate filter
+    bool m_filter;
+    char16_t m_first[2], m_last[2];
+
+    char16_t normalize(char16_t ch) const;
+    bool matchesAt(const char16_t *text, int size, int pos) const;
+};
+
+#endif // QTEXTPAD_LITERALSEARCH_H
@@ -19,7 +19,83 @@
 #include <KSyntaxHighlighting/Theme>
 #include <KSyntaxHighlighting/Definition>
 
+#include <QElapsedTimer>
 #include <QRegularExpression>
+#include <QTextLayout>
+
+enum SyntaxHighlighter_Properties
+{
+    Property_StyleId = QTextFormat::UserProperty + 1,
+    Property_ThemeSerial,
+};
+
+// Style ID for the whitespace markers, which don't come from a syntax Format
+static const int WhitespaceStyle = -1;
+
+void SyntaxHighlighter::setTheme(const KSyntaxHighlighting::Theme &theme)
+{
+    KSyntaxHighlighting::SyntaxHighlighter::setTheme(theme);
+
+    // Existing ranges in the document are updated lazily by
+    // updateThemeFormats() as they are displayed.
+    m_themeFormats.clear();
+    ++m_themeSerial;
+}
+
+bool SyntaxHighlighter::updateThemeFormats(const QTextBlock &block)
+{
+    QTextLayout *layout = block.layout();
+    if (!layout)
+        return false;
+
+    auto ranges = layout->formats();
+    bool changed = false;
+    for (auto &range : ranges) {
+        if (!range.format.hasProperty(Property_StyleId)
+                || range.format.intProperty(Property_ThemeSerial) == m_themeSerial)
+            continue;
+        range.format = themeFormat(range.format.intProperty(Property_StyleId));
+        changed = true;
+    }
+    if (changed) {
+        // This is what QSyntaxHighlighter does internally, without running
+        // the syntax engine over the block again.
+        layout->setFormats(ranges);
+        document()->markContentsDirty(block.position(), block.length());
+    }
+    return changed;
+}
+
+QTextCharFormat SyntaxHighlighter::themeFormat(int styleId)
+{
+    auto iter = m_themeFormats.constFind(styleId);
+    if (iter != m_themeFormats.constEnd())
+        return *iter;
+
+    QTextCharFormat charFormat;
+    if (styleId == WhitespaceStyle) {
+        charFormat.setForeground(theme().editorColor(KSyntaxHighlighting::Theme::TabMarker));
+    } else {
+        // Same as KSyntaxHighlighting::SyntaxHighlighter::applyFormat()
+        const KSyntaxHighlighting::Format format = m_styles.value(styleId);
+        const KSyntaxHighlighting::Theme currentTheme = theme();
+        charFormat.setForeground(format.textColor(currentTheme));
+        if (format.hasBackgroundColor(currentTheme))
+            charFormat.setBackground(format.backgroundColor(currentTheme));
+        if (format.isBold(currentTheme))
+            charFormat.setFontWeight(QFont::Bold);
+        if (format.isItalic(currentTheme))
+            charFormat.setFontItalic(true);
+        if (format.isUnderline(currentTheme))
+            charFormat.setFontUnderline(true);
+        if (format.isStrikeThrough(currentTheme))
+            charFormat.setFontStrikeOut(true);
+    }
+    charFormat.setProperty(Property_StyleId, styleId);
+    charFormat.setProperty(Property_ThemeSerial, m_themeSerial);
+    m_themeFormats.insert(styleId, charFormat);
+    return charFormat;
+}
 
 void SyntaxHighlighter::hideBlock(QTextBlock block, bool hide)
 {
@@ -157,17 +233,62 @@ QTextBlock SyntaxHighlighter::findFoldEnd(const QTextBlock &startBlock) const
     return QTextBlock();
 }
 
+static inline bool isWhitespace(const QChar &ch)
+{
+    // Matches the ASCII-only definition of \s used by QRegularExpression
+    const auto code = ch.unicode();
+    return code == ' ' || (code >= '\t' && code <= '\r');
+}
+
 void SyntaxHighlighter::highlightBlock(const QString &text)
 {
-    KSyntaxHighlighting::SyntaxHighlighter::highlightBlock(text);
+    QElapsedTimer timer;
+    if (m_trackHighlightTime)
+        timer.start();
 
-    static const QRegularExpression ws_regex(QStringLiteral("\\s+"));
-    auto iter = ws_regex.globalMatch(text);
-    QTextCharFormat ws_format;
-    const QBrush ws_brush(theme().editorColor(KSyntaxHighlighting::Theme::TabMarker));
-    ws_format.setForeground(ws_brush);
-    while (iter.hasNext()) {
-        const auto match = iter.next();
-        setFormat(match.capturedStart(), match.capturedLength(), ws_format);
+    // Don't let the syntax engine crawl through huge (e.g. minified) lines.
+    // Anything past the threshold is left unhighlighted.
+    const bool largeLine = m_largeLineThreshold > 0 && text.size() > m_largeLineThreshold;
+    const QString highlightText = largeLine ? text.left(m_largeLineThreshold) : text;
+    KSyntaxHighlighting::SyntaxHighlighter::highlightBlock(highlightText);
+
+    // The whitespace markers are only drawn with ShowTabsAndSpaces, so don't
+    // clutter the document's formats with them otherwise.
+    if (m_showWhitespace) {
+        const QTextCharFormat ws_format = themeFormat(WhitespaceStyle);
+        const QChar *chars = highlightText.constData();
+        const int size = highlightText.size();
+        int pos = 0;
+        while (pos < size) {
+            while (pos < size && !isWhitespace(chars[pos]))
+                ++pos;
+            const int start = pos;
+            while (pos < size && isWhitespace(chars[pos]))
+                ++pos;
+            if (pos > start)
+                setFormat(start, pos - start, ws_format);
+        }
     }
+
+    if (m_trackHighlightTime)
+        m_highlightTime += timer.nsecsElapsed();
+}
+
+qint64 SyntaxHighlighter::takeHighlightTime()
+{
+    const qint64 elapsed = m_highlightTime;
+    m_highlightTime = 0;
+    return elapsed;
+}
+
+void SyntaxHighlighter::applyFormat(int offset, int length,
+                                    const KSyntaxHighlighting::Format &format)
+{
+    if (length == 0)
+        return;
+
+    const int styleId = format.id();
+    if (!m_styles.contains(styleId))
+        m_styles.insert(styleId, format);
+    setFormat(offset, length, themeFormat(styleId));
 }
@@ -18,18 +18,44 @@
 #define QTEXTPAD_SYNTAXHIGHLIGHTER_H
 
 #include <KSyntaxHighlighting/SyntaxHighlighter>
+#include <KSyntaxHighlighting/Format>
+
+#include <QHash>
+#include <QTextCharFormat>
 
 class SyntaxHighlighter : public KSyntaxHighlighting::SyntaxHighlighter
 {
 public:
     explicit SyntaxHighlighter(QTextDocument *document)
         : KSyntaxHighlighting::SyntaxHighlighter(document),
-          m_tabCharSize()
+          m_tabCharSize(), m_showWhitespace(), m_largeLineThreshold(),
+          m_trackHighlightTime(), m_highlightTime(), m_themeSerial(1)
     { }
 
+    void setTheme(const KSyntaxHighlighting::Theme &theme) Q_DECL_OVERRIDE;
+
+    // Re-resolve the block's highlighting ranges against the current theme,
+    // if they were formatted with a previous theme.  Returns true if the
+    // block's formats were changed.
+    bool updateThemeFormats(const QTextBlock &block);
+
     void setTabWidth(int width) { m_tabCharSize = width; }
     int tabWidth() const { return m_tabCharSize; }
 
+    // NOTE: Changing this only affects blocks that are highlighted afterward
+    void setShowWhitespace(bool show) { m_showWhitespace = show; }
+    bool showWhitespace() const { return m_showWhitespace; }
+
+    // Lines longer than this are only highlighted up to the threshold.
+    // A value of 0 disables the limit.
+    void setLargeLineThreshold(int length) { m_largeLineThreshold = length; }
+    int largeLineThreshold() const { return m_largeLineThreshold; }
+
+    // When enabled, the time spent in highlightBlock() is accumulated until
+    // it is collected with takeHighlightTime() (in nanoseconds).
+    void setTrackHighlightTime(bool track) { m_trackHighlightTime = track; }
+    qint64 takeHighlightTime();
+
     static void hideBlock(QTextBlock block, bool hide);
 
     static bool isFolded(const QTextBlock &block)
@@ -49,9 +75,23 @@ public:
 
 protected:
     void highlightBlock(const QString &text) Q_DECL_OVERRIDE;
+    void applyFormat(int offset, int length,
+                     const KSyntaxHighlighting::Format &format) Q_DECL_OVERRIDE;
 
 private:
     int m_tabCharSize;
+    bool m_showWhitespace;
+    int m_largeLineThreshold;
+    bool m_trackHighlightTime;
+    qint64 m_highlightTime;
+
+    // Highlighted ranges store a theme-independent style ID, which is
+    // resolved to a QTextCharFormat through the current theme's table.
+    int m_themeSerial;
+    QHash<int, KSyntaxHighlighting::Format> m_styles;
+    QHash<int, QTextCharFormat> m_themeFormats;
+
+    QTextCharFormat themeFormat(int styleId);
 };
 
 #endif // QTEXTPAD_SYNTAXHIGHLIGHTER_H
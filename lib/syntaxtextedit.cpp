@@ -17,6 +17,13 @@
 #include "syntaxtextedit.h"
 
 #include <QScrollBar>
+#include <QClipboard>
+#include <QMimeData>
+#include <QScopedValueRollback>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QLoggingCategory>
+#include <QFontInfo>
 #include <QTextBlock>
 #include <QPainter>
 #include <QPrinter>
@@ -25,8 +32,8 @@
 #include <QStringView>
 #include <QtMath>
 
-#if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QGuiApplication>
+#if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QStyleHints>
 #endif
 
@@ -40,7 +47,9 @@
 #include <KSyntaxHighlighting/Repository>
 #include <KSyntaxHighlighting/SyntaxHighlighter>
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
 
 #include "syntaxhighlighter.h"
 
@@ -54,6 +63,56 @@ enum SyntaxTextEdit_Config
     Config_LongLineEdge = (1U<<5),
     Config_ExternalUndoRedo = (1U<<6),
     Config_ShowFolding = (1U<<7),
+    Config_DebugRepaints = (1U<<8),
+    Config_FastLayout = (1U<<9),
+    Config_TrackLatency = (1U<<10),
+    Config_OverviewRuler = (1U<<11),
+};
+
+enum { MaxHistogramBuckets = 1024 };
+
+Q_LOGGING_CATEGORY(LatencyLog, "qtextpad.latency", QtInfoMsg)
+
+// Number of keystrokes kept for the rolling latency statistics
+static const int LatencySamples = 256;
+
+// Adds the elapsed time of its scope to a latency phase, if one is active
+class LatencyTimer
+{
+public:
+    explicit LatencyTimer(qint64 *phaseTime) : m_phaseTime(phaseTime)
+    {
+        if (m_phaseTime)
+            m_timer.start();
+    }
+
+    ~LatencyTimer()
+    {
+        if (m_phaseTime)
+            *m_phaseTime += m_timer.nsecsElapsed();
+    }
+
+private:
+    qint64 *m_phaseTime;
+    QElapsedTimer m_timer;
+};
+
+// Number of extra columns laid out on either side of the visible part of
+// a line painted with a column window
+static const int ColumnWindowMargin = 16;
+
+// Maximum number of blocks whose indent guide columns are cached.  This
+// bounds the work needed to shift the entries after an edit.
+static const int IndentGuideCacheSize = 4096;
+
+// Spacing (in characters) of the column checkpoints kept for large lines
+// containing tabs, which bounds how much of the line is scanned per paint
+static const int ColumnCheckpointInterval = 4096;
+
+enum FastFontStyle
+{
+    FastFont_Bold = (1<<0),
+    FastFont_Italic = (1<<1),
 };
 
 KSyntaxHighlighting::Repository *SyntaxTextEdit::syntaxRepo()
@@ -70,12 +129,25 @@ const KSyntaxHighlighting::Definition &SyntaxTextEdit::nullSyntax()
 
 SyntaxTextEdit::SyntaxTextEdit(QWidget *parent)
     : QPlainTextEdit(parent), m_tabCharSize(4), m_indentWidth(4),
-      m_longLineMarker(80), m_config(), m_indentationMode(),
-      m_originalFontSize()
+      m_longLineMarker(80), m_largeLineThreshold(10000), m_config(),
+      m_indentationMode(),
+      m_originalFontSize(), m_cursorBlockNumber(-1),
+      m_histogramBucketSize(1), m_foldedBlockCount(0), m_foldedRangesValid(false),
+      m_primaryCaret(0), m_syncingCarets(false), m_boxAnchorLine(-1),
+      m_boxAnchorColumn(0), m_boxLine(-1), m_boxColumn(0), m_boxDragging(false),
+      m_indentGuideBlockCount(1), m_fastLayoutCache(4096)
 {
     m_lineMargin = new LineMargin(this);
+    m_overviewRuler = new OverviewRuler(this);
+    m_overviewRuler->hide();
+    m_multiLineSearchTimer = new QTimer(this);
+    m_multiLineSearchTimer->setSingleShot(true);
+    m_multiLineSearchTimer->setInterval(250);
+    connect(m_multiLineSearchTimer, &QTimer::timeout,
+            this, &SyntaxTextEdit::updateLiveSearch);
     m_highlighter = new SyntaxHighlighter(document());
     m_highlighter->setTabWidth(m_tabCharSize);
+    m_highlighter->setLargeLineThreshold(m_largeLineThreshold);
 
     connect(this, &QPlainTextEdit::blockCountChanged,
             this, &SyntaxTextEdit::updateMargins);
@@ -83,8 +155,36 @@ SyntaxTextEdit::SyntaxTextEdit(QWidget *parent)
             this, &SyntaxTextEdit::updateLineNumbers);
     connect(this, &QPlainTextEdit::cursorPositionChanged,
             this, &SyntaxTextEdit::updateCursor);
-    connect(this, &QPlainTextEdit::textChanged,
-            this, &SyntaxTextEdit::updateLiveSearch);
+    connect(document(), &QTextDocument::contentsChange,
+            this, &SyntaxTextEdit::invalidateBlockCaches);
+    connect(document(), &QTextDocument::contentsChange,
+            this, &SyntaxTextEdit::updateSearchIndex);
+    connect(document(), &QTextDocument::contentsChange,
+            this, &SyntaxTextEdit::updateFoldedRanges);
+
+    // Moving the text cursor or editing the document other than through
+    // the carets goes back to a single caret
+    connect(this, &QPlainTextEdit::cursorPositionChanged, this, [this] {
+        if (!m_syncingCarets)
+            clearExtraCarets();
+    });
+    connect(document(), &QTextDocument::contentsChange, this, [this] {
+        if (!m_syncingCarets)
+            clearExtraCarets();
+    });
+
+    // Only key presses that edit or move something are latency samples
+    connect(this, &QPlainTextEdit::cursorPositionChanged, this, [this] {
+        m_latency.changed = true;
+    });
+    connect(document(), &QTextDocument::contentsChange, this, [this] {
+        m_latency.changed = true;
+    });
+
+    if (qEnvironmentVariableIsSet("QTEXTPAD_DEBUG_REPAINTS"))
+        m_config |= Config_DebugRepaints;
+    if (LatencyLog().isDebugEnabled())
+        setTrackTypingLatency(true);
 
     // Initialize default editor configuration
     QFont fixedFont = QFontDatabase::systemFont(QFontDatabase::FixedFont);
@@ -100,6 +200,13 @@ SyntaxTextEdit::SyntaxTextEdit(QWidget *parent)
 
 void SyntaxTextEdit::deleteSelection()
 {
+    if (hasMultipleCarets()) {
+        editCarets([](const Caret &caret) {
+            return CaretEdit{caret.start(), caret.end(), QString()};
+        });
+        return;
+    }
+
     QTextCursor cursor = textCursor();
     cursor.removeSelectedText();
     cursor.setVerticalMovementX(-1);
@@ -108,20 +215,12 @@ void SyntaxTextEdit::deleteSelection()
 
 void SyntaxTextEdit::deleteLines()
 {
+    int firstLine, lastLine;
+    selectedLines(&firstLine, &lastLine);
+    replaceLines(firstLine, lastLine, QStringList());
+
     QTextCursor cursor = textCursor();
-    if (cursor.hasSelection()) {
-        const int startPos = cursor.selectionStart();
-        const int endPos = cursor.selectionEnd();
-        cursor.setPosition(startPos);
-        cursor.movePosition(QTextCursor::StartOfBlock);
-        cursor.setPosition(endPos, QTextCursor::KeepAnchor);
-        if (!cursor.atBlockStart())
-            cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor);
-    } else {
-        cursor.movePosition(QTextCursor::StartOfBlock);
-        cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor);
-    }
-    cursor.removeSelectedText();
+    cursor.clearSelection();
     cursor.setVerticalMovementX(-1);
     setTextCursor(cursor);
 }
@@ -179,6 +278,28 @@ bool SyntaxTextEdit::showFolding() const
     return !!(m_config & Config_ShowFolding);
 }
 
+void SyntaxTextEdit::setShowOverviewRuler(bool show)
+{
+    if (show)
+        m_config |= Config_OverviewRuler;
+    else
+        m_config &= ~Config_OverviewRuler;
+    m_overviewRuler->setVisible(show);
+    updateMargins();
+}
+
+bool SyntaxTextEdit::showOverviewRuler() const
+{
+    return !!(m_config & Config_OverviewRuler);
+}
+
+int SyntaxTextEdit::overviewRulerWidth() const
+{
+    if (!showOverviewRuler())
+        return 0;
+    return qMax(8, fontMetrics().height() / 2);
+}
+
 void SyntaxTextEdit::setShowWhitespace(bool show)
 {
     QTextOption opt = document()->defaultTextOption();
@@ -187,6 +308,12 @@ void SyntaxTextEdit::setShowWhitespace(bool show)
     else
         opt.setFlags(opt.flags() & ~QTextOption::ShowTabsAndSpaces);
     document()->setDefaultTextOption(opt);
+
+    // The highlighter only formats whitespace when it will be shown
+    if (m_highlighter->showWhitespace() != show) {
+        m_highlighter->setShowWhitespace(show);
+        m_highlighter->rehighlight();
+    }
 }
 
 bool SyntaxTextEdit::showWhitespace() const
@@ -228,6 +355,8 @@ void SyntaxTextEdit::setTabWidth(int width)
 {
     m_tabCharSize = width;
     m_highlighter->setTabWidth(width);
+    m_indentGuideCache.clear();
+    m_largeLineCache.clear();
     updateTabMetrics();
 }
 
@@ -255,6 +384,21 @@ void SyntaxTextEdit::updateTabMetrics()
 
 void SyntaxTextEdit::updateTextMetrics()
 {
+    // Fast layout runs depend on the font and tab stops
+    m_fastFonts[0] = QRawFont();
+    m_fastLayoutCache.clear();
+
+    updateMarginPixmaps();
+    updateMargins();
+    updateTabMetrics();
+}
+
+void SyntaxTextEdit::updateMarginPixmaps()
+{
+    // The digit atlas depends on the font and theme, so it will be
+    // regenerated on the next margin repaint
+    m_digitAtlas.pixelRatio = 0;
+
     QFontMetricsF metrics(font());
     const qreal box = qMin(metrics.boundingRect(QLatin1Char('x')).width() * 1.5,
                            metrics.height());
@@ -288,8 +432,7 @@ void SyntaxTextEdit::updateTextMetrics()
     painter.drawPolygon(arrowClosed);
     painter.end();
 
-    updateMargins();
-    updateTabMetrics();
+    m_lineMargin->update();
 }
 
 void SyntaxTextEdit::setIndentationMode(int mode)
@@ -304,6 +447,22 @@ void SyntaxTextEdit::setIndentationMode(int mode)
         viewport()->update();
 }
 
+void SyntaxTextEdit::setLargeLineThreshold(int length)
+{
+    m_largeLineThreshold = qMax(0, length);
+    if (m_highlighter->largeLineThreshold() != m_largeLineThreshold) {
+        m_highlighter->setLargeLineThreshold(m_largeLineThreshold);
+        m_indentGuideCache.clear();
+        m_highlighter->rehighlight();
+    }
+}
+
+bool SyntaxTextEdit::isLargeLine(const QTextBlock &block) const
+{
+    // NOTE: block.length() includes the block separator
+    return m_largeLineThreshold > 0 && block.length() - 1 > m_largeLineThreshold;
+}
+
 int SyntaxTextEdit::textColumn(const QString &block, int positionInBlock) const
 {
     int column = 0;
@@ -316,6 +475,26 @@ int SyntaxTextEdit::textColumn(const QString &block, int positionInBlock) const
     return column;
 }
 
+int SyntaxTextEdit::textColumn(const QTextCursor &cursor) const
+{
+    const QTextBlock block = cursor.block();
+    if (!isLargeLine(block))
+        return textColumn(block.text(), cursor.positionInBlock());
+
+    // Don't copy a huge line just to expand its tabs.  Only the first part
+    // of the line is scanned, and the rest is counted one column per character.
+    const int positionInBlock = cursor.positionInBlock();
+    const int scanLength = qMin(positionInBlock, m_largeLineThreshold);
+    int column = 0;
+    for (int i = 0; i < scanLength; ++i) {
+        if (document()->characterAt(block.position() + i) == QLatin1Char('\t'))
+            column = column - (column % m_tabCharSize) + m_tabCharSize;
+        else
+            ++column;
+    }
+    return column + (positionInBlock - scanLength);
+}
+
 void SyntaxTextEdit::moveCursorTo(int line, int column)
 {
     const auto block = document()->findBlockByNumber(line - 1);
@@ -346,54 +525,58 @@ void SyntaxTextEdit::moveCursorTo(int line, int column)
     setTextCursor(cursor);
 }
 
-void SyntaxTextEdit::moveLines(QTextCursor::MoveOperation op)
+void SyntaxTextEdit::selectedLines(int *firstLine, int *lastLine) const
 {
-    auto cursor = textCursor();
+    const QTextCursor cursor = textCursor();
+    const QTextBlock firstBlock = document()->findBlock(cursor.selectionStart());
+    QTextBlock lastBlock = document()->findBlock(cursor.selectionEnd());
+    if (lastBlock != firstBlock && cursor.selectionEnd() == lastBlock.position())
+        lastBlock = lastBlock.previous();
+    *firstLine = firstBlock.blockNumber();
+    *lastLine = lastBlock.blockNumber();
+}
 
-    const int startPos = cursor.position();
-    const int endPos = cursor.anchor();
-    cursor.setPosition(qMin(startPos, endPos));
-    cursor.movePosition(QTextCursor::StartOfBlock);
-    cursor.setPosition(qMax(startPos, endPos), QTextCursor::KeepAnchor);
-    bool moveFromEndOfDocument = false;
-    bool moveToEndOfDocument = false;
-    if (startPos == endPos || !cursor.atBlockStart()) {
-        if (!cursor.movePosition(QTextCursor::NextBlock, QTextCursor::KeepAnchor)) {
-            moveFromEndOfDocument = true;
-            cursor.movePosition(QTextCursor::EndOfBlock, QTextCursor::KeepAnchor);
-        }
-    }
+void SyntaxTextEdit::moveLines(QTextCursor::MoveOperation op)
+{
+    int firstLine, lastLine;
+    selectedLines(&firstLine, &lastLine);
 
-    if (cursor.anchor() == 0 && op == QTextCursor::PreviousBlock)
-        return;
-    if (moveFromEndOfDocument && cursor.atEnd() && op == QTextCursor::NextBlock)
+    // The displaced line moves to the other side of the selected lines
+    QTextBlock displaced;
+    if (op == QTextCursor::PreviousBlock)
+        displaced = document()->findBlockByNumber(firstLine).previous();
+    else if (op == QTextCursor::NextBlock)
+        displaced = document()->findBlockByNumber(lastLine).next();
+    if (!displaced.isValid())
         return;
 
-    cursor.beginEditBlock();
-    const auto moveText = cursor.selectedText();
-    cursor.removeSelectedText();
-    const int positionStart = cursor.position();
-    if ((!cursor.movePosition(op) && op == QTextCursor::NextBlock) || cursor.atEnd()) {
-        cursor.movePosition(QTextCursor::End);
-        cursor.insertBlock();
-        moveToEndOfDocument = true;
+    QStringList lines;
+    lines.reserve(lastLine - firstLine + 2);
+    QTextBlock block = document()->findBlockByNumber(firstLine);
+    for (int line = firstLine; line <= lastLine; ++line) {
+        lines.append(block.text());
+        block = block.next();
     }
-    const int postionDelta = cursor.position() - positionStart;
 
-    cursor.insertText(moveText);
-    if (moveFromEndOfDocument)
-        cursor.insertBlock();
-    if (moveFromEndOfDocument || moveToEndOfDocument) {
-        // Remove the extra newline from the displaced line
-        cursor.movePosition(QTextCursor::End);
-        cursor.deletePreviousChar();
+    int positionDelta;
+    if (op == QTextCursor::PreviousBlock) {
+        lines.append(displaced.text());
+        positionDelta = -displaced.length();
+        --firstLine;
+    } else {
+        lines.prepend(displaced.text());
+        positionDelta = displaced.length();
+        ++lastLine;
     }
-    cursor.endEditBlock();
 
-    cursor.setPosition(endPos + postionDelta);
-    if (startPos != endPos)
-        cursor.setPosition(startPos + postionDelta, QTextCursor::KeepAnchor);
+    QTextCursor cursor = textCursor();
+    const int startPos = cursor.position();
+    const int endPos = cursor.anchor();
+    replaceLines(firstLine, lastLine, lines);
 
+    cursor.setPosition(endPos + positionDelta);
+    if (startPos != endPos)
+        cursor.setPosition(startPos + positionDelta, QTextCursor::KeepAnchor);
     setTextCursor(cursor);
 }
 
@@ -516,6 +699,94 @@ QTextCursor safeFindNext(QTextDocument *document, const Findable &search,
     return cursor;
 }
 
+const QRegularExpression &SyntaxTextEdit::SearchParams::compiledRegex() const
+{
+    auto options = caseSensitive ? QRegularExpression::NoPatternOption
+                                 : QRegularExpression::CaseInsensitiveOption;
+    if (multiLine)
+        options |= QRegularExpression::MultilineOption;
+    if (m_compiledRegex.pattern() != searchText || m_compiledRegex.patternOptions() != options) {
+        m_compiledRegex = QRegularExpression(searchText, options);
+        m_compiledRegex.optimize();
+    }
+    return m_compiledRegex;
+}
+
+const LiteralSearch &SyntaxTextEdit::SearchParams::literalSearch() const
+{
+    const auto cs = caseSensitive ? Qt::CaseSensitive : Qt::CaseInsensitive;
+    if (m_literalSearch.needle() != searchText || m_literalSearch.caseSensitivity() != cs
+            || m_literalSearch.wholeWord() != wholeWord)
+        m_literalSearch = LiteralSearch(searchText, cs, wholeWord);
+    return m_literalSearch;
+}
+
+bool SyntaxTextEdit::SearchParams::narrows(const SearchParams &previous) const
+{
+    // Whole word matches of the previous text are not (in general) at the
+    // same places as matches of the extended text.  The previous search
+    // also has to have found every occurrence, which is only guaranteed if
+    // its matches can't overlap.
+    if (regex || wholeWord || !previous.canBeNarrowed()
+            || caseSensitive != previous.caseSensitive)
+        return false;
+    return searchText.startsWith(previous.searchText);
+}
+
+bool SyntaxTextEdit::SearchParams::canBeNarrowed() const
+{
+    return !regex && !wholeWord && !searchText.isEmpty()
+            && !literalSearch().canOverlap();
+}
+
+static QTextCursor findLiteral(QTextDocument *document, const LiteralSearch &search,
+                               const QTextCursor &start, bool reverse)
+{
+    // Matches QTextDocument::find(): forward searches start after the
+    // selection, and backward searches find matches starting before it.
+    QTextBlock block;
+    int offset;
+    if (reverse) {
+        const int from = start.selectionStart() - 1;
+        if (from < 0)
+            return QTextCursor();
+        block = document->findBlock(from);
+        offset = from - block.position();
+    } else {
+        block = document->findBlock(start.selectionEnd());
+        offset = start.selectionEnd() - block.position();
+    }
+
+    while (block.isValid()) {
+        const QString text = block.text();
+        const int index = reverse ? search.lastIndexIn(text, offset)
+                                  : search.indexIn(text, offset);
+        if (index >= 0) {
+            QTextCursor cursor(document);
+            cursor.setPosition(block.position() + index);
+            cursor.setPosition(block.position() + index + search.length(),
+                               QTextCursor::KeepAnchor);
+            return cursor;
+        }
+        if (reverse) {
+            block = block.previous();
+            offset = block.length();
+        } else {
+            block = block.next();
+            offset = 0;
+        }
+    }
+    return QTextCursor();
+}
+
+template <typename Callback>
+static void findMultiLine(const QTextDocument *document, const SyntaxTextEdit::SearchParams &params,
+                          int start, int end, Callback found);
+static QTextCursor findMultiLineNext(QTextDocument *document,
+                                     const SyntaxTextEdit::SearchParams &params,
+                                     const QTextCursor &start, bool reverse,
+                                     QRegularExpressionMatch *regexMatch);
+
 QTextCursor SyntaxTextEdit::textSearch(const QTextCursor &start, const SearchParams &params,
                                        bool matchFirst, bool reverse,
                                        QRegularExpressionMatch *regexMatch)
@@ -528,11 +799,14 @@ QTextCursor SyntaxTextEdit::textSearch(const QTextCursor &start, const SearchPar
     if (reverse)
         flags |= QTextDocument::FindBackward;
 
-    if (params.regex) {
-        QRegularExpression::PatternOptions csOption = params.caseSensitive
-                                                    ? QRegularExpression::NoPatternOption
-                                                    : QRegularExpression::CaseInsensitiveOption;
-        const QRegularExpression re(params.searchText, csOption);
+    if (params.isMultiLine()) {
+        // As with literal searches, the empty matches which could equal
+        // the start cursor are never reported.
+        if (params.searchText.isEmpty())
+            return QTextCursor();
+        return findMultiLineNext(document(), params, start, reverse, regexMatch);
+    } else if (params.regex) {
+        const QRegularExpression &re = params.compiledRegex();
         QTextCursor cursor = safeFindNext(document(), re, start, flags, matchFirst);
         if (cursor.isNull())
             return cursor;
@@ -540,14 +814,22 @@ QTextCursor SyntaxTextEdit::textSearch(const QTextCursor &start, const SearchPar
             *regexMatch = re.match(cursor.selectedText());
         return cursor;
     } else {
-        return safeFindNext(document(), params.searchText, start, flags, matchFirst);
+        // A non-empty literal match never equals the start cursor, so there
+        // is nothing for matchFirst to skip.
+        if (params.searchText.isEmpty())
+            return QTextCursor();
+        return findLiteral(document(), params.literalSearch(), start, reverse);
     }
 }
 
 void SyntaxTextEdit::setLiveSearch(const SearchParams &params)
 {
+    const bool narrow = params.narrows(m_liveSearch);
     m_liveSearch = params;
-    updateLiveSearch();
+    if (narrow)
+        narrowLiveSearch();
+    else
+        updateLiveSearch();
 }
 
 void SyntaxTextEdit::clearLiveSearch()
@@ -558,30 +840,893 @@ void SyntaxTextEdit::clearLiveSearch()
 
 void SyntaxTextEdit::updateLiveSearch()
 {
-    if (m_searchResults.isEmpty() && m_liveSearch.searchText.isEmpty())
+    LatencyTimer latencyTimer(latencyPhase(Latency_LiveSearch));
+
+    m_multiLineSearchTimer->stop();
+    m_searchIndex.clear();
+    if (m_liveSearch.isMultiLine() && !m_liveSearch.searchText.isEmpty()) {
+        // Split each match into its parts on each line
+        m_searchIndex.resize(document()->blockCount());
+        QTextBlock block = document()->begin();
+        findMultiLine(document(), m_liveSearch, 0, document()->characterCount(),
+                      [&](int position, int length, const QRegularExpressionMatch &) {
+            while (block.position() + block.length() <= position)
+                block = block.next();
+            for (QTextBlock part = block; part.isValid() && part.position() < position + length;
+                 part = part.next()) {
+                const int partStart = qMax(position, part.position());
+                const int partEnd = qMin(position + length, part.position() + part.length() - 1);
+                if (partEnd > partStart) {
+                    m_searchIndex[part.blockNumber()].append(
+                            SearchMatch{partStart - part.position(), partEnd - partStart});
+                }
+            }
+            return true;
+        });
+    } else if (!m_liveSearch.searchText.isEmpty()) {
+        m_searchIndex.reserve(document()->blockCount());
+        for (QTextBlock block = document()->begin(); block.isValid(); block = block.next())
+            m_searchIndex.append(findLiveSearchMatches(block));
+    }
+    rebuildMatchHistogram();
+    viewport()->update();
+}
+
+void SyntaxTextEdit::narrowLiveSearch()
+{
+    LatencyTimer latencyTimer(latencyPhase(Latency_LiveSearch));
+
+    // Only the blocks which matched the previous search text are checked.
+    // Skipping candidates that overlap the last kept match gives the same
+    // result as searching the block again.
+    const LiteralSearch &search = m_liveSearch.literalSearch();
+    const int length = search.length();
+    QTextBlock block = document()->begin();
+    for (int i = 0; i < m_searchIndex.size() && block.isValid(); ++i, block = block.next()) {
+        if (m_searchIndex.at(i).isEmpty())
+            continue;
+
+        const QString text = block.text();
+        QVector<SearchMatch> &matches = m_searchIndex[i];
+        int kept = 0;
+        int nextStart = 0;
+        for (int j = 0; j < matches.size(); ++j) {
+            const int start = matches.at(j).start;
+            if (start >= nextStart && search.matchesAt(text, start)) {
+                matches[kept++] = SearchMatch{start, length};
+                nextStart = start + length;
+            }
+        }
+        matches.resize(kept);
+    }
+    rebuildMatchHistogram();
+    viewport()->update();
+}
+
+void SyntaxTextEdit::rebuildMatchHistogram(int firstBlock)
+{
+    // Group blocks so the histogram never has more buckets than a
+    // (very tall) ruler has pixels
+    const int blockCount = m_searchIndex.size();
+    const int bucketSize = qMax(1, (blockCount + MaxHistogramBuckets - 1) / MaxHistogramBuckets);
+    const int bucketCount = (blockCount + bucketSize - 1) / bucketSize;
+
+    // Buckets before firstBlock's are unchanged, unless the bucket size has
+    // changed, which moves every bucket boundary
+    int firstBucket = 0;
+    if (bucketSize == m_histogramBucketSize) {
+        firstBucket = qMin(firstBlock / bucketSize, int(m_matchHistogram.size()));
+        m_matchHistogram.resize(bucketCount);
+        std::fill(m_matchHistogram.begin() + qMin(firstBucket, bucketCount),
+                  m_matchHistogram.end(), 0);
+    } else {
+        m_histogramBucketSize = bucketSize;
+        m_matchHistogram.fill(0, bucketCount);
+    }
+    for (int i = firstBucket * bucketSize; i < blockCount; ++i)
+        m_matchHistogram[i / bucketSize] += m_searchIndex.at(i).size();
+    m_overviewRuler->update();
+}
+
+static bool isWholeWord(const QString &text, int start, int end)
+{
+    // Same word boundary rules as QTextDocument::find()
+    return (start == 0 || !text.at(start - 1).isLetterOrNumber())
+            && (end == text.size() || !text.at(end).isLetterOrNumber());
+}
+
+// Calls found(start, length, regexMatch) for each match in a block's text,
+// until it returns false.  regexMatch is only valid for regex searches.
+template <typename Callback>
+static void findInBlockText(const QString &blockText, const SyntaxTextEdit::SearchParams &params,
+                            Callback found)
+{
+    if (params.regex) {
+        QString text = blockText;
+        text.replace(QChar::Nbsp, QLatin1Char(' '));
+        auto iter = params.compiledRegex().globalMatch(text);
+        while (iter.hasNext()) {
+            const auto match = iter.next();
+            const int start = match.capturedStart();
+            const int length = match.capturedLength();
+            if (length == 0)
+                continue;
+            if (params.wholeWord && !isWholeWord(text, start, start + length))
+                continue;
+            if (!found(start, length, match))
+                return;
+        }
+    } else {
+        const QRegularExpressionMatch noMatch;
+        const LiteralSearch &search = params.literalSearch();
+        const int length = search.length();
+        int start = search.indexIn(blockText);
+        while (start >= 0) {
+            if (!found(start, length, noMatch))
+                return;
+            start = search.indexIn(blockText, start + length);
+        }
+    }
+}
+
+/* Multi-line searches assemble the document text, with '\n' between blocks,
+ * in chunks of whole blocks so that memory use stays bounded on large files.
+ * Since block separators are a single position in the document, an offset
+ * in a chunk maps to a document position by adding the position of the
+ * chunk's first block.  Consecutive chunks overlap by MultiLineOverlap, and
+ * each chunk only reports the matches starting before the overlap, so a
+ * match is only cut short if it extends further than that into the overlap.
+ */
+static const int MultiLineChunkSize = 4 * 1024 * 1024;
+static const int MultiLineOverlap = 256 * 1024;
+
+// Calls found(position, length, regexMatch) for each match between the
+// start and end positions, until it returns false
+template <typename Callback>
+static void findMultiLine(const QTextDocument *document, const SyntaxTextEdit::SearchParams &params,
+                          int start, int end, Callback found)
+{
+    QString chunk;
+    QVector<int> blockOffsets;
+    QTextBlock block = document->findBlock(start);
+    while (block.isValid() && block.position() <= end) {
+        const int chunkPosition = block.position();
+        chunk.clear();
+        blockOffsets.clear();
+        QTextBlock next = block;
+        while (next.isValid() && chunk.size() < MultiLineChunkSize) {
+            if (!blockOffsets.isEmpty())
+                chunk.append(QLatin1Char('\n'));
+            blockOffsets.append(int(chunk.size()));
+            chunk.append(next.text());
+            next = next.next();
+        }
+
+        // The next chunk starts at the first block inside the overlap
+        int overlapStart = std::numeric_limits<int>::max();
+        QTextBlock nextChunk = next;
+        if (next.isValid() && next.position() <= end) {
+            auto overlap = std::lower_bound(blockOffsets.cbegin() + 1, blockOffsets.cend(),
+                                            int(chunk.size()) - MultiLineOverlap);
+            if (overlap != blockOffsets.cend()) {
+                overlapStart = *overlap;
+                nextChunk = document->findBlock(chunkPosition + overlapStart);
+            }
+        }
+
+        bool stopped = false;
+        findInBlockText(chunk, params, [&](int matchStart, int length,
+                                           const QRegularExpressionMatch &match) {
+            if (matchStart >= overlapStart)
+                return false;
+            const int position = chunkPosition + matchStart;
+            if (position > end) {
+                stopped = true;
+                return false;
+            }
+            if (position < start || position + length > end)
+                return true;
+            if (!found(position, length, match)) {
+                stopped = true;
+                return false;
+            }
+            return true;
+        });
+        if (stopped)
+            return;
+        block = nextChunk;
+    }
+}
+
+static QTextCursor findMultiLineNext(QTextDocument *document,
+                                     const SyntaxTextEdit::SearchParams &params,
+                                     const QTextCursor &start, bool reverse,
+                                     QRegularExpressionMatch *regexMatch)
+{
+    int matchPosition = -1, matchLength = 0;
+    QRegularExpressionMatch foundMatch;
+    const int documentEnd = document->characterCount();
+    if (reverse) {
+        // Keep the last match starting before the selection.  Rather than
+        // scanning from the start of the document every time, scan windows
+        // of growing size backward from the selection until one has a match.
+        int before = start.selectionStart();
+        int window = MultiLineChunkSize;
+        // Each window ends where the previous one started, plus enough of
+        // an overlap for the matches which cross that point.
+        while (matchPosition < 0 && before > 0) {
+            const int windowStart = qMax(0, before - window);
+            const int windowEnd = int(qMin(qint64(before) + MultiLineOverlap, qint64(documentEnd)));
+            findMultiLine(document, params, windowStart, windowEnd,
+                          [&](int position, int length, const QRegularExpressionMatch &match) {
+                if (position >= before)
+                    return false;
+                matchPosition = position;
+                matchLength = length;
+                foundMatch = match;
+                return true;
+            });
+            before = windowStart;
+            window = int(qMin(qint64(window) * 2, qint64(std::numeric_limits<int>::max())));
+        }
+    } else {
+        findMultiLine(document, params, start.selectionEnd(), documentEnd,
+                      [&](int position, int length, const QRegularExpressionMatch &match) {
+            matchPosition = position;
+            matchLength = length;
+            foundMatch = match;
+            return false;
+        });
+    }
+
+    if (matchPosition < 0)
+        return QTextCursor();
+    QTextCursor cursor(document);
+    cursor.setPosition(matchPosition);
+    cursor.setPosition(matchPosition + matchLength, QTextCursor::KeepAnchor);
+    if (regexMatch)
+        *regexMatch = foundMatch;
+    return cursor;
+}
+
+void SyntaxTextEdit::findInText(const QString &text, const SearchParams &params,
+                                const MatchCallback &found)
+{
+    if (params.searchText.isEmpty())
         return;
+    findInBlockText(text, params, [&found](int start, int length, const QRegularExpressionMatch &) {
+        return found(start, length);
+    });
+}
 
-    m_searchResults.clear();
-    if (!m_liveSearch.searchText.isEmpty()) {
-        auto searchCursor = textCursor();
-        searchCursor.movePosition(QTextCursor::Start);
-        searchCursor = textSearch(searchCursor, m_liveSearch, true);
-        while (!searchCursor.isNull()) {
-            if (searchCursor.hasSelection()) {
-                QTextEdit::ExtraSelection selection;
-                selection.format.setBackground(m_searchBg);
-                selection.cursor = searchCursor;
-                m_searchResults.append(selection);
+QVector<SyntaxTextEdit::SearchMatch> SyntaxTextEdit::findLiveSearchMatches(const QTextBlock &block) const
+{
+    QVector<SearchMatch> matches;
+    findInBlockText(block.text(), m_liveSearch,
+                    [&matches](int start, int length, const QRegularExpressionMatch &) {
+        matches.append(SearchMatch{start, length});
+        return true;
+    });
+    return matches;
+}
+
+QVector<SyntaxTextEdit::BlockReplacement>
+SyntaxTextEdit::findReplacements(const SearchParams &params, int start, int end,
+                                 const Replacer &replace, int *matchCount) const
+{
+    QVector<BlockReplacement> replacements;
+    int matches = 0;
+    if (params.searchText.isEmpty()) {
+        if (matchCount)
+            *matchCount = 0;
+        return replacements;
+    }
+
+    if (params.isMultiLine()) {
+        // Matches may span blocks, so each one is replaced separately
+        findMultiLine(document(), params, start, end,
+                      [&](int position, int length, const QRegularExpressionMatch &match) {
+            replacements.append(BlockReplacement{position, length, replace(match)});
+            ++matches;
+            return true;
+        });
+        if (matchCount)
+            *matchCount = matches;
+        return replacements;
+    }
+
+    for (QTextBlock block = document()->findBlock(start); block.isValid(); block = block.next()) {
+        const int blockStart = block.position();
+        if (blockStart > end)
+            break;
+
+        // Build the replaced text of the block in one pass
+        const QString text = block.text();
+        QString newText;
+        int copied = 0;
+        findInBlockText(text, params, [&](int matchStart, int length,
+                                          const QRegularExpressionMatch &match) {
+            if (blockStart + matchStart < start || blockStart + matchStart + length > end)
+                return true;
+            newText.append(QStringView(text).mid(copied, matchStart - copied));
+            newText.append(replace(match));
+            copied = matchStart + length;
+            ++matches;
+            return true;
+        });
+        if (copied == 0)
+            continue;
+        newText.append(QStringView(text).mid(copied));
+        replacements.append(BlockReplacement{blockStart, int(text.size()), newText});
+    }
+
+    if (matchCount)
+        *matchCount = matches;
+    return replacements;
+}
+
+void SyntaxTextEdit::applyReplacements(const QVector<BlockReplacement> &replacements)
+{
+    if (replacements.isEmpty())
+        return;
+
+    // A single edit block makes this one undo step, and the document only
+    // reports one contentsChange covering all of the modified blocks.
+    QTextCursor cursor(document());
+    cursor.beginEditBlock();
+    for (auto iter = replacements.crbegin(); iter != replacements.crend(); ++iter) {
+        // Working backwards keeps the earlier positions valid
+        cursor.setPosition(iter->position);
+        cursor.setPosition(iter->position + iter->length, QTextCursor::KeepAnchor);
+        cursor.insertText(iter->text);
+        Q_EMIT partialEdit(iter->position, iter->length, cursor.position() - iter->position);
+    }
+    cursor.endEditBlock();
+}
+
+void SyntaxTextEdit::replaceLines(int firstLine, int lastLine, const QStringList &newLines)
+{
+    replaceLineText(firstLine, lastLine, newLines.join(QLatin1Char('\n')), newLines.isEmpty());
+}
+
+void SyntaxTextEdit::replaceLines(int firstLine, int lastLine, const QString &newText)
+{
+    replaceLineText(firstLine, lastLine, newText, false);
+}
+
+void SyntaxTextEdit::replaceLineText(int firstLine, int lastLine, const QString &newText,
+                                     bool removeLines)
+{
+    const QTextBlock firstBlock = document()->findBlockByNumber(firstLine);
+    const QTextBlock lastBlock = document()->findBlockByNumber(lastLine);
+    if (!firstBlock.isValid() || !lastBlock.isValid() || lastLine < firstLine)
+        return;
+
+    int start = firstBlock.position();
+    int end = lastBlock.position() + lastBlock.length() - 1;
+    QString oldText;
+    oldText.reserve(end - start + 1);
+    for (QTextBlock block = firstBlock; ; block = block.next()) {
+        oldText.append(block.text());
+        if (block == lastBlock)
+            break;
+        oldText.append(QLatin1Char('\n'));
+    }
+
+    if (removeLines) {
+        if (lastBlock.next().isValid()) {
+            oldText.append(QLatin1Char('\n'));
+            ++end;
+        } else if (firstBlock.previous().isValid()) {
+            oldText.prepend(QLatin1Char('\n'));
+            --start;
+        }
+    }
+    if (oldText == newText)
+        return;
+
+    // Trim the common prefix and suffix (without splitting any surrogate
+    // pairs), so the rest of the lines and their highlighting are untouched.
+    const int common = qMin(int(oldText.size()), int(newText.size()));
+    int prefix = 0;
+    while (prefix < common && oldText.at(prefix) == newText.at(prefix))
+        ++prefix;
+    if (prefix > 0 && oldText.at(prefix - 1).isHighSurrogate())
+        --prefix;
+    int suffix = 0;
+    while (suffix < common - prefix
+           && oldText.at(oldText.size() - suffix - 1) == newText.at(newText.size() - suffix - 1))
+        ++suffix;
+    if (suffix > 0 && oldText.at(oldText.size() - suffix).isLowSurrogate())
+        --suffix;
+
+    QTextCursor cursor(document());
+    cursor.beginEditBlock();
+    cursor.setPosition(start + prefix);
+    cursor.setPosition(end - suffix, QTextCursor::KeepAnchor);
+    cursor.insertText(newText.mid(prefix, newText.size() - prefix - suffix));
+    cursor.endEditBlock();
+}
+
+static int previousCharacter(const QTextDocument *document, int position)
+{
+    if (position <= 0)
+        return 0;
+    --position;
+    if (position > 0 && document->characterAt(position).isLowSurrogate()
+            && document->characterAt(position - 1).isHighSurrogate())
+        --position;
+    return position;
+}
+
+static int nextCharacter(const QTextDocument *document, int position)
+{
+    const int last = document->characterCount() - 1;
+    if (position >= last)
+        return last;
+    ++position;
+    if (position < last && document->characterAt(position).isLowSurrogate()
+            && document->characterAt(position - 1).isHighSurrogate())
+        ++position;
+    return position;
+}
+
+void SyntaxTextEdit::setCarets(QVector<Caret> carets, int primary)
+{
+    const Caret primaryCaret = carets.at(primary);
+    std::sort(carets.begin(), carets.end(), [](const Caret &left, const Caret &right) {
+        return left.start() < right.start()
+                || (left.start() == right.start() && left.end() < right.end());
+    });
+
+    // Carets which now overlap (e.g. after deleting up to the previous
+    // caret) are merged into one
+    QVector<Caret> merged;
+    merged.reserve(carets.size());
+    for (const Caret &caret : std::as_const(carets)) {
+        if (!merged.isEmpty()) {
+            Caret &last = merged.last();
+            if (caret.start() < last.end() || caret.start() == last.start()) {
+                const int start = last.start();
+                const int end = qMax(last.end(), caret.end());
+                last = (last.anchor <= last.position) ? Caret{start, end} : Caret{end, start};
+                continue;
             }
-            searchCursor = textSearch(searchCursor, m_liveSearch, false);
         }
+        merged.append(caret);
+    }
+
+    auto iter = std::lower_bound(merged.cbegin(), merged.cend(), primaryCaret.position,
+                                 [](const Caret &caret, int position) {
+        return caret.end() < position;
+    });
+    const int primaryIndex = (iter == merged.cend()) ? int(merged.size()) - 1
+                                                     : int(iter - merged.cbegin());
+
+    QScopedValueRollback<bool> syncing(m_syncingCarets, true);
+    const Caret textCaret = merged.at(primaryIndex);
+    if (merged.size() > 1) {
+        m_carets = merged;
+        m_primaryCaret = primaryIndex;
+    } else {
+        m_carets.clear();
+    }
+
+    QTextCursor cursor = textCursor();
+    cursor.setPosition(textCaret.anchor);
+    cursor.setPosition(textCaret.position, QTextCursor::KeepAnchor);
+    setTextCursor(cursor);
+    viewport()->update();
+}
+
+void SyntaxTextEdit::clearExtraCarets()
+{
+    m_boxAnchorLine = -1;
+    m_boxLine = -1;
+    if (m_carets.isEmpty())
+        return;
+
+    m_carets.clear();
+    viewport()->update();
+}
+
+void SyntaxTextEdit::addCaretAbove()
+{
+    addCaret(-1);
+}
+
+void SyntaxTextEdit::addCaretBelow()
+{
+    addCaret(1);
+}
+
+void SyntaxTextEdit::addCaret(int lineDelta)
+{
+    QVector<Caret> carets = m_carets;
+    if (carets.isEmpty()) {
+        const QTextCursor cursor = textCursor();
+        carets.append(Caret{cursor.anchor(), cursor.position()});
+    }
+
+    // The new caret goes in the same column as the first (or last) caret
+    const Caret &edge = (lineDelta < 0) ? carets.first() : carets.last();
+    QTextBlock block = document()->findBlock(edge.position);
+    const int column = textColumn(block.text(), edge.position - block.position());
+    block = (lineDelta < 0) ? block.previous() : block.next();
+    if (!block.isValid())
+        return;
+
+    const int position = block.position() + positionForColumn(block.text(), column);
+    carets.append(Caret{position, position});
+    setCarets(carets, int(carets.size()) - 1);
+}
+
+void SyntaxTextEdit::setRectangularSelection(int anchorLine, int anchorColumn,
+                                             int line, int column)
+{
+    const int firstLine = qMin(anchorLine, line);
+    const int lastLine = qMax(anchorLine, line);
+    QVector<Caret> carets;
+    carets.reserve(lastLine - firstLine + 1);
+    QTextBlock block = document()->findBlockByNumber(firstLine);
+    for (int i = firstLine; i <= lastLine && block.isValid(); ++i) {
+        const QString blockText = block.text();
+        carets.append(Caret{block.position() + positionForColumn(blockText, anchorColumn),
+                            block.position() + positionForColumn(blockText, column)});
+        block = block.next();
+    }
+    if (carets.isEmpty())
+        return;
+
+    setCarets(carets, (line >= anchorLine) ? int(carets.size()) - 1 : 0);
+    m_boxAnchorLine = anchorLine;
+    m_boxAnchorColumn = anchorColumn;
+    m_boxLine = line;
+    m_boxColumn = column;
+}
+
+void SyntaxTextEdit::extendRectangularSelection(int lineDelta, int columnDelta)
+{
+    if (m_boxAnchorLine < 0) {
+        const QTextCursor cursor = textCursor();
+        m_boxAnchorLine = m_boxLine = cursor.blockNumber();
+        m_boxAnchorColumn = m_boxColumn = textColumn(cursor);
+    }
+    setRectangularSelection(m_boxAnchorLine, m_boxAnchorColumn,
+                            qBound(0, m_boxLine + lineDelta, blockCount() - 1),
+                            qMax(0, m_boxColumn + columnDelta));
+}
+
+void SyntaxTextEdit::rectangularPositionAt(const QPoint &pos, int *line, int *column) const
+{
+    const QTextCursor cursor = cursorForPosition(pos);
+    *line = cursor.blockNumber();
+    *column = textColumn(cursor);
+    if (cursor.atBlockEnd()) {
+        // Allow the selection to extend past the end of shorter lines
+        const qreal spaceWidth = QFontMetricsF(font()).horizontalAdvance(QLatin1Char(' '));
+        const qreal extra = pos.x() - cursorRect(cursor).left();
+        if (extra > 0 && spaceWidth > 0)
+            *column += qRound(extra / spaceWidth);
+    }
+}
+
+int SyntaxTextEdit::positionForColumn(const QString &blockText, int column) const
+{
+    int textColumn = 0;
+    for (int i = 0; i < blockText.size(); ++i) {
+        if (textColumn >= column)
+            return i;
+        if (blockText.at(i) == QLatin1Char('\t'))
+            textColumn = textColumn - (textColumn % m_tabCharSize) + m_tabCharSize;
+        else
+            ++textColumn;
+    }
+    return int(blockText.size());
+}
+
+void SyntaxTextEdit::editCarets(const std::function<CaretEdit (const Caret &)> &edit)
+{
+    if (m_carets.isEmpty())
+        return;
+
+    QVector<CaretEdit> edits;
+    edits.reserve(m_carets.size());
+    int previousEnd = 0;
+    for (const Caret &caret : std::as_const(m_carets)) {
+        CaretEdit caretEdit = edit(caret);
+        // Deleting at adjacent carets mustn't remove the same text twice
+        caretEdit.start = qMax(caretEdit.start, previousEnd);
+        caretEdit.end = qMax(caretEdit.end, caretEdit.start);
+        previousEnd = caretEdit.end;
+        edits.append(caretEdit);
+    }
+
+    // As in applyReplacements(), a single edit block makes this one undo
+    // step and one contentsChange, and working backwards keeps the earlier
+    // positions valid.
+    QScopedValueRollback<bool> syncing(m_syncingCarets, true);
+    QTextCursor cursor(document());
+    cursor.beginEditBlock();
+    for (auto iter = edits.crbegin(); iter != edits.crend(); ++iter) {
+        if (iter->start == iter->end && iter->text.isEmpty())
+            continue;
+        cursor.setPosition(iter->start);
+        cursor.setPosition(iter->end, QTextCursor::KeepAnchor);
+        cursor.insertText(iter->text);
+        Q_EMIT partialEdit(iter->start, iter->end - iter->start, cursor.position() - iter->start);
+    }
+    cursor.endEditBlock();
+
+    // Each caret ends up after its own inserted text, shifted by the edits
+    // before it
+    QVector<Caret> carets;
+    carets.reserve(edits.size());
+    int shift = 0;
+    for (const CaretEdit &caretEdit : std::as_const(edits)) {
+        const int position = caretEdit.start + shift + int(caretEdit.text.size());
+        carets.append(Caret{position, position});
+        shift += int(caretEdit.text.size()) - (caretEdit.end - caretEdit.start);
+    }
+    setCarets(carets, m_primaryCaret);
+}
+
+void SyntaxTextEdit::moveCarets(const std::function<Caret (const Caret &)> &move)
+{
+    QVector<Caret> carets;
+    carets.reserve(m_carets.size());
+    for (const Caret &caret : std::as_const(m_carets))
+        carets.append(move(caret));
+    setCarets(carets, m_primaryCaret);
+}
+
+QString SyntaxTextEdit::caretSelectedText() const
+{
+    // One line per caret, so pasting it back into the same number of
+    // carets gives each caret its own text
+    QStringList parts;
+    parts.reserve(m_carets.size());
+    QTextCursor cursor(document());
+    for (const Caret &caret : m_carets) {
+        cursor.setPosition(caret.anchor);
+        cursor.setPosition(caret.position, QTextCursor::KeepAnchor);
+        QString text = cursor.selectedText();
+        text.replace(QChar::ParagraphSeparator, QLatin1Char('\n'));
+        parts.append(text);
+    }
+    return parts.join(QLatin1Char('\n'));
+}
+
+bool SyntaxTextEdit::caretKeyPressEvent(QKeyEvent *e)
+{
+    switch (e->key()) {
+    case Qt::Key_Shift:
+    case Qt::Key_Control:
+    case Qt::Key_Alt:
+    case Qt::Key_AltGr:
+    case Qt::Key_Meta:
+        return false;
+    case Qt::Key_Escape:
+        clearExtraCarets();
+        return true;
+    default:
+        break;
+    }
+
+    if (e->matches(QKeySequence::Cut)) {
+        cutLines();
+        return true;
+    }
+    if (e->matches(QKeySequence::Copy)) {
+        copyLines();
+        return true;
+    }
+    if (e->matches(QKeySequence::Paste)) {
+        paste();
+        return true;
+    }
+
+    const bool backspace = e->matches(QKeySequence::Backspace)
+            || (e->key() == Qt::Key_Backspace && (e->modifiers() & ~Qt::ShiftModifier) == 0);
+    if (backspace || e->matches(QKeySequence::Delete)) {
+        const QTextDocument *doc = document();
+        editCarets([doc, backspace](const Caret &caret) {
+            if (caret.anchor != caret.position)
+                return CaretEdit{caret.start(), caret.end(), QString()};
+            if (backspace)
+                return CaretEdit{previousCharacter(doc, caret.position), caret.position, QString()};
+            return CaretEdit{caret.position, nextCharacter(doc, caret.position), QString()};
+        });
+        return true;
+    }
+
+    const auto modifiers = e->modifiers() & ~Qt::KeypadModifier;
+    const bool select = (modifiers == Qt::ShiftModifier);
+    if (modifiers == Qt::NoModifier || select) {
+        const QTextDocument *doc = document();
+        switch (e->key()) {
+        case Qt::Key_Left:
+        case Qt::Key_Right:
+        case Qt::Key_Home:
+        case Qt::Key_End:
+            moveCarets([doc, select, key = e->key()](const Caret &caret) {
+                int position;
+                if (key == Qt::Key_Left) {
+                    position = (!select && caret.anchor != caret.position)
+                             ? caret.start() : previousCharacter(doc, caret.position);
+                } else if (key == Qt::Key_Right) {
+                    position = (!select && caret.anchor != caret.position)
+                             ? caret.end() : nextCharacter(doc, caret.position);
+                } else {
+                    const QTextBlock block = doc->findBlock(caret.position);
+                    position = (key == Qt::Key_Home) ? block.position()
+                                                     : block.position() + block.length() - 1;
+                }
+                return Caret{select ? caret.anchor : position, position};
+            });
+            return true;
+        case Qt::Key_Return:
+        case Qt::Key_Enter:
+            editCarets([](const Caret &caret) {
+                return CaretEdit{caret.start(), caret.end(), QStringLiteral("\n")};
+            });
+            return true;
+        case Qt::Key_Tab:
+            editCarets([this](const Caret &caret) {
+                if (m_indentationMode == IndentTabs)
+                    return CaretEdit{caret.start(), caret.end(), QStringLiteral("\t")};
+                const QTextBlock block = document()->findBlock(caret.start());
+                const int column = textColumn(block.text(), caret.start() - block.position());
+                return CaretEdit{caret.start(), caret.end(),
+                                 QString(m_indentWidth - (column % m_indentWidth), QLatin1Char(' '))};
+            });
+            return true;
+        default:
+            break;
+        }
+    }
+
+    const QString text = e->text();
+    if (!text.isEmpty() && text.at(0).isPrint()
+            && (modifiers & (Qt::ControlModifier | Qt::MetaModifier)) == 0) {
+        editCarets([&text](const Caret &caret) {
+            return CaretEdit{caret.start(), caret.end(), text};
+        });
+        return true;
+    }
+
+    // Anything else (e.g. moving up or down) continues with just the text cursor
+    clearExtraCarets();
+    return false;
+}
+
+void SyntaxTextEdit::insertFromMimeData(const QMimeData *source)
+{
+    if (!hasMultipleCarets() || !source->hasText()) {
+        QPlainTextEdit::insertFromMimeData(source);
+        return;
+    }
+
+    QString text = source->text();
+    text.replace(QLatin1String("\r\n"), QLatin1String("\n"));
+    text.replace(QLatin1Char('\r'), QLatin1Char('\n'));
+
+    // Text with one line per caret is split between them, otherwise every
+    // caret gets all of it
+    QStringList lines = text.split(QLatin1Char('\n'));
+    if (lines.size() == m_carets.size() + 1 && lines.last().isEmpty())
+        lines.removeLast();
+    const bool distribute = (lines.size() == m_carets.size());
+    int index = 0;
+    editCarets([&](const Caret &caret) {
+        return CaretEdit{caret.start(), caret.end(), distribute ? lines.at(index++) : text};
+    });
+}
+
+void SyntaxTextEdit::mousePressEvent(QMouseEvent *e)
+{
+    // Alt+drag makes a rectangular selection
+    if (e->button() == Qt::LeftButton && (e->modifiers() & Qt::AltModifier)) {
+        int line, column;
+        rectangularPositionAt(e->pos(), &line, &column);
+        setRectangularSelection(line, column, line, column);
+        m_boxDragging = true;
+        e->accept();
+        return;
     }
-    updateExtraSelections();
+
+    clearExtraCarets();
+    QPlainTextEdit::mousePressEvent(e);
 }
 
-void SyntaxTextEdit::updateExtraSelections()
+void SyntaxTextEdit::mouseMoveEvent(QMouseEvent *e)
 {
-    setExtraSelections(m_braceMatch + m_searchResults);
+    if (m_boxDragging && (e->buttons() & Qt::LeftButton)) {
+        int line, column;
+        rectangularPositionAt(e->pos(), &line, &column);
+        setRectangularSelection(m_boxAnchorLine, m_boxAnchorColumn, line, column);
+        e->accept();
+        return;
+    }
+    QPlainTextEdit::mouseMoveEvent(e);
+}
+
+void SyntaxTextEdit::mouseReleaseEvent(QMouseEvent *e)
+{
+    if (m_boxDragging && e->button() == Qt::LeftButton) {
+        m_boxDragging = false;
+        e->accept();
+        return;
+    }
+    QPlainTextEdit::mouseReleaseEvent(e);
+}
+
+void SyntaxTextEdit::updateSearchIndex(int position, int, int added)
+{
+    if (m_liveSearch.searchText.isEmpty())
+        return;
+
+    LatencyTimer latencyTimer(latencyPhase(Latency_LiveSearch));
+
+    // Only the blocks touched by the change need to be rescanned.  Any
+    // blocks that were added or removed shift the rest of the index.
+    const int oldBlockCount = m_searchIndex.size();
+    const int blockDelta = document()->blockCount() - oldBlockCount;
+    const QTextBlock firstBlock = document()->findBlock(position);
+    QTextBlock lastBlock = document()->findBlock(position + added);
+    if (!lastBlock.isValid())
+        lastBlock = document()->lastBlock();
+    const int first = firstBlock.blockNumber();
+    const int last = lastBlock.blockNumber();
+    const int oldLast = last - blockDelta;
+    if (first < 0 || oldLast < first - 1 || oldLast >= oldBlockCount) {
+        // The index is out of sync with the document; rebuild it
+        updateLiveSearch();
+        return;
+    }
+
+    if (blockDelta == 0) {
+        for (int i = first; i <= oldLast; ++i)
+            m_matchHistogram[i / m_histogramBucketSize] -= m_searchIndex.at(i).size();
+    }
+    // An edit can change multi-line matches outside of the changed blocks.
+    // Until the index is rebuilt, the changed blocks have no matches and
+    // the rest of the index just shifts with the edit.
+    const bool multiLine = m_liveSearch.isMultiLine();
+    QVector<QVector<SearchMatch>> changed;
+    if (multiLine) {
+        changed.resize(last - first + 1);
+        m_multiLineSearchTimer->start();
+    } else {
+        changed.reserve(last - first + 1);
+        for (QTextBlock block = firstBlock; block.isValid(); block = block.next()) {
+            changed.append(findLiveSearchMatches(block));
+            if (block == lastBlock)
+                break;
+        }
+    }
+
+    // Resize the changed range in one step, rather than shifting the rest
+    // of the index once for every inserted or removed line
+    const int oldCount = oldLast - first + 1;
+    const int newCount = changed.size();
+    if (newCount > oldCount)
+        m_searchIndex.insert(first + oldCount, newCount - oldCount, QVector<SearchMatch>());
+    else if (newCount < oldCount)
+        m_searchIndex.remove(first + newCount, oldCount - newCount);
+    for (int i = 0; i < newCount; ++i)
+        m_searchIndex[first + i] = std::move(changed[i]);
+
+    if (blockDelta == 0) {
+        for (int i = first; i <= last; ++i)
+            m_matchHistogram[i / m_histogramBucketSize] += m_searchIndex.at(i).size();
+        m_overviewRuler->update();
+    } else {
+        // Added or removed lines shift the bucket boundaries after them
+        rebuildMatchHistogram(first);
+    }
+
+    viewport()->update();
 }
 
 void SyntaxTextEdit::setMatchBraces(bool match)
@@ -611,6 +1756,21 @@ bool SyntaxTextEdit::externalUndoRedo() const
     return !!(m_config & Config_ExternalUndoRedo);
 }
 
+void SyntaxTextEdit::setDebugRepaints(bool enable)
+{
+    if (enable)
+        m_config |= Config_DebugRepaints;
+    else
+        m_config &= ~Config_DebugRepaints;
+    viewport()->update();
+    m_lineMargin->update();
+}
+
+bool SyntaxTextEdit::debugRepaints() const
+{
+    return !!(m_config & Config_DebugRepaints);
+}
+
 void SyntaxTextEdit::setDefaultFont(const QFont &font)
 {
     // Note:  This will reset the zoom factor to 100%
@@ -657,13 +1817,13 @@ void SyntaxTextEdit::setTheme(const KSyntaxHighlighting::Theme &theme)
     m_editorBg = theme.editorColor(KSyntaxHighlighting::Theme::BackgroundColor);
 #endif
 
+    // The highlighter only needs to re-resolve its formats for the new theme,
+    // which is done for the visible blocks in paintEvent().
     m_highlighter->setTheme(theme);
-    m_highlighter->rehighlight();
 
-    // Update extra highlights to match the new theme
-    for (auto &result : m_searchResults)
-        result.format.setBackground(m_searchBg);
-    updateTextMetrics();
+    // Only the margin's pixmaps use the theme colors.  The tab stops and
+    // text layouts don't change, so the document is left alone.
+    updateMarginPixmaps();
     updateCursor();
 }
 
@@ -696,7 +1856,13 @@ QString SyntaxTextEdit::syntaxName() const
 
 void SyntaxTextEdit::updateMargins()
 {
-    setViewportMargins(lineMarginWidth(), 0, 0, 0);
+    setViewportMargins(lineMarginWidth(), 0, overviewRulerWidth(), 0);
+
+    if (showOverviewRuler()) {
+        const QRect viewRect = viewport()->geometry();
+        m_overviewRuler->setGeometry(viewRect.right() + 1, viewRect.top(),
+                                     overviewRulerWidth(), viewRect.height());
+    }
 }
 
 void SyntaxTextEdit::updateLineNumbers(const QRect &rect, int dy)
@@ -754,10 +1920,14 @@ struct BraceMatchResult
     bool validMatch;
 };
 
-static BraceMatchResult findNextBrace(QTextBlock block, int position)
+static BraceMatchResult findNextBrace(QTextBlock block, int position, int maxLength)
 {
     QStack<QChar> balance;
     do {
+        // Give up rather than scanning through a huge line
+        if (maxLength > 0 && block.length() - 1 > maxLength)
+            return BraceMatchResult();
+
         QString text = block.text();
         while (position < text.size()) {
             const QChar ch = text.at(position);
@@ -790,10 +1960,14 @@ static BraceMatchResult findNextBrace(QTextBlock block, int position)
     return BraceMatchResult();
 }
 
-static BraceMatchResult findPrevBrace(QTextBlock block, int position)
+static BraceMatchResult findPrevBrace(QTextBlock block, int position, int maxLength)
 {
     QStack<QChar> balance;
     do {
+        // Give up rather than scanning through a huge line
+        if (maxLength > 0 && block.length() - 1 > maxLength)
+            return BraceMatchResult();
+
         QString text = block.text();
         while (position > 0) {
             --position;
@@ -819,7 +1993,7 @@ static BraceMatchResult findPrevBrace(QTextBlock block, int position)
         }
 
         block = block.previous();
-        position = block.text().size();
+        position = block.length() - 1;
     } while (block.isValid());
 
     // No match found in the document
@@ -828,42 +2002,41 @@ static BraceMatchResult findPrevBrace(QTextBlock block, int position)
 
 void SyntaxTextEdit::updateCursor()
 {
+    LatencyTimer latencyTimer(latencyPhase(Latency_CursorUpdate));
+
+    // Repaint the previous current line and brace match positions along
+    // with the new ones
+    QRegion damage = blockViewportRect(document()->findBlockByNumber(m_cursorBlockNumber));
+    for (const auto &brace : m_braceMatch)
+        damage |= characterViewportRect(brace.position);
+    bool foldsChanged = false;
+
     m_braceMatch.clear();
 
     if (matchBraces()) {
         QTextCursor cursor = textCursor();
         cursor.clearSelection();
-        const QString blockText = cursor.block().text();
         const int blockPos = cursor.positionInBlock();
         const QChar chPrev = (blockPos > 0)
-                             ? blockText[cursor.positionInBlock() - 1]
+                             ? document()->characterAt(cursor.position() - 1)
                              : QLatin1Char(0);
-        const QChar chNext = (blockPos < blockText.size())
-                             ? blockText[cursor.positionInBlock()]
+        const QChar chNext = (blockPos < cursor.block().length() - 1)
+                             ? document()->characterAt(cursor.position())
                              : QLatin1Char(0);
         BraceMatchResult match;
         if (isOpenBrace(chNext)) {
-            match = findNextBrace(cursor.block(), blockPos);
+            match = findNextBrace(cursor.block(), blockPos, m_largeLineThreshold);
         } else if (isCloseBrace(chPrev)) {
-            match = findPrevBrace(cursor.block(), blockPos);
+            match = findPrevBrace(cursor.block(), blockPos, m_largeLineThreshold);
             cursor.movePosition(QTextCursor::PreviousCharacter);
         }
 
         if (match.position >= 0) {
-            QTextEdit::ExtraSelection selection;
-            selection.format.setBackground(match.validMatch ? m_braceMatchBg : m_errorBg);
-            selection.cursor = cursor;
-            selection.cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
-            m_braceMatch.append(selection);
-            selection.cursor = textCursor();
-            selection.cursor.setPosition(match.position);
-            selection.cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor);
-            m_braceMatch.append(selection);
+            m_braceMatch.append(BraceHighlight{cursor.position(), match.validMatch});
+            m_braceMatch.append(BraceHighlight{match.position, match.validMatch});
         }
     }
 
-    updateExtraSelections();
-
     // Ensure the block containing cursor is fully unfolded
     QTextBlock cursorBlock = textCursor().block();
     if (!cursorBlock.isVisible()) {
@@ -879,6 +2052,7 @@ void SyntaxTextEdit::updateCursor()
             m_highlighter->unfoldBlock(foldStack.pop());
         SyntaxHighlighter::hideBlock(cursorBlock, false);
         updateScrollBars();
+        foldsChanged = true;
     }
 
     // If the previous block is folded but the current block is visible, that
@@ -889,6 +2063,7 @@ void SyntaxTextEdit::updateCursor()
         if (m_highlighter->isFoldable(previousBlock)) {
             m_highlighter->unfoldBlock(previousBlock);
             updateScrollBars();
+            foldsChanged = true;
         } else {
             previousBlock.setUserState(-1);
         }
@@ -899,13 +2074,172 @@ void SyntaxTextEdit::updateCursor()
     QTextBlock nextBlock = cursorBlock.next();
     cursorBlock.setUserState(nextBlock.isVisible() ? -1 : 1);
 
-    // Ensure the entire viewport gets repainted to account for the
-    // "current line" highlight change
-    viewport()->update();
+    if (m_cursorBlockNumber != cursorBlock.blockNumber())
+        m_overviewRuler->update();
+    m_cursorBlockNumber = cursorBlock.blockNumber();
+    if (foldsChanged) {
+        // Block geometry below the unfolded region has moved
+        viewport()->update();
+        m_lineMargin->update();
+        return;
+    }
 
-    // Also update the entire line number margin; otherwise word-wrapped lines
-    // may not get the correct block updated
-    m_lineMargin->update();
+    damage |= blockViewportRect(cursorBlock);
+    for (const auto &brace : m_braceMatch)
+        damage |= characterViewportRect(brace.position);
+    viewport()->update(damage);
+
+    // The block rects cover all wrapped lines of a block, so the margin
+    // can use the same vertical ranges to update the current line number
+    for (const QRect &rect : damage)
+        m_lineMargin->update(0, rect.y(), m_lineMargin->width(), rect.height());
+}
+
+QRect SyntaxTextEdit::blockViewportRect(const QTextBlock &block) const
+{
+    if (!block.isValid() || !block.isVisible())
+        return QRect();
+
+    // Use the full viewport width, since the current line highlight and
+    // long line marker are painted past the document margins
+    QRect rect = blockBoundingGeometry(block).translated(contentOffset()).toAlignedRect();
+    rect.setLeft(0);
+    rect.setRight(viewport()->width());
+    return rect;
+}
+
+QRect SyntaxTextEdit::characterViewportRect(int position) const
+{
+    QTextCursor cursor(document());
+    cursor.setPosition(qMin(position, document()->characterCount() - 1));
+    const QRect start = cursorRect(cursor);
+    cursor.movePosition(QTextCursor::NextCharacter);
+    return start.united(cursorRect(cursor)).adjusted(-1, 0, 1, 0);
+}
+
+void SyntaxTextEdit::paintHighlight(QPainter &painter, const QTextBlock &block,
+                                    int start, int length, const QColor &color)
+{
+    // A highlight may be split over several wrapped lines
+    const QTextLayout *layout = block.layout();
+    const QPointF offset = blockBoundingGeometry(block).translated(contentOffset()).topLeft();
+    const int end = start + length;
+    int position = start;
+    while (position < end) {
+        const QTextLine line = layout->lineForTextPosition(position);
+        if (!line.isValid())
+            break;
+        const int lineEnd = qMin(end, line.textStart() + line.textLength());
+        if (lineEnd <= position)
+            break;
+        const qreal left = line.cursorToX(position);
+        const qreal right = line.cursorToX(lineEnd);
+        painter.fillRect(QRectF(qMin(left, right), line.y(), qAbs(right - left), line.height())
+                                .translated(offset), color);
+        position = lineEnd;
+    }
+}
+
+void SyntaxTextEdit::paintHighlights(const QRect &eventRect)
+{
+    if (m_searchIndex.isEmpty() && m_braceMatch.isEmpty() && m_carets.isEmpty())
+        return;
+
+    QPainter painter(viewport());
+    for (QTextBlock block = firstVisibleBlock(); block.isValid(); block = block.next()) {
+        if (!block.isVisible())
+            continue;
+        const QRectF blockRect = blockBoundingGeometry(block).translated(contentOffset());
+        if (blockRect.top() > eventRect.bottom())
+            break;
+        const int blockNumber = block.blockNumber();
+        if (blockRect.bottom() < eventRect.top() || blockNumber >= m_searchIndex.size())
+            continue;
+        for (const SearchMatch &match : m_searchIndex.at(blockNumber))
+            paintHighlight(painter, block, match.start, match.length, m_searchBg);
+    }
+
+    for (const BraceHighlight &brace : m_braceMatch) {
+        const QTextBlock block = document()->findBlock(brace.position);
+        if (block.isValid() && block.isVisible()) {
+            paintHighlight(painter, block, brace.position - block.position(), 1,
+                           brace.validMatch ? m_braceMatchBg : m_errorBg);
+        }
+    }
+
+    // The selections of the other carets.  QPlainTextEdit paints the text
+    // cursor's selection itself.
+    const auto carets = visibleCaretRange();
+    const QColor selectionBg = palette().color(QPalette::Highlight);
+    for (int i = carets.first; i < carets.second; ++i) {
+        const Caret &caret = m_carets.at(i);
+        if (i == m_primaryCaret || caret.anchor == caret.position)
+            continue;
+        for (QTextBlock block = document()->findBlock(caret.start());
+             block.isValid() && block.position() < caret.end(); block = block.next()) {
+            if (!block.isVisible())
+                continue;
+            const QRectF blockRect = blockBoundingGeometry(block).translated(contentOffset());
+            if (blockRect.top() > eventRect.bottom())
+                break;
+            if (blockRect.bottom() < eventRect.top())
+                continue;
+            const int start = qMax(caret.start(), block.position());
+            const int end = qMin(caret.end(), block.position() + block.length() - 1);
+            if (end > start)
+                paintHighlight(painter, block, start - block.position(), end - start, selectionBg);
+        }
+    }
+}
+
+QPair<int, int> SyntaxTextEdit::visibleCaretRange() const
+{
+    if (m_carets.isEmpty())
+        return qMakePair(0, 0);
+
+    const int first = firstVisibleBlock().position();
+    const QTextBlock lastBlock = cursorForPosition(viewport()->rect().bottomRight()).block();
+    const int last = lastBlock.position() + lastBlock.length();
+    auto begin = std::lower_bound(m_carets.cbegin(), m_carets.cend(), first,
+                                  [](const Caret &caret, int position) {
+        return caret.end() < position;
+    });
+    auto end = std::upper_bound(begin, m_carets.cend(), last,
+                                [](int position, const Caret &caret) {
+        return position < caret.start();
+    });
+    return qMakePair(int(begin - m_carets.cbegin()), int(end - m_carets.cbegin()));
+}
+
+void SyntaxTextEdit::paintCarets(const QRect &eventRect)
+{
+    if (m_carets.isEmpty())
+        return;
+
+    // These don't blink, since there may be thousands of them
+    QPainter painter(viewport());
+    const QColor caretColor = palette().color(QPalette::Text);
+    const auto carets = visibleCaretRange();
+    QTextCursor cursor(document());
+    for (int i = carets.first; i < carets.second; ++i) {
+        if (i == m_primaryCaret)
+            continue;
+        cursor.setPosition(m_carets.at(i).position);
+        if (!cursor.block().isVisible())
+            continue;
+        QRect caretRect = cursorRect(cursor);
+        caretRect.setWidth(cursorWidth());
+        if (caretRect.intersects(eventRect))
+            painter.fillRect(caretRect, caretColor);
+    }
+}
+
+static QColor nextDebugRepaintColor()
+{
+    // Cycle through hues so each repaint is distinguishable from the last
+    static int s_repaintCount = 0;
+    s_repaintCount = (s_repaintCount + 1) % 12;
+    return QColor::fromHsv(s_repaintCount * 30, 255, 255, 64);
 }
 
 void SyntaxTextEdit::resizeEvent(QResizeEvent *e)
@@ -915,10 +2249,22 @@ void SyntaxTextEdit::resizeEvent(QResizeEvent *e)
     QRect rect = contentsRect();
     rect.setWidth(lineMarginWidth());
     m_lineMargin->setGeometry(rect);
+
+    if (showOverviewRuler()) {
+        const QRect viewRect = viewport()->geometry();
+        m_overviewRuler->setGeometry(viewRect.right() + 1, viewRect.top(),
+                                     overviewRulerWidth(), viewRect.height());
+    }
 }
 
 void SyntaxTextEdit::cutLines()
 {
+    if (hasMultipleCarets()) {
+        QGuiApplication::clipboard()->setText(caretSelectedText());
+        deleteSelection();
+        return;
+    }
+
     auto cursor = textCursor();
     if (!cursor.hasSelection()) {
         cursor.movePosition(QTextCursor::StartOfBlock);
@@ -930,6 +2276,11 @@ void SyntaxTextEdit::cutLines()
 
 void SyntaxTextEdit::copyLines()
 {
+    if (hasMultipleCarets()) {
+        QGuiApplication::clipboard()->setText(caretSelectedText());
+        return;
+    }
+
     auto cursor = textCursor();
     if (!cursor.hasSelection()) {
         cursor.movePosition(QTextCursor::StartOfBlock);
@@ -940,83 +2291,75 @@ void SyntaxTextEdit::copyLines()
 }
 
 void SyntaxTextEdit::indentSelection()
-{
-    QTextCursor cursor = textCursor();
-    cursor.beginEditBlock();
-
-    const int startPos = cursor.selectionStart();
-    cursor.setPosition(cursor.selectionEnd());
-    const int endBlock = (cursor.position() == cursor.block().position())
-                         ? cursor.blockNumber() - 1 : cursor.blockNumber();
-    cursor.setPosition(startPos);
-    do {
-        int startOfLine = 0;
-        const QString blockText = cursor.block().text();
-        const int leadingIndent = m_highlighter->leadingIndentation(blockText, &startOfLine);
-
-        if (!blockText.isEmpty()) {
-            cursor.movePosition(QTextCursor::StartOfLine);
-            cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor,
-                                startOfLine);
-            cursor.removeSelectedText();
+{
+    shiftSelection(m_indentationMode == IndentTabs ? m_tabCharSize : m_indentWidth);
+}
 
-            const int indent = leadingIndent + (m_indentationMode == IndentTabs
-                                                ? m_tabCharSize : m_indentWidth);
-            if (m_indentationMode == IndentSpaces) {
-                cursor.insertText(QString(indent, QLatin1Char(' ')));
-            } else {
-                const int tabs = indent / m_tabCharSize;
-                const int spaces = indent % m_tabCharSize;
-                cursor.insertText(QString(tabs, QLatin1Char('\t')));
-                cursor.insertText(QString(spaces, QLatin1Char(' ')));
-            }
-        }
+void SyntaxTextEdit::outdentSelection()
+{
+    shiftSelection(-(m_indentationMode == IndentTabs ? m_tabCharSize : m_indentWidth));
+}
 
-        if (!cursor.movePosition(QTextCursor::NextBlock))
-            break;
-    } while (cursor.blockNumber() <= endBlock);
+QString SyntaxTextEdit::indentationText(int indent) const
+{
+    if (m_indentationMode == IndentSpaces)
+        return QString(indent, QLatin1Char(' '));
 
-    cursor.endEditBlock();
+    const int tabs = indent / m_tabCharSize;
+    const int spaces = indent % m_tabCharSize;
+    return QString(tabs, QLatin1Char('\t')) + QString(spaces, QLatin1Char(' '));
 }
 
-void SyntaxTextEdit::outdentSelection()
+void SyntaxTextEdit::shiftSelection(int indentDelta)
 {
-    QTextCursor cursor = textCursor();
-    cursor.beginEditBlock();
+    int firstLine, lastLine;
+    selectedLines(&firstLine, &lastLine);
 
-    const int startPos = cursor.selectionStart();
-    cursor.setPosition(cursor.selectionEnd());
-    const int endBlock = (cursor.position() == cursor.block().position())
-                         ? cursor.blockNumber() - 1 : cursor.blockNumber();
-    cursor.setPosition(startPos);
-    do {
-        int startOfLine = 0;
-        const QString blockText = cursor.block().text();
-        const int leadingIndent = m_highlighter->leadingIndentation(blockText, &startOfLine);
-
-        cursor.movePosition(QTextCursor::StartOfLine);
-        cursor.movePosition(QTextCursor::NextCharacter, QTextCursor::KeepAnchor,
-                            startOfLine);
-        cursor.removeSelectedText();
-
-        const int indent = leadingIndent - (m_indentationMode == IndentTabs
-                                            ? m_tabCharSize : m_indentWidth);
-        if (indent > 0) {
-            if (m_indentationMode == IndentSpaces) {
-                cursor.insertText(QString(indent, QLatin1Char(' ')));
-            } else {
-                const int tabs = indent / m_tabCharSize;
-                const int spaces = indent % m_tabCharSize;
-                cursor.insertText(QString(tabs, QLatin1Char('\t')));
-                cursor.insertText(QString(spaces, QLatin1Char(' ')));
-            }
+    // Rebuild the leading indentation of each line, remembering how many
+    // characters it took before and after for adjusting the selection.
+    QStringList lines;
+    QVector<QPair<int, int>> indentChars;
+    lines.reserve(lastLine - firstLine + 1);
+    indentChars.reserve(lastLine - firstLine + 1);
+    QTextBlock block = document()->findBlockByNumber(firstLine);
+    for (int line = firstLine; line <= lastLine; ++line) {
+        const QString blockText = block.text();
+        if (indentDelta > 0 && blockText.isEmpty()) {
+            // Don't add trailing whitespace to empty lines
+            lines.append(blockText);
+            indentChars.append(qMakePair(0, 0));
+        } else {
+            int startOfLine = 0;
+            const int leadingIndent = m_highlighter->leadingIndentation(blockText, &startOfLine);
+            const QString indent = indentationText(qMax(0, leadingIndent + indentDelta));
+            lines.append(indent + blockText.mid(startOfLine));
+            indentChars.append(qMakePair(startOfLine, int(indent.size())));
         }
+        block = block.next();
+    }
 
-        if (!cursor.movePosition(QTextCursor::NextBlock))
-            break;
-    } while (cursor.blockNumber() <= endBlock);
-
-    cursor.endEditBlock();
+    QTextCursor cursor = textCursor();
+    const QTextBlock anchorBlock = document()->findBlock(cursor.anchor());
+    const QTextBlock positionBlock = document()->findBlock(cursor.position());
+    const int anchorLine = anchorBlock.blockNumber();
+    const int anchorColumn = cursor.anchor() - anchorBlock.position();
+    const int positionLine = positionBlock.blockNumber();
+    const int positionColumn = cursor.position() - positionBlock.position();
+
+    replaceLines(firstLine, lastLine, lines);
+
+    const auto mapPosition = [&](int line, int column) {
+        const int blockStart = document()->findBlockByNumber(line).position();
+        if (line < firstLine || line > lastLine)
+            return blockStart + column;
+        const auto &chars = indentChars.at(line - firstLine);
+        if (column >= chars.first)
+            return blockStart + column - chars.first + chars.second;
+        return blockStart + qMin(column, chars.second);
+    };
+    cursor.setPosition(mapPosition(anchorLine, anchorColumn));
+    cursor.setPosition(mapPosition(positionLine, positionColumn), QTextCursor::KeepAnchor);
+    setTextCursor(cursor);
 }
 
 void SyntaxTextEdit::foldCurrentLine()
@@ -1114,6 +2457,18 @@ void SyntaxTextEdit::zoomReset()
 
 void SyntaxTextEdit::keyPressEvent(QKeyEvent *e)
 {
+    if (trackTypingLatency() && (!m_latency.pending || !m_latency.changed)) {
+        // If several keys arrive before the next paint, measure from the
+        // first one which changed anything, since that's the latency the
+        // user sees.  Modifiers and other keys which did nothing don't count.
+        m_latency.keyTimer.start();
+        m_latency.pending = true;
+        m_latency.changed = false;
+        for (auto &phaseTime : m_latency.current)
+            phaseTime = 0;
+        (void) m_highlighter->takeHighlightTime();
+    }
+
     if (externalUndoRedo()) {
         // Ensure these are handled by the application, NOT by QPlainTextEdit's
         // built-in implementation that bypasses us altogether
@@ -1127,6 +2482,28 @@ void SyntaxTextEdit::keyPressEvent(QKeyEvent *e)
         }
     }
 
+    // Alt+Shift+arrow keys make a rectangular selection
+    if ((e->modifiers() & ~Qt::KeypadModifier) == (Qt::AltModifier | Qt::ShiftModifier)) {
+        switch (e->key()) {
+        case Qt::Key_Up:
+            extendRectangularSelection(-1, 0);
+            return;
+        case Qt::Key_Down:
+            extendRectangularSelection(1, 0);
+            return;
+        case Qt::Key_Left:
+            extendRectangularSelection(0, -1);
+            return;
+        case Qt::Key_Right:
+            extendRectangularSelection(0, 1);
+            return;
+        default:
+            break;
+        }
+    }
+    if (hasMultipleCarets() && caretKeyPressEvent(e))
+        return;
+
     // Custom versions of Cut and Copy
     if (e->matches(QKeySequence::Cut)) {
         cutLines();
@@ -1353,6 +2730,17 @@ void SyntaxTextEdit::paintEvent(QPaintEvent *e)
     }
 #endif
 
+    // Apply the current theme to any visible blocks that were highlighted
+    // with a previous theme.
+    for (QTextBlock block = firstVisibleBlock(); block.isValid(); block = block.next()) {
+        if (!block.isVisible())
+            continue;
+        const QRectF blockRect = blockBoundingGeometry(block).translated(contentOffset());
+        if (blockRect.top() > viewRect.bottom())
+            break;
+        m_highlighter->updateThemeFormats(block);
+    }
+
     const QTextCursor cursor = textCursor();
     if (highlightCurrentLine()) {
         // Highlight current line first, so the long line marker will draw over it
@@ -1406,7 +2794,13 @@ void SyntaxTextEdit::paintEvent(QPaintEvent *e)
         }
     }
 
-    QPlainTextEdit::paintEvent(e);
+    paintHighlights(eventRect);
+
+    {
+        LatencyTimer latencyTimer(latencyPhase(Latency_Paint));
+        paintText(e);
+    }
+    paintCarets(eventRect);
 
     // Overlay indentation guides after rendering the text
     if (showIndentGuides()) {
@@ -1419,26 +2813,20 @@ void SyntaxTextEdit::paintEvent(QPaintEvent *e)
         const qreal indentLine = indentAdvance(fm, guideWidth);
         const qreal lineOffset = contentOffset().x() + document()->documentMargin();
         while (block.isValid()) {
-            QString blockText = block.text();
-            int wsColumn = 0;
-            bool onlySpaces = true;
-            for (const QChar &ch : std::as_const(blockText)) {
-                if (ch == QLatin1Char('\t')) {
-                    wsColumn = wsColumn - (wsColumn % m_tabCharSize) + m_tabCharSize;
-                } else if (ch.isSpace()) {
-                    ++wsColumn;
-                } else {
-                    onlySpaces = false;
-                    break;
-                }
-            }
-            if (onlySpaces) {
-                // Pretend we have one more column so whitespace-only lines
-                // show the indent guideline when applicable
-                wsColumn += 1;
+            if (!block.isVisible()) {
+                block = block.next();
+                continue;
             }
             QRectF blockRect = blockBoundingGeometry(block);
             blockRect.translate(contentOffset());
+            if (blockRect.top() > eventRect.bottom())
+                break;
+            if (blockRect.bottom() < eventRect.top()) {
+                block = block.next();
+                continue;
+            }
+
+            int wsColumn = indentGuideColumns(block);
             wsColumn = (wsColumn + guideWidth - 1) / guideWidth;
             for (int i = 1; i < wsColumn; ++i) {
                 if (cursor.blockNumber() == block.blockNumber()
@@ -1452,6 +2840,552 @@ void SyntaxTextEdit::paintEvent(QPaintEvent *e)
             block = block.next();
         }
     }
+
+    if (debugRepaints()) {
+        QPainter p(viewport());
+        const QColor debugColor = nextDebugRepaintColor();
+        for (const QRect &rect : e->region())
+            p.fillRect(rect, debugColor);
+    }
+
+    if (m_latency.pending && m_latency.changed)
+        finishLatencySample();
+    else
+        m_latency.pending = false;
+}
+
+void SyntaxTextEdit::setTrackTypingLatency(bool track)
+{
+    if (track) {
+        m_config |= Config_TrackLatency;
+    } else {
+        m_config &= ~Config_TrackLatency;
+        m_latency.pending = false;
+    }
+    m_highlighter->setTrackHighlightTime(track);
+}
+
+bool SyntaxTextEdit::trackTypingLatency() const
+{
+    return !!(m_config & Config_TrackLatency);
+}
+
+SyntaxTextEdit::LatencyStats SyntaxTextEdit::typingLatency(LatencyPhase phase) const
+{
+    LatencyStats stats;
+    if (phase < 0 || phase >= Latency_PhaseCount)
+        return stats;
+
+    QVector<qint64> samples = m_latency.samples[phase];
+    stats.samples = samples.size();
+    if (samples.isEmpty())
+        return stats;
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](int pct) {
+        return samples.at(static_cast<int>((samples.size() - 1) * qint64(pct) / 100)) / 1.0e6;
+    };
+    stats.p50 = percentile(50);
+    stats.p95 = percentile(95);
+    stats.p99 = percentile(99);
+    return stats;
+}
+
+qint64 *SyntaxTextEdit::latencyPhase(LatencyPhase phase)
+{
+    return m_latency.pending ? &m_latency.current[phase] : nullptr;
+}
+
+void SyntaxTextEdit::finishLatencySample()
+{
+    m_latency.pending = false;
+    m_latency.current[Latency_Total] = m_latency.keyTimer.nsecsElapsed();
+    m_latency.current[Latency_Highlight] = m_highlighter->takeHighlightTime();
+
+    for (int phase = 0; phase < Latency_PhaseCount; ++phase) {
+        QVector<qint64> &samples = m_latency.samples[phase];
+        if (samples.size() < LatencySamples)
+            samples.append(m_latency.current[phase]);
+        else
+            samples[m_latency.next] = m_latency.current[phase];
+    }
+    m_latency.next = (m_latency.next + 1) % LatencySamples;
+
+    qCDebug(LatencyLog, "key to paint %.2f ms (cursor %.2f, live search %.2f, "
+                        "highlight %.2f, paint %.2f)",
+            m_latency.current[Latency_Total] / 1.0e6,
+            m_latency.current[Latency_CursorUpdate] / 1.0e6,
+            m_latency.current[Latency_LiveSearch] / 1.0e6,
+            m_latency.current[Latency_Highlight] / 1.0e6,
+            m_latency.current[Latency_Paint] / 1.0e6);
+    Q_EMIT typingLatencyUpdated();
+}
+
+int SyntaxTextEdit::indentGuideColumns(const QTextBlock &block)
+{
+    const int blockNumber = block.blockNumber();
+    const auto cached = m_indentGuideCache.constFind(blockNumber);
+    if (cached != m_indentGuideCache.cend())
+        return cached.value();
+
+    // Only the leading whitespace is needed, so read it directly from
+    // the document instead of copying the (possibly huge) line
+    const int blockStart = block.position();
+    int scanEnd = blockStart + block.length() - 1;
+    if (m_largeLineThreshold > 0)
+        scanEnd = qMin(scanEnd, blockStart + m_largeLineThreshold);
+    int wsColumn = 0;
+    bool onlySpaces = true;
+    for (int pos = blockStart; pos < scanEnd; ++pos) {
+        const QChar ch = document()->characterAt(pos);
+        if (ch == QLatin1Char('\t')) {
+            wsColumn = wsColumn - (wsColumn % m_tabCharSize) + m_tabCharSize;
+        } else if (ch.isSpace()) {
+            ++wsColumn;
+        } else {
+            onlySpaces = false;
+            break;
+        }
+    }
+    if (onlySpaces) {
+        // Pretend we have one more column so whitespace-only lines
+        // show the indent guideline when applicable
+        wsColumn += 1;
+    }
+
+    if (m_indentGuideCache.size() >= IndentGuideCacheSize)
+        m_indentGuideCache.clear();
+    m_indentGuideCache.insert(blockNumber, wsColumn);
+    return wsColumn;
+}
+
+void SyntaxTextEdit::invalidateBlockCaches(int position, int, int added)
+{
+    // The edit replaced blocks first to oldLast with first to last.  Indent
+    // guide entries for the replaced blocks are dropped, and those after
+    // them are moved to their new block numbers.
+    const int blockDelta = document()->blockCount() - m_indentGuideBlockCount;
+    m_indentGuideBlockCount = document()->blockCount();
+    const int firstBlock = document()->findBlock(position).blockNumber();
+    QTextBlock lastBlock = document()->findBlock(position + added);
+    if (!lastBlock.isValid())
+        lastBlock = document()->lastBlock();
+    const int oldLast = lastBlock.blockNumber() - blockDelta;
+    if (firstBlock < 0) {
+        m_indentGuideCache.clear();
+    } else if (blockDelta == 0) {
+        for (auto iter = m_indentGuideCache.begin(); iter != m_indentGuideCache.end(); ) {
+            if (iter.key() >= firstBlock && iter.key() <= oldLast)
+                iter = m_indentGuideCache.erase(iter);
+            else
+                ++iter;
+        }
+    } else {
+        QHash<int, int> shifted;
+        shifted.reserve(m_indentGuideCache.size());
+        for (auto iter = m_indentGuideCache.cbegin(); iter != m_indentGuideCache.cend(); ++iter) {
+            if (iter.key() < firstBlock)
+                shifted.insert(iter.key(), iter.value());
+            else if (iter.key() > oldLast)
+                shifted.insert(iter.key() + blockDelta, iter.value());
+        }
+        m_indentGuideCache.swap(shifted);
+    }
+
+    // The other caches are only kept for a few large or visible lines, so
+    // everything from the first modified block onward is dropped
+    const auto fastLayoutKeys = m_fastLayoutCache.keys();
+    for (int blockNumber : fastLayoutKeys) {
+        if (blockNumber >= firstBlock)
+            m_fastLayoutCache.remove(blockNumber);
+    }
+
+    for (auto iter = m_largeLineCache.begin(); iter != m_largeLineCache.end(); ) {
+        if (iter.key() >= firstBlock)
+            iter = m_largeLineCache.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+bool SyntaxTextEdit::useColumnWindow(const QTextBlock &block) const
+{
+    // The column window relies on every character having the same advance,
+    // so that positions in the window line up with the block's real layout
+    // (which is still used for hit testing and cursor movement).
+    return isLargeLine(block) && !wordWrap() && QFontInfo(font()).fixedPitch();
+}
+
+void SyntaxTextEdit::paintText(QPaintEvent *e)
+{
+    const QRect eventRect = e->rect();
+
+    // Paint the normal blocks in bands between any lines that are painted
+    // by the column window or the fast layout path
+    const bool useFastLayout = fastLayout() && !wordWrap() && QFontInfo(font()).fixedPitch()
+            && !(document()->defaultTextOption().flags() & QTextOption::ShowTabsAndSpaces);
+    int bandTop = eventRect.top();
+    QAbstractTextDocumentLayout::PaintContext context;
+    bool haveContext = false;
+    for (QTextBlock block = firstVisibleBlock(); block.isValid(); block = block.next()) {
+        if (!block.isVisible())
+            continue;
+        const QRect blockRect = blockBoundingGeometry(block).translated(contentOffset())
+                                        .toAlignedRect();
+        if (blockRect.top() > eventRect.bottom())
+            break;
+        if (blockRect.bottom() < eventRect.top())
+            continue;
+
+        const bool columnWindow = useColumnWindow(block);
+        if (!columnWindow && !useFastLayout)
+            continue;
+        if (!haveContext) {
+            context = getPaintContext();
+            haveContext = true;
+        }
+        if (columnWindow)
+            paintColumnWindow(block, eventRect, context);
+        else if (!paintFastLayout(block, context))
+            continue;
+
+        // The painted block splits the area left for QPlainTextEdit
+        if (blockRect.top() > bandTop) {
+            QPaintEvent bandEvent(QRect(eventRect.left(), bandTop,
+                                        eventRect.width(), blockRect.top() - bandTop));
+            QPlainTextEdit::paintEvent(&bandEvent);
+        }
+        bandTop = blockRect.bottom() + 1;
+    }
+
+    if (bandTop == eventRect.top()) {
+        QPlainTextEdit::paintEvent(e);
+    } else if (bandTop <= eventRect.bottom()) {
+        QPaintEvent bandEvent(QRect(eventRect.left(), bandTop,
+                                    eventRect.width(), eventRect.bottom() + 1 - bandTop));
+        QPlainTextEdit::paintEvent(&bandEvent);
+    }
+}
+
+void SyntaxTextEdit::setFastLayout(bool enable)
+{
+    if (enable)
+        m_config |= Config_FastLayout;
+    else
+        m_config &= ~Config_FastLayout;
+    viewport()->update();
+}
+
+bool SyntaxTextEdit::fastLayout() const
+{
+    return !!(m_config & Config_FastLayout);
+}
+
+static bool fastLayoutFormat(const QTextCharFormat &format)
+{
+    // Anything beyond colors, bold and italic needs a real QTextLayout
+    return !format.fontUnderline() && !format.fontStrikeOut() && !format.fontOverline()
+            && format.underlineStyle() == QTextCharFormat::NoUnderline
+            && !format.hasProperty(QTextFormat::FontFamily)
+            && !format.hasProperty(QTextFormat::FontPointSize)
+            && !format.hasProperty(QTextFormat::FontPixelSize)
+            && !format.hasProperty(QTextFormat::FontLetterSpacing)
+            && !format.hasProperty(QTextFormat::FontWordSpacing);
+}
+
+void SyntaxTextEdit::updateFastFonts()
+{
+    for (int style = 0; style < 4; ++style) {
+        QFont styleFont = font();
+        styleFont.setBold(style & FastFont_Bold);
+        styleFont.setItalic(style & FastFont_Italic);
+        m_fastFonts[style] = QRawFont::fromFont(styleFont);
+
+        QString latin1(256, QChar());
+        for (int ch = 0; ch < 256; ++ch)
+            latin1[ch] = QChar(ch);
+        m_fastGlyphs[style] = m_fastFonts[style].glyphIndexesForString(latin1);
+        if (m_fastGlyphs[style].size() != 256)
+            m_fastGlyphs[style] = QVector<quint32>(256, 0);
+    }
+}
+
+SyntaxTextEdit::FastLayoutLine *SyntaxTextEdit::fastLayoutLine(const QTextBlock &block)
+{
+    const auto formats = block.layout()->formats();
+    FastLayoutLine *line = m_fastLayoutCache.object(block.blockNumber());
+    if (line && line->formats == formats)
+        return line;
+
+    if (!m_fastFonts[0].isValid())
+        updateFastFonts();
+
+    line = new FastLayoutLine;
+    line->formats = formats;
+    line->text = block.text();
+    line->valid = false;
+    m_fastLayoutCache.insert(block.blockNumber(), line, 1);
+
+    const QString &text = line->text;
+    QVector<int> charFormat(text.size(), -1);
+    for (int i = 0; i < formats.size(); ++i) {
+        if (!fastLayoutFormat(formats.at(i).format))
+            return line;
+        const int end = qMin(formats.at(i).start + formats.at(i).length, int(text.size()));
+        for (int pos = qMax(0, formats.at(i).start); pos < end; ++pos)
+            charFormat[pos] = i;
+    }
+
+    const qreal tabStop = document()->defaultTextOption().tabStopDistance();
+    const qreal charWidth = QFontMetricsF(font()).horizontalAdvance(QLatin1Char(' '));
+    qreal x = 0;
+    int pos = 0;
+    while (pos < text.size()) {
+        // Each run covers the characters sharing one format range
+        const int format = charFormat.at(pos);
+        FastLayoutLine::Run run;
+        int style = 0;
+        if (format >= 0) {
+            const QTextCharFormat &charFmt = formats.at(format).format;
+            if (charFmt.fontWeight() > QFont::Normal)
+                style |= FastFont_Bold;
+            if (charFmt.fontItalic())
+                style |= FastFont_Italic;
+            run.foreground = charFmt.foreground();
+            run.background = charFmt.background();
+        }
+
+        QVector<quint32> glyphs;
+        QVector<QPointF> positions;
+        run.left = x;
+        for ( ; pos < text.size() && charFormat.at(pos) == format; ++pos) {
+            const ushort ch = text.at(pos).unicode();
+            if (ch == '\t') {
+                x = (qFloor(x / tabStop) + 1) * tabStop;
+                continue;
+            }
+            if (ch < 0x20 || (ch >= 0x7f && ch < 0xa0) || ch == 0xad || ch > 0xff)
+                return line;
+            if (ch != ' ' && ch != 0xa0) {
+                const quint32 glyph = m_fastGlyphs[style].at(ch);
+                if (glyph == 0) {
+                    // Missing from the font; QTextLayout would use a fallback
+                    return line;
+                }
+                glyphs.append(glyph);
+                positions.append(QPointF(x, 0));
+            }
+            x += charWidth;
+        }
+        run.right = x;
+        if (!glyphs.isEmpty()) {
+            run.glyphs.setRawFont(m_fastFonts[style]);
+            run.glyphs.setGlyphIndexes(glyphs);
+            run.glyphs.setPositions(positions);
+        }
+        line->runs.append(run);
+    }
+    line->valid = true;
+    return line;
+}
+
+bool SyntaxTextEdit::paintFastLayout(const QTextBlock &block,
+                                     const QAbstractTextDocumentLayout::PaintContext &context)
+{
+    const QTextLayout *blockLayout = block.layout();
+    if (blockLayout->lineCount() != 1 || overwriteMode())
+        return false;
+
+    // Selections are rare enough to leave to QTextLayout
+    const int blockStart = block.position();
+    const int blockEnd = blockStart + block.length();
+    for (const auto &selection : context.selections) {
+        if (selection.cursor.selectionEnd() >= blockStart
+                && selection.cursor.selectionStart() < blockEnd
+                && !selection.format.boolProperty(QTextFormat::FullWidthSelection))
+            return false;
+    }
+
+    const FastLayoutLine *line = fastLayoutLine(block);
+    if (!line->valid)
+        return false;
+
+    const QTextLine textLine = blockLayout->lineAt(0);
+    const QPointF origin(contentOffset().x() + document()->documentMargin(),
+                         blockBoundingGeometry(block).translated(contentOffset()).top()
+                         + textLine.y());
+    const QColor textColor = context.palette.color(QPalette::Text);
+
+    QPainter painter(viewport());
+    for (const auto &run : line->runs) {
+        if (run.background.style() != Qt::NoBrush) {
+            painter.fillRect(QRectF(origin.x() + run.left, origin.y(),
+                                    run.right - run.left, textLine.height()),
+                             run.background);
+        }
+    }
+    for (const auto &run : line->runs) {
+        if (run.glyphs.glyphIndexes().isEmpty())
+            continue;
+        if (run.foreground.style() != Qt::NoBrush)
+            painter.setPen(QPen(run.foreground, 0));
+        else
+            painter.setPen(textColor);
+        painter.drawGlyphRun(QPointF(origin.x(), origin.y() + textLine.ascent()), run.glyphs);
+    }
+
+    const int cursorPos = context.cursorPosition - blockStart;
+    if (cursorPos >= 0 && cursorPos < block.length()) {
+        const qreal tabStop = document()->defaultTextOption().tabStopDistance();
+        const qreal charWidth = QFontMetricsF(font()).horizontalAdvance(QLatin1Char(' '));
+        qreal x = 0;
+        for (int pos = 0; pos < cursorPos; ++pos) {
+            if (line->text.at(pos) == QLatin1Char('\t'))
+                x = (qFloor(x / tabStop) + 1) * tabStop;
+            else
+                x += charWidth;
+        }
+        painter.fillRect(QRectF(origin.x() + x, origin.y(), cursorWidth(), textLine.height()),
+                         textColor);
+    }
+    return true;
+}
+
+void SyntaxTextEdit::paintColumnWindow(const QTextBlock &block, const QRect &eventRect,
+                                       const QAbstractTextDocumentLayout::PaintContext &context)
+{
+    auto cacheIter = m_largeLineCache.find(block.blockNumber());
+    if (cacheIter == m_largeLineCache.end()) {
+        // Record where the columns are at tab stops every so often, so the
+        // window can be found without keeping (or rescanning) the whole line
+        const QString text = block.text();
+        LargeLine line;
+        line.length = int(text.size());
+        line.firstTab = int(text.indexOf(QLatin1Char('\t')));
+        if (line.firstTab >= 0) {
+            int column = 0, nextCheckpoint = 0;
+            for (int pos = 0; pos < text.size(); ++pos) {
+                if (pos >= nextCheckpoint && (column % m_tabCharSize) == 0) {
+                    line.checkpoints.append(ColumnCheckpoint{pos, column});
+                    nextCheckpoint = pos + ColumnCheckpointInterval;
+                }
+                if (text.at(pos) == QLatin1Char('\t'))
+                    column = column - (column % m_tabCharSize) + m_tabCharSize;
+                else
+                    ++column;
+            }
+        }
+        cacheIter = m_largeLineCache.insert(block.blockNumber(), line);
+    }
+    const LargeLine &largeLine = *cacheIter;
+
+    // Only the part of the line being scanned or painted is copied out of
+    // the document
+    const auto lineText = [&block](int start, int end) {
+        QTextCursor cursor(block);
+        cursor.setPosition(block.position() + start);
+        cursor.setPosition(block.position() + end, QTextCursor::KeepAnchor);
+        return cursor.selectedText();
+    };
+
+    const QFontMetricsF fm(font());
+    const qreal charWidth = fm.horizontalAdvance(QLatin1Char(' '));
+    const qreal textLeft = contentOffset().x() + document()->documentMargin();
+    const int firstColumn = qMax(0, qFloor((eventRect.left() - textLeft) / charWidth)
+                                    - ColumnWindowMargin);
+    const int lastColumn = qMax(0, qCeil((eventRect.right() - textLeft) / charWidth)
+                                   + ColumnWindowMargin);
+
+    // Start the window on a tab stop, so tabs inside the window expand to
+    // the same width they have in the full layout
+    int windowStart, windowEnd, windowColumn;
+    QString windowText;
+    if (largeLine.firstTab < 0 || largeLine.firstTab >= lastColumn) {
+        windowColumn = qMin(firstColumn - (firstColumn % m_tabCharSize), largeLine.length);
+        windowStart = windowColumn;
+        windowEnd = qMin(lastColumn, largeLine.length);
+        windowText = lineText(windowStart, qMax(windowStart, windowEnd));
+    } else {
+        // Scan from the last checkpoint at or before the first column.
+        // Every character takes at least one column, so no more than
+        // lastColumn - checkpoint.column characters are needed.
+        auto checkpoint = std::upper_bound(largeLine.checkpoints.cbegin(),
+                                           largeLine.checkpoints.cend(), firstColumn,
+                                           [](int column, const ColumnCheckpoint &checkpoint) {
+            return column < checkpoint.column;
+        });
+        Q_ASSERT(checkpoint != largeLine.checkpoints.cbegin());
+        --checkpoint;
+        const int scanStart = checkpoint->position;
+        const QString scanText = lineText(scanStart,
+                qMin(largeLine.length, scanStart + qMax(0, lastColumn - checkpoint->column)));
+
+        windowStart = scanStart;
+        windowColumn = checkpoint->column;
+        int pos = scanStart, column = checkpoint->column;
+        for ( ; pos - scanStart < scanText.size() && column < lastColumn; ++pos) {
+            if (column <= firstColumn && (column % m_tabCharSize) == 0) {
+                windowStart = pos;
+                windowColumn = column;
+            }
+            if (scanText.at(pos - scanStart) == QLatin1Char('\t'))
+                column = column - (column % m_tabCharSize) + m_tabCharSize;
+            else
+                ++column;
+        }
+        windowEnd = pos;
+        windowText = scanText.mid(windowStart - scanStart, windowEnd - windowStart);
+    }
+
+    // Map the highlighter's formats and the selections into the window
+    QVector<QTextLayout::FormatRange> formats;
+    auto addRange = [&formats, windowStart, windowEnd](int start, int end,
+                                                        const QTextCharFormat &format) {
+        start = qMax(start, windowStart);
+        end = qMin(end, windowEnd);
+        if (start >= end)
+            return;
+        QTextLayout::FormatRange range;
+        range.start = start - windowStart;
+        range.length = end - start;
+        range.format = format;
+        formats.append(range);
+    };
+    const auto blockFormats = block.layout()->formats();
+    for (const auto &range : blockFormats)
+        addRange(range.start, range.start + range.length, range.format);
+
+    const int blockStart = block.position();
+    for (const auto &selection : context.selections) {
+        if (selection.format.boolProperty(QTextFormat::FullWidthSelection))
+            continue;
+        addRange(selection.cursor.selectionStart() - blockStart,
+                 selection.cursor.selectionEnd() - blockStart, selection.format);
+    }
+
+    QTextLayout layout(windowText, font(), viewport());
+    QTextOption option = document()->defaultTextOption();
+    option.setWrapMode(QTextOption::NoWrap);
+    layout.setTextOption(option);
+    layout.setFormats(formats);
+    layout.beginLayout();
+    QTextLine line = layout.createLine();
+    if (line.isValid())
+        line.setPosition(QPointF(0, 0));
+    layout.endLayout();
+
+    const QTextLayout *blockLayout = block.layout();
+    const qreal lineTop = blockLayout->lineCount() > 0 ? blockLayout->lineAt(0).y() : 0;
+    const QPointF origin(textLeft + windowColumn * charWidth,
+                         blockBoundingGeometry(block).translated(contentOffset()).top() + lineTop);
+
+    QPainter painter(viewport());
+    painter.setPen(context.palette.color(QPalette::Text));
+    layout.draw(&painter, origin);
+
+    const int cursorPos = context.cursorPosition - blockStart;
+    if (cursorPos >= windowStart && cursorPos <= windowEnd)
+        layout.drawCursor(&painter, origin, cursorPos - windowStart, cursorWidth());
 }
 
 void SyntaxTextEdit::printDocument(QPrinter *printer)
@@ -1465,9 +3399,15 @@ void SyntaxTextEdit::printDocument(QPrinter *printer)
     auto printingTheme = syntaxRepo()->theme(QStringLiteral("Printing"));
     if (!printingTheme.isValid())
         printingTheme = syntaxRepo()->defaultTheme(KSyntaxHighlighting::Repository::LightTheme);
-    if (printingTheme.isValid())
+    if (printingTheme.isValid()) {
         setTheme(printingTheme);
 
+        // Off-screen blocks are normally updated lazily when painted, but
+        // the whole document is about to be printed.
+        for (QTextBlock block = document()->begin(); block.isValid(); block = block.next())
+            m_highlighter->updateThemeFormats(block);
+    }
+
     auto displayOption = document()->defaultTextOption();
     auto printOption = displayOption;
     printOption.setFlags(printOption.flags() & ~QTextOption::ShowTabsAndSpaces);
@@ -1487,6 +3427,39 @@ void SyntaxTextEdit::printDocument(QPrinter *printer)
     updateTextMetrics();
 }
 
+void SyntaxTextEdit::updateDigitAtlas(qreal pixelRatio)
+{
+    const QFontMetricsF metrics(font());
+    qreal maxAdvance = 0;
+    for (int i = 0; i < 10; ++i) {
+        m_digitAtlas.advances[i] = metrics.horizontalAdvance(QLatin1Char(char('0' + i)));
+        maxAdvance = qMax(maxAdvance, m_digitAtlas.advances[i]);
+    }
+
+    // Leave some padding around each glyph so antialiased edges and any
+    // overhang past the advance width aren't clipped
+    m_digitAtlas.cellWidth = qCeil(maxAdvance) + 2;
+    m_digitAtlas.height = qCeil(metrics.height());
+    m_digitAtlas.pixelRatio = pixelRatio;
+
+    auto renderDigits = [this, &metrics, pixelRatio](const QColor &color) {
+        QPixmap pixmap(qCeil(m_digitAtlas.cellWidth * 10 * pixelRatio),
+                       qCeil(m_digitAtlas.height * pixelRatio));
+        pixmap.setDevicePixelRatio(pixelRatio);
+        pixmap.fill(Qt::transparent);
+        QPainter painter(&pixmap);
+        painter.setFont(font());
+        painter.setPen(color);
+        for (int i = 0; i < 10; ++i) {
+            painter.drawText(QPointF(i * m_digitAtlas.cellWidth + 1, metrics.ascent()),
+                             QString(QLatin1Char(char('0' + i))));
+        }
+        return pixmap;
+    };
+    m_digitAtlas.digits = renderDigits(m_lineMarginFg);
+    m_digitAtlas.cursorDigits = renderDigits(m_cursorLineNum);
+}
+
 void SyntaxTextEdit::updateScrollBars()
 {
     // We don't have access to QPlainTextEdit's private APIs for updating
@@ -1494,6 +3467,175 @@ void SyntaxTextEdit::updateScrollBars()
     // them by sending a dummy resize event...
     QResizeEvent dummyResize(size(), size());
     resizeEvent(&dummyResize);
+
+    // This is also called whenever blocks are folded or unfolded
+    m_foldedRangesValid = false;
+    m_overviewRuler->update();
+}
+
+const QVector<QPair<int, int>> &SyntaxTextEdit::foldedRanges()
+{
+    if (m_foldedRangesValid)
+        return m_foldedRanges;
+
+    m_foldedRanges.clear();
+    appendFoldedRanges(document()->begin(), document()->blockCount() - 1);
+    m_foldedBlockCount = document()->blockCount();
+    m_foldedRangesValid = true;
+    return m_foldedRanges;
+}
+
+// Appends the folded ranges starting from block up to lastBlock (inclusive)
+void SyntaxTextEdit::appendFoldedRanges(QTextBlock block, int lastBlock)
+{
+    while (block.isValid() && block.blockNumber() <= lastBlock) {
+        if (SyntaxHighlighter::isFolded(block) && m_highlighter->isFoldable(block)) {
+            const QTextBlock endBlock = m_highlighter->findFoldEnd(block);
+            const int last = endBlock.isValid() ? endBlock.blockNumber()
+                                                : document()->blockCount() - 1;
+            m_foldedRanges.append(qMakePair(block.blockNumber(), last));
+            block = endBlock;
+        } else {
+            block = block.next();
+        }
+    }
+}
+
+void SyntaxTextEdit::updateFoldedRanges(int position, int, int added)
+{
+    if (!m_foldedRangesValid)
+        return;
+
+    // The edit replaced blocks first to oldLast with first to last.  Ranges
+    // before it are unchanged, and ranges after it just shift, but any that
+    // overlap it are found again within the blocks they covered.
+    const int blockDelta = document()->blockCount() - m_foldedBlockCount;
+    m_foldedBlockCount = document()->blockCount();
+    const int first = document()->findBlock(position).blockNumber();
+    QTextBlock lastBlock = document()->findBlock(position + added);
+    if (!lastBlock.isValid())
+        lastBlock = document()->lastBlock();
+    const int last = lastBlock.blockNumber();
+    const int oldLast = last - blockDelta;
+    if (first < 0) {
+        m_foldedRangesValid = false;
+        return;
+    }
+
+    auto overlapBegin = std::lower_bound(m_foldedRanges.begin(), m_foldedRanges.end(), first,
+                                         [](const QPair<int, int> &range, int block) {
+        return range.second < block;
+    });
+    auto overlapEnd = overlapBegin;
+    int rescanFirst = first, rescanLast = last;
+    while (overlapEnd != m_foldedRanges.end() && overlapEnd->first <= oldLast) {
+        rescanFirst = qMin(rescanFirst, overlapEnd->first);
+        rescanLast = qMax(rescanLast, overlapEnd->second + blockDelta);
+        ++overlapEnd;
+    }
+    const bool overlapped = (overlapBegin != overlapEnd);
+    if (!overlapped && blockDelta == 0)
+        return;
+
+    QVector<QPair<int, int>> after(overlapEnd, m_foldedRanges.end());
+    m_foldedRanges.erase(overlapBegin, m_foldedRanges.end());
+    if (overlapped)
+        appendFoldedRanges(document()->findBlockByNumber(rescanFirst), rescanLast);
+
+    // A fold which grew may now contain the ones after it
+    const int foldedTo = m_foldedRanges.isEmpty() ? -1 : m_foldedRanges.last().second;
+    for (const auto &range : std::as_const(after)) {
+        if (range.first + blockDelta > foldedTo)
+            m_foldedRanges.append(qMakePair(range.first + blockDelta, range.second + blockDelta));
+    }
+    m_overviewRuler->update();
+}
+
+SyntaxTextEdit::OverviewRuler::OverviewRuler(SyntaxTextEdit *editor)
+    : QWidget(editor), m_editor(editor)
+{
+}
+
+qreal SyntaxTextEdit::OverviewRuler::blockY(int blockNumber) const
+{
+    // The ruler maps the whole document (by line) to its height
+    const int blockCount = qMax(1, m_editor->document()->blockCount());
+    return qreal(blockNumber) * height() / blockCount;
+}
+
+void SyntaxTextEdit::OverviewRuler::paintEvent(QPaintEvent *e)
+{
+    QPainter painter(this);
+    painter.fillRect(e->rect(), m_editor->m_lineMarginBg);
+
+    const qreal foldWidth = width() / qreal(3.0);
+    for (const auto &range : m_editor->foldedRanges()) {
+        // The first line of a folded region is still shown
+        const qreal top = blockY(range.first + 1);
+        const qreal bottom = blockY(range.second + 1);
+        painter.fillRect(QRectF(0, top, foldWidth, qMax(qreal(1.0), bottom - top)),
+                         m_editor->m_codeFoldingBg);
+    }
+
+    // Draw from the histogram, so this doesn't depend on the number of matches
+    const int blockCount = m_editor->document()->blockCount();
+    const int bucketSize = m_editor->m_histogramBucketSize;
+    const auto &histogram = m_editor->m_matchHistogram;
+    for (int bucket = 0; bucket < histogram.size(); ++bucket) {
+        if (histogram.at(bucket) == 0)
+            continue;
+        const qreal top = blockY(bucket * bucketSize);
+        const qreal bottom = blockY(qMin((bucket + 1) * bucketSize, blockCount));
+        painter.fillRect(QRectF(foldWidth, top, width() - foldWidth,
+                                qMax(qreal(2.0), bottom - top)),
+                         m_editor->m_searchBg);
+    }
+
+    const qreal cursorY = blockY(m_editor->textCursor().blockNumber());
+    painter.fillRect(QRectF(0, cursorY, width(), 2), m_editor->m_cursorLineNum);
+}
+
+void SyntaxTextEdit::OverviewRuler::mousePressEvent(QMouseEvent *e)
+{
+    if (e->button() != Qt::LeftButton) {
+        QWidget::mousePressEvent(e);
+        return;
+    }
+
+    QTextDocument *document = m_editor->document();
+    const int blockCount = document->blockCount();
+    const int line = qBound(0, int(e->pos().y() * qreal(blockCount) / qMax(1, height())),
+                            blockCount - 1);
+
+    // Jump to the first match in the clicked bucket.  Marks are drawn at
+    // least 2 pixels high, so the neighboring buckets are also accepted.
+    const int bucketSize = m_editor->m_histogramBucketSize;
+    const auto &histogram = m_editor->m_matchHistogram;
+    const int clicked = line / bucketSize;
+    int bucket = -1;
+    for (int candidate : { clicked, clicked - 1, clicked + 1 }) {
+        if (candidate >= 0 && candidate < histogram.size() && histogram.at(candidate) > 0) {
+            bucket = candidate;
+            break;
+        }
+    }
+
+    QTextCursor cursor(document->findBlockByNumber(line));
+    if (bucket >= 0) {
+        const auto &index = m_editor->m_searchIndex;
+        const int end = qMin((bucket + 1) * bucketSize, int(index.size()));
+        for (int blockNumber = bucket * bucketSize; blockNumber < end; ++blockNumber) {
+            if (index.at(blockNumber).isEmpty())
+                continue;
+            const int blockStart = document->findBlockByNumber(blockNumber).position();
+            const SearchMatch &match = index.at(blockNumber).first();
+            cursor.setPosition(blockStart + match.start);
+            cursor.setPosition(blockStart + match.start + match.length, QTextCursor::KeepAnchor);
+            break;
+        }
+    }
+    m_editor->setTextCursor(cursor);
+    m_editor->setFocus(Qt::MouseFocusReason);
 }
 
 SyntaxTextEdit::LineMargin::LineMargin(SyntaxTextEdit *editor)
@@ -1521,17 +3663,14 @@ void SyntaxTextEdit::LineMargin::paintEvent(QPaintEvent *paintEvent)
                           + (m_editor->showFolding() ? foldPixmapWidth : 0);
     QTextCursor cursor = m_editor->textCursor();
 
+    if (m_editor->showLineNumbers() && m_editor->m_digitAtlas.pixelRatio != devicePixelRatioF())
+        m_editor->updateDigitAtlas(devicePixelRatioF());
+
     while (block.isValid() && top <= paintEvent->rect().bottom()) {
         if (block.isVisible()) {
             if (m_editor->showLineNumbers() && bottom >= paintEvent->rect().top()) {
-                const QString lineNum = QString::number(block.blockNumber() + 1);
-                if (block.blockNumber() == cursor.blockNumber())
-                    painter.setPen(m_editor->m_cursorLineNum);
-                else
-                    painter.setPen(m_editor->m_lineMarginFg);
-                const QRectF numberRect(0, top, width() - numOffset,
-                                        metrics.height());
-                painter.drawText(numberRect, Qt::AlignRight, lineNum);
+                drawLineNumber(painter, block.blockNumber() + 1, width() - numOffset, top,
+                               block.blockNumber() == cursor.blockNumber());
             }
 
             if (m_editor->showFolding() && m_editor->m_highlighter->isFoldable(block)) {
@@ -1561,6 +3700,66 @@ void SyntaxTextEdit::LineMargin::paintEvent(QPaintEvent *paintEvent)
         top = bottom;
         bottom = top + m_editor->blockBoundingRect(block).height();
     }
+
+    if (m_editor->debugRepaints()) {
+        const QColor debugColor = nextDebugRepaintColor();
+        for (const QRect &rect : paintEvent->region())
+            painter.fillRect(rect, debugColor);
+    }
+}
+
+void SyntaxTextEdit::LineMargin::drawLineNumber(QPainter &painter, int lineNumber,
+                                                qreal right, qreal top, bool cursorLine)
+{
+    const DigitAtlas &atlas = m_editor->m_digitAtlas;
+    const QPixmap &digits = cursorLine ? atlas.cursorDigits : atlas.digits;
+    const qreal ratio = atlas.pixelRatio;
+
+    // Blit the digits right to left, starting from the least significant
+    qreal x = right;
+    do {
+        const int digit = lineNumber % 10;
+        lineNumber /= 10;
+        x -= atlas.advances[digit];
+        const QRectF source(digit * atlas.cellWidth * ratio, 0,
+                            atlas.cellWidth * ratio, atlas.height * ratio);
+        painter.drawPixmap(QPointF(x - 1, top), digits, source);
+    } while (lineNumber > 0);
+}
+
+QRect SyntaxTextEdit::LineMargin::foldHoverRect(int line) const
+{
+    const QTextBlock block = m_editor->document()->findBlockByNumber(line);
+    QRect rect = m_editor->blockViewportRect(block);
+    if (rect.isNull())
+        return QRect();
+
+    if (m_editor->m_highlighter->isFoldable(block) && !SyntaxHighlighter::isFolded(block)) {
+        QTextBlock endBlock = m_editor->m_highlighter->findFoldEnd(block);
+        if (!endBlock.isValid())
+            endBlock = m_editor->document()->lastBlock();
+        const qreal endBottom = m_editor->blockBoundingGeometry(endBlock)
+                                    .translated(m_editor->contentOffset()).bottom();
+        rect.setBottom(qMin(qCeil(endBottom), height()));
+    }
+    rect.setLeft(0);
+    rect.setRight(width());
+    return rect;
+}
+
+void SyntaxTextEdit::LineMargin::setFoldHoverLine(int line)
+{
+    if (line == m_foldHoverLine)
+        return;
+
+    // Only repaint the previously and newly highlighted fold regions
+    QRegion damage;
+    if (m_foldHoverLine >= 0)
+        damage |= foldHoverRect(m_foldHoverLine);
+    m_foldHoverLine = line;
+    if (m_foldHoverLine >= 0)
+        damage |= foldHoverRect(m_foldHoverLine);
+    update(damage);
 }
 
 void SyntaxTextEdit::LineMargin::mouseMoveEvent(QMouseEvent *e)
@@ -1569,15 +3768,15 @@ void SyntaxTextEdit::LineMargin::mouseMoveEvent(QMouseEvent *e)
     QTextCursor lineCursor = m_editor->cursorForPosition(QPoint(0, eventPos.y()));
     const int foldPixmapWidth = m_editor->m_foldOpen.width() + 4;
 
-    m_foldHoverLine = -1;
+    int foldHoverLine = -1;
     if (m_editor->showFolding()) {
         if (!m_editor->showLineNumbers() || eventPos.x() >= width() - foldPixmapWidth) {
             QTextBlock block = lineCursor.block();
             if (block.isValid() && m_editor->m_highlighter->isFoldable(block))
-                m_foldHoverLine = block.blockNumber();
+                foldHoverLine = block.blockNumber();
         }
-        update();
     }
+    setFoldHoverLine(foldHoverLine);
 
     if ((e->buttons() & Qt::LeftButton) && m_marginSelectStart >= 0) {
         const int linePosition = lineCursor.position();
@@ -1642,7 +3841,6 @@ void SyntaxTextEdit::LineMargin::mousePressEvent(QMouseEvent *e)
 
 void SyntaxTextEdit::LineMargin::leaveEvent(QEvent *e)
 {
-    m_foldHoverLine = -1;
-    update();
+    setFoldHoverLine(-1);
     QWidget::leaveEvent(e);
 }
@@ -18,6 +18,17 @@
 #define QTEXTPAD_SYNTAXTEXTEDIT_H
 
 #include <QPlainTextEdit>
+#include <QAbstractTextDocumentLayout>
+#include <QHash>
+#include <QCache>
+#include <QGlyphRun>
+#include <QRawFont>
+#include <QElapsedTimer>
+#include <QRegularExpression>
+
+#include <functional>
+
+#include "literalsearch.h"
 
 namespace KSyntaxHighlighting
 {
@@ -29,6 +40,8 @@ namespace KSyntaxHighlighting
 class SyntaxHighlighter;
 
 class QPrinter;
+class QPainter;
+class QTimer;
 
 class SyntaxTextEdit : public QPlainTextEdit
 {
@@ -45,6 +58,8 @@ public:
     bool showLineNumbers() const;
     void setShowFolding(bool show);
     bool showFolding() const;
+    void setShowOverviewRuler(bool show);
+    bool showOverviewRuler() const;
 
     void setShowWhitespace(bool show);
     bool showWhitespace() const;
@@ -70,10 +85,21 @@ public:
     void setIndentationMode(int mode);
     IndentationMode indentationMode() const { return m_indentationMode; }
 
+    // Expensive per-line work (highlighting, brace matching, column scans)
+    // is limited on lines longer than this.  A value of 0 disables the limit.
+    void setLargeLineThreshold(int length);
+    int largeLineThreshold() const { return m_largeLineThreshold; }
+    bool isLargeLine(const QTextBlock &block) const;
+
     int textColumn(const QString &block, int positionInBlock) const;
+    int textColumn(const QTextCursor &cursor) const;
     void moveCursorTo(int line, int column = 0);
 
     void moveLines(QTextCursor::MoveOperation op);
+
+    // The lines touched by the selection (or the cursor line).  A selection
+    // ending at the start of a line doesn't include that line.
+    void selectedLines(int *firstLine, int *lastLine) const;
     void smartHome(QTextCursor::MoveMode mode);
     void smartEnd(QTextCursor::MoveMode mode);
 
@@ -94,14 +120,87 @@ public:
         QString searchText;
         bool caseSensitive, wholeWord, regex;
 
-        SearchParams() : caseSensitive(), wholeWord(), regex() { }
+        // Regex searches run over the whole document with the lines joined
+        // by '\n' (and with ^ and $ matching at line boundaries), so a match
+        // may span multiple lines.
+        bool multiLine;
+
+        SearchParams() : caseSensitive(), wholeWord(), regex(), multiLine() { }
+
+        bool isMultiLine() const { return regex && multiLine; }
+
+        // Returns searchText compiled as a regular expression.  The compiled
+        // pattern is kept and reused until searchText or caseSensitive change.
+        const QRegularExpression &compiledRegex() const;
+
+        // Likewise, returns the literal search used when regex is not set.
+        const LiteralSearch &literalSearch() const;
+
+        // Returns true if every match of this search starts at a match of
+        // previous (e.g. the search text was extended while typing), so the
+        // matches of previous can be checked again instead of searching the
+        // whole document.
+        bool narrows(const SearchParams &previous) const;
+
+        // Returns true if some later search could narrow this one
+        bool canBeNarrowed() const;
+
+    private:
+        mutable QRegularExpression m_compiledRegex;
+        mutable LiteralSearch m_literalSearch;
     };
     QTextCursor textSearch(const QTextCursor &start, const SearchParams& params,
                            bool matchFirst, bool reverse = false,
                            QRegularExpressionMatch *regexMatch = nullptr);
+    // Calls found(start, length) for each match of params in the text, until
+    // it returns false.  For multi-line searches, the text may contain
+    // several lines separated by '\n'.  This does not touch the document,
+    // so it may be used from a worker thread on a copy of the params.
+    typedef std::function<bool (int start, int length)> MatchCallback;
+    static void findInText(const QString &text, const SearchParams &params,
+                           const MatchCallback &found);
+
     void setLiveSearch(const SearchParams& params);
     void clearLiveSearch();
 
+    // Bulk replacement: findReplacements() scans the blocks between the
+    // start and end positions once, returning the replaced text of every
+    // block with a match, and applyReplacements() applies them as a single
+    // undo step.  The replacer is given the regex match (if params.regex
+    // is set) and returns the replacement text for it.
+    struct BlockReplacement
+    {
+        int position, length;
+        QString text;
+    };
+    typedef std::function<QString (const QRegularExpressionMatch &)> Replacer;
+    QVector<BlockReplacement> findReplacements(const SearchParams &params, int start, int end,
+                                               const Replacer &replace,
+                                               int *matchCount = nullptr) const;
+    void applyReplacements(const QVector<BlockReplacement> &replacements);
+
+    // Replaces the lines firstLine to lastLine (block numbers, inclusive)
+    // with newLines as a single edit and undo step.  Only the span of text
+    // which actually differs is replaced, so highlighting and layout are
+    // only invalidated there.  If newLines is empty, the lines are removed
+    // along with one line separator.
+    void replaceLines(int firstLine, int lastLine, const QStringList &newLines);
+
+    // As above, with the new lines already joined by '\n'.  An empty
+    // newText leaves a single empty line.
+    void replaceLines(int firstLine, int lastLine, const QString &newText);
+
+    // Multiple carets.  Typing, deleting and pasting apply to every caret
+    // (replacing its selection) as a single edit and undo step.  The text
+    // cursor is always one of the carets; moving it or editing the document
+    // any other way goes back to just the text cursor.
+    bool hasMultipleCarets() const { return !m_carets.isEmpty(); }
+    int caretCount() const { return qMax(1, int(m_carets.size())); }
+
+    // Selects the same range of (tab expanded) columns on every line from
+    // anchorLine to line (block numbers), with a caret on each line.
+    void setRectangularSelection(int anchorLine, int anchorColumn, int line, int column);
+
     void setMatchBraces(bool match);
     bool matchBraces() const;
 
@@ -111,6 +210,44 @@ public:
     void setExternalUndoRedo(bool enable);
     bool externalUndoRedo() const;
 
+    // Tint each repainted region with a different color, to check that
+    // only the necessary parts of the editor are being redrawn.  This can
+    // also be enabled with the QTEXTPAD_DEBUG_REPAINTS environment variable.
+    void setDebugRepaints(bool enable);
+    bool debugRepaints() const;
+
+    // Paint ASCII/Latin-1 lines in fixed-pitch fonts from cached glyph runs
+    // positioned arithmetically, instead of through QTextLayout.  Lines
+    // with other characters or complex formatting are painted normally.
+    void setFastLayout(bool enable);
+    bool fastLayout() const;
+
+    // Measure the time from each key press to the next completed paint,
+    // along with the parts of it spent in cursor updates, live search,
+    // highlighting and QPlainTextEdit's painting.  This is also enabled
+    // when the qtextpad.latency logging category is enabled for debug
+    // output, which logs each sample.
+    void setTrackTypingLatency(bool track);
+    bool trackTypingLatency() const;
+
+    enum LatencyPhase
+    {
+        Latency_Total,
+        Latency_CursorUpdate,
+        Latency_LiveSearch,
+        Latency_Highlight,
+        Latency_Paint,
+        Latency_PhaseCount,
+    };
+    struct LatencyStats
+    {
+        double p50, p95, p99;   // In milliseconds
+        int samples;
+
+        LatencyStats() : p50(), p95(), p99(), samples() { }
+    };
+    LatencyStats typingLatency(LatencyPhase phase = Latency_Total) const;
+
     static KSyntaxHighlighting::Repository *syntaxRepo();
     static const KSyntaxHighlighting::Definition &nullSyntax();
 
@@ -129,10 +266,22 @@ protected:
     void keyPressEvent(QKeyEvent *e) Q_DECL_OVERRIDE;
     void wheelEvent(QWheelEvent *e) Q_DECL_OVERRIDE;
     void paintEvent(QPaintEvent *e) Q_DECL_OVERRIDE;
+    void mousePressEvent(QMouseEvent *e) Q_DECL_OVERRIDE;
+    void mouseMoveEvent(QMouseEvent *e) Q_DECL_OVERRIDE;
+    void mouseReleaseEvent(QMouseEvent *e) Q_DECL_OVERRIDE;
+    void insertFromMimeData(const QMimeData *source) Q_DECL_OVERRIDE;
 
 Q_SIGNALS:
     void undoRequested();
     void redoRequested();
+    void typingLatencyUpdated();
+
+    // Emitted right after each separate part of an edit which is made as a
+    // single edit block (Replace All, or editing at multiple carets), since
+    // the document's contentsChange only reports one range covering all of
+    // them when the block ends.  Positions are in the document as it is at
+    // the time of the signal.
+    void partialEdit(int position, int charsRemoved, int charsAdded);
 
 public Q_SLOTS:
     void cutLines();
@@ -140,6 +289,10 @@ public Q_SLOTS:
     void indentSelection();
     void outdentSelection();
 
+    void addCaretAbove();
+    void addCaretBelow();
+    void clearExtraCarets();
+
     void foldCurrentLine();
     void unfoldCurrentLine();
     void foldAll();
@@ -157,11 +310,15 @@ private Q_SLOTS:
     void updateCursor();
     void updateTabMetrics();
     void updateTextMetrics();
+    void updateMarginPixmaps();
     void updateLiveSearch();
-    void updateExtraSelections();
+    void invalidateBlockCaches(int position, int removed, int added);
+    void updateSearchIndex(int position, int removed, int added);
+    void updateFoldedRanges(int position, int removed, int added);
 
 private:
     QWidget *m_lineMargin;
+    QWidget *m_overviewRuler;
     SyntaxHighlighter *m_highlighter;
     QColor m_lineMarginBg, m_lineMarginFg;
     QColor m_codeFoldingBg, m_codeFoldingFg;
@@ -173,9 +330,11 @@ private:
     QColor m_errorBg;
     int m_tabCharSize, m_indentWidth;
     int m_longLineMarker;
+    int m_largeLineThreshold;
     unsigned int m_config;
     IndentationMode m_indentationMode;
     int m_originalFontSize;
+    int m_cursorBlockNumber;
 
 #if defined(Q_OS_WIN) && QT_VERSION >= QT_VERSION_CHECK(6, 7, 0)
     QColor m_editorBg;
@@ -184,11 +343,182 @@ private:
 
     QPixmap m_foldOpen, m_foldClosed;
 
+    // Pre-rendered digits for the line number margin, in the normal and
+    // current line colors.  Each digit occupies a fixed-width cell.
+    struct DigitAtlas
+    {
+        QPixmap digits, cursorDigits;
+        qreal advances[10];
+        qreal cellWidth, height;
+        qreal pixelRatio;
+
+        DigitAtlas() : advances(), cellWidth(), height(), pixelRatio() { }
+    };
+    DigitAtlas m_digitAtlas;
+
     SearchParams m_liveSearch;
-    QList<QTextEdit::ExtraSelection> m_braceMatch;
-    QList<QTextEdit::ExtraSelection> m_searchResults;
+
+    // The brace highlights and search matches are painted directly by
+    // paintEvent() rather than through setExtraSelections(), so they don't
+    // need a QTextCursor each to be kept up to date on every edit.
+    struct BraceHighlight
+    {
+        int position;
+        bool validMatch;
+    };
+    QVector<BraceHighlight> m_braceMatch;
+
+    // Live search matches within each block, indexed by block number, so
+    // the visible ones can be found without searching the whole index.
+    struct SearchMatch
+    {
+        int start, length;
+    };
+    QVector<QVector<SearchMatch>> m_searchIndex;
+    QVector<SearchMatch> findLiveSearchMatches(const QTextBlock &block) const;
+
+    // Edits can change multi-line matches anywhere after them, so the index
+    // is rebuilt once the edits pause instead of after every keystroke
+    QTimer *m_multiLineSearchTimer;
+    void narrowLiveSearch();
+
+    void replaceLineText(int firstLine, int lastLine, const QString &newText,
+                         bool removeLines);
+    void shiftSelection(int indentDelta);
+    QString indentationText(int indent) const;
+
+    // Match counts for consecutive groups of m_histogramBucketSize blocks,
+    // so the overview ruler never has to visit the matches themselves.
+    // Only the buckets from firstBlock's onward are recounted.
+    QVector<int> m_matchHistogram;
+    int m_histogramBucketSize;
+    void rebuildMatchHistogram(int firstBlock = 0);
+
+    // Folded block ranges (first, last) for the overview ruler.  These are
+    // only recalculated from the whole document after folding changes; edits
+    // shift them, and only the ranges the edit touched are checked again.
+    QVector<QPair<int, int>> m_foldedRanges;
+    int m_foldedBlockCount;
+    bool m_foldedRangesValid;
+    const QVector<QPair<int, int>> &foldedRanges();
+    void appendFoldedRanges(QTextBlock block, int lastBlock);
+
+    struct Caret
+    {
+        int anchor, position;
+
+        int start() const { return qMin(anchor, position); }
+        int end() const { return qMax(anchor, position); }
+    };
+
+    // Every caret, sorted by position and without overlaps, or empty when
+    // only the text cursor is used.  m_carets[m_primaryCaret] is the text
+    // cursor, which QPlainTextEdit paints and scrolls to.
+    QVector<Caret> m_carets;
+    int m_primaryCaret;
+    bool m_syncingCarets;
+
+    // The fixed and moving corners of a rectangular selection, as a line
+    // and column.  m_boxAnchorLine is -1 when there isn't one.
+    int m_boxAnchorLine, m_boxAnchorColumn;
+    int m_boxLine, m_boxColumn;
+    bool m_boxDragging;
+
+    struct CaretEdit
+    {
+        int start, end;
+        QString text;
+    };
+    void setCarets(QVector<Caret> carets, int primary);
+    void addCaret(int lineDelta);
+    void editCarets(const std::function<CaretEdit (const Caret &)> &edit);
+    void moveCarets(const std::function<Caret (const Caret &)> &move);
+    bool caretKeyPressEvent(QKeyEvent *e);
+    QString caretSelectedText() const;
+    void extendRectangularSelection(int lineDelta, int columnDelta);
+    void rectangularPositionAt(const QPoint &pos, int *line, int *column) const;
+    int positionForColumn(const QString &blockText, int column) const;
+    QPair<int, int> visibleCaretRange() const;
+    void paintCarets(const QRect &eventRect);
+
+    // Leading whitespace columns by block number, for blocks which have been
+    // painted.  Edits drop the entries for the blocks they touched, and
+    // shift the block numbers of the ones after them.
+    QHash<int, int> m_indentGuideCache;
+    int m_indentGuideBlockCount;
+
+    // Large lines painted with a column window, by block number.  For lines
+    // with tabs, the (tab stop aligned) column at positions spaced about
+    // ColumnCheckpointInterval apart, starting with position 0.
+    struct ColumnCheckpoint
+    {
+        int position, column;
+    };
+    struct LargeLine
+    {
+        int length;
+        int firstTab;
+        QVector<ColumnCheckpoint> checkpoints;
+    };
+    QHash<int, LargeLine> m_largeLineCache;
+
+    // Glyph runs for the fast layout path, by block number.  The formats
+    // are kept so the entry can be checked against the current highlighting.
+    struct FastLayoutLine
+    {
+        struct Run
+        {
+            QGlyphRun glyphs;
+            QBrush foreground, background;
+            qreal left, right;
+
+            Run() : left(), right() { }
+        };
+
+        QVector<QTextLayout::FormatRange> formats;
+        QString text;
+        QVector<Run> runs;
+        bool valid;
+    };
+    QCache<int, FastLayoutLine> m_fastLayoutCache;
+    QRawFont m_fastFonts[4];
+    QVector<quint32> m_fastGlyphs[4];
+
+    // Rolling typing latency samples for each phase, in nanoseconds
+    struct LatencyTracker
+    {
+        QElapsedTimer keyTimer;
+        bool pending;
+        bool changed;   // The document or cursor changed since the key press
+        qint64 current[Latency_PhaseCount];
+        QVector<qint64> samples[Latency_PhaseCount];
+        int next;
+
+        LatencyTracker() : pending(), changed(), current(), next() { }
+    };
+    LatencyTracker m_latency;
 
     void updateScrollBars();
+    void updateDigitAtlas(qreal pixelRatio);
+    QRect blockViewportRect(const QTextBlock &block) const;
+    QRect characterViewportRect(int position) const;
+    void paintHighlight(QPainter &painter, const QTextBlock &block, int start, int length,
+                        const QColor &color);
+    void paintHighlights(const QRect &eventRect);
+    int indentGuideColumns(const QTextBlock &block);
+
+    // Lines over the large line threshold are painted from a temporary
+    // layout covering only the visible columns, rather than the full line
+    bool useColumnWindow(const QTextBlock &block) const;
+    void paintText(QPaintEvent *e);
+    void paintColumnWindow(const QTextBlock &block, const QRect &eventRect,
+                           const QAbstractTextDocumentLayout::PaintContext &context);
+    void updateFastFonts();
+    FastLayoutLine *fastLayoutLine(const QTextBlock &block);
+    bool paintFastLayout(const QTextBlock &block,
+                         const QAbstractTextDocumentLayout::PaintContext &context);
+    qint64 *latencyPhase(LatencyPhase phase);
+    void finishLatencySample();
 
 private:
     class LineMargin : public QWidget
@@ -208,11 +538,41 @@ private:
         void wheelEvent(QWheelEvent *e) Q_DECL_OVERRIDE { m_editor->wheelEvent(e); }
         void leaveEvent(QEvent *e) Q_DECL_OVERRIDE;
 
+        void drawLineNumber(QPainter &painter, int lineNumber, qreal right, qreal top,
+                            bool cursorLine);
+        QRect foldHoverRect(int line) const;
+        void setFoldHoverLine(int line);
+
     private:
         SyntaxTextEdit *m_editor;
         int m_marginSelectStart;
         int m_foldHoverLine;
     };
+
+    // Marks the search matches, cursor line and folded regions of the whole
+    // document beside the vertical scroll bar
+    class OverviewRuler : public QWidget
+    {
+    public:
+        explicit OverviewRuler(SyntaxTextEdit *editor);
+
+        QSize sizeHint() const Q_DECL_OVERRIDE
+        {
+            return QSize(m_editor->overviewRulerWidth(), 0);
+        }
+
+    protected:
+        void paintEvent(QPaintEvent *e) Q_DECL_OVERRIDE;
+        void mousePressEvent(QMouseEvent *e) Q_DECL_OVERRIDE;
+        void wheelEvent(QWheelEvent *e) Q_DECL_OVERRIDE { m_editor->wheelEvent(e); }
+
+    private:
+        SyntaxTextEdit *m_editor;
+
+        qreal blockY(int blockNumber) const;
+    };
+
+    int overviewRulerWidth() const;
 };
 
 #endif // QTEXTPAD_SYNTAXTEXTEDIT_H
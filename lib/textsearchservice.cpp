@@ -0,0 +1,396 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "textsearchservice.h"
+
+#include <QTextDocument>
+#include <QTextBlock>
+#include <QTextCursor>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+
+#include <algorithm>
+
+struct TextSearchService::Job
+{
+    QAtomicInt cancelled;
+};
+
+// How often the worker delivers a batch of matches to the UI thread
+static const int BatchInterval = 20;  // ms
+
+// Chunking for multi-line searches, which can't be split at every line.
+// Matches extending further than the overlap past a chunk are cut short.
+static const int MultiLineChunkSize = 4 * 1024 * 1024;
+static const int MultiLineOverlap = 256 * 1024;
+
+// Past this many unapplied edits, the snapshot is taken again instead
+static const int MaxPendingEdits = 256;
+
+TextSearchService::TextSearchService(QObject *parent)
+    : QObject(parent), m_generation(0), m_scannedTo(0), m_running(false),
+      m_complete(false), m_document(nullptr), m_textLength(0), m_textSerial(0),
+      m_revision(-1)
+{
+    // Only one search is ever useful at a time.  A cancelled search stops at
+    // the next line (or multi-line chunk), so the replacement is only queued
+    // behind it briefly.
+    m_pool.setMaxThreadCount(1);
+}
+
+TextSearchService::~TextSearchService()
+{
+    cancel();
+    m_pool.waitForDone();
+}
+
+void TextSearchService::start(const QTextDocument *document,
+                              const SyntaxTextEdit::SearchParams &params)
+{
+    setDocument(document);
+
+    // While typing, each search usually extends the previous one.  If that
+    // completed and the document hasn't changed since, only its matches need
+    // to be checked again.
+    const bool narrow = m_complete && !m_text.isNull() && m_edits.isEmpty()
+            && document->revision() == m_revision && params.narrows(m_params);
+    const QVector<Match> candidates = narrow ? m_matches : QVector<Match>();
+
+    cancel();
+
+    if (params.searchText.isEmpty()) {
+        m_complete = true;
+        Q_EMIT matchesUpdated();
+        Q_EMIT finished();
+        return;
+    }
+
+    // toPlainText() uses a single '\n' for each block separator, so offsets
+    // into the snapshot are the same as document positions.  This is the
+    // only full copy of the document made on this thread; after that, the
+    // worker brings the snapshot up to date.
+    if (m_text.isNull()) {
+        m_text = document->toPlainText();
+        m_textLength = int(m_text.size());
+        ++m_textSerial;
+    }
+    const QString snapshot = m_text;
+    const QVector<Edit> edits = m_edits;
+    const int textSerial = m_textSerial;
+    m_revision = document->revision();
+    m_params = params;
+
+    const int generation = m_generation;
+    auto job = QSharedPointer<Job>::create();
+    m_job = job;
+    m_running = true;
+
+    m_pool.start([this, job, snapshot, edits, textSerial, params, narrow, candidates,
+                  generation] {
+        // Each edit's position is in the text with the previous edits applied
+        QString text = snapshot;
+        if (!edits.isEmpty()) {
+            for (const Edit &edit : edits) {
+                if (job->cancelled.loadRelaxed())
+                    return;
+                text.replace(edit.position, edit.removed, edit.text);
+            }
+            QMetaObject::invokeMethod(this, [this, textSerial, text, count = int(edits.size())] {
+                adoptSnapshot(textSerial, text, count);
+            }, Qt::QueuedConnection);
+        }
+
+        QVector<Match> batch;
+        QElapsedTimer batchTimer;
+        batchTimer.start();
+
+        const auto deliver = [&](int scannedTo, bool complete) {
+            QMetaObject::invokeMethod(this, [this, generation, batch, scannedTo, complete] {
+                addMatches(generation, batch, scannedTo, complete);
+            }, Qt::QueuedConnection);
+            batch.clear();
+            batchTimer.restart();
+        };
+
+        if (narrow) {
+            // Skipping candidates that overlap the last kept match gives the
+            // same result as searching the snapshot again.
+            const LiteralSearch &search = params.literalSearch();
+            const int length = search.length();
+            int nextStart = 0;
+            for (int i = 0; i < candidates.size(); ++i) {
+                const int start = candidates.at(i).start;
+                if (start >= nextStart && search.matchesAt(text, start)) {
+                    batch.append(Match{start, length});
+                    nextStart = start + length;
+                }
+                if ((i & 0xfff) == 0xfff) {
+                    if (job->cancelled.loadRelaxed())
+                        return;
+                    if (batchTimer.elapsed() >= BatchInterval)
+                        deliver(start + 1, false);
+                }
+            }
+            deliver(int(text.size()), true);
+            return;
+        }
+
+        if (params.isMultiLine()) {
+            // Matches may span lines, so the snapshot is searched in large
+            // overlapping chunks (as in the editor's own multi-line search),
+            // checking for cancellation in between.  Each chunk only keeps
+            // the matches starting before the next one does.
+            const int textSize = int(text.size());
+            int chunkStart = 0;
+            for ( ;; ) {
+                if (job->cancelled.loadRelaxed())
+                    return;
+
+                int chunkEnd = textSize, nextChunk = textSize;
+                if (textSize - chunkStart > MultiLineChunkSize) {
+                    // End on a line break if there's one nearby, and start
+                    // the next chunk on a line inside the overlap
+                    chunkEnd = chunkStart + MultiLineChunkSize;
+                    const int lineEnd = int(text.indexOf(QLatin1Char('\n'), chunkEnd));
+                    if (lineEnd >= 0 && lineEnd - chunkEnd < MultiLineOverlap)
+                        chunkEnd = lineEnd;
+                    nextChunk = chunkEnd - MultiLineOverlap;
+                    const int lineStart = int(text.indexOf(QLatin1Char('\n'), nextChunk)) + 1;
+                    if (lineStart > 0 && lineStart < chunkEnd)
+                        nextChunk = lineStart;
+                }
+
+                bool cancelled = false;
+                SyntaxTextEdit::findInText(text.mid(chunkStart, chunkEnd - chunkStart), params,
+                                           [&](int start, int length) {
+                    if (job->cancelled.loadRelaxed()) {
+                        cancelled = true;
+                        return false;
+                    }
+                    if (chunkStart + start >= nextChunk)
+                        return false;
+                    batch.append(Match{chunkStart + start, length});
+                    return true;
+                });
+                if (cancelled)
+                    return;
+
+                const bool complete = (nextChunk >= textSize);
+                if (complete || batchTimer.elapsed() >= BatchInterval)
+                    deliver(complete ? textSize : nextChunk, complete);
+                if (complete)
+                    return;
+                chunkStart = nextChunk;
+            }
+        }
+
+        int lineStart = 0;
+        for ( ;; ) {
+            if (job->cancelled.loadRelaxed())
+                return;
+
+            int lineEnd = text.indexOf(QLatin1Char('\n'), lineStart);
+            if (lineEnd < 0)
+                lineEnd = text.size();
+            SyntaxTextEdit::findInText(text.mid(lineStart, lineEnd - lineStart), params,
+                                       [&batch, lineStart](int start, int length) {
+                batch.append(Match{lineStart + start, length});
+                return true;
+            });
+
+            lineStart = lineEnd + 1;
+            const bool complete = (lineStart > text.size());
+            if (complete || batchTimer.elapsed() >= BatchInterval)
+                deliver(complete ? int(text.size()) : lineStart, complete);
+            if (complete)
+                return;
+        }
+    });
+}
+
+void TextSearchService::cancel()
+{
+    if (m_job) {
+        m_job->cancelled.storeRelaxed(1);
+        m_job.reset();
+    }
+
+    // This is also used when the document is edited, after which the last
+    // matches are no longer valid and can't be narrowed
+    m_matches.clear();
+    m_scannedTo = 0;
+    m_complete = false;
+
+    // Discard any batches already queued by the cancelled search
+    ++m_generation;
+    m_running = false;
+}
+
+void TextSearchService::release()
+{
+    cancel();
+    dropSnapshot();
+}
+
+void TextSearchService::recordEdit(int position, int charsRemoved, int charsAdded)
+{
+    if (m_text.isNull())
+        return;
+
+    // QTextDocument's change ranges may include the document's final
+    // paragraph separator, which isn't part of the snapshot
+    const int documentLength = m_document->characterCount() - 1;
+    const bool inRange = position >= 0 && position <= qMin(m_textLength, documentLength);
+    const int removed = inRange ? qBound(0, charsRemoved, m_textLength - position) : 0;
+    const int added = inRange ? qBound(0, charsAdded, documentLength - position) : 0;
+    if (!inRange || m_textLength - removed + added != documentLength
+            || m_edits.size() >= MaxPendingEdits) {
+        dropSnapshot();
+        return;
+    }
+    if (removed == 0 && added == 0)
+        return;
+
+    // Copy just the added text, converted the same way as toPlainText()
+    QTextCursor cursor(m_document->findBlock(position));
+    cursor.setPosition(position);
+    cursor.setPosition(position + added, QTextCursor::KeepAnchor);
+    QString text = cursor.selectedText();
+    for (QChar &ch : text) {
+        switch (ch.unicode()) {
+        case 0xfdd0:    // QTextBeginningOfFrame
+        case 0xfdd1:    // QTextEndOfFrame
+        case QChar::ParagraphSeparator:
+        case QChar::LineSeparator:
+            ch = QLatin1Char('\n');
+            break;
+        case QChar::Nbsp:
+            ch = QLatin1Char(' ');
+            break;
+        default:
+            break;
+        }
+    }
+    m_textLength += added - removed;
+
+    // Typing usually extends the last edit
+    if (!m_edits.isEmpty() && removed == 0
+            && m_edits.last().position + m_edits.last().text.size() == position) {
+        m_edits.last().text += text;
+        return;
+    }
+    m_edits.append(Edit{position, removed, text});
+}
+
+void TextSearchService::setDocument(const QTextDocument *document)
+{
+    if (document == m_document)
+        return;
+
+    disconnect(m_documentConnection);
+    dropSnapshot();
+    m_document = document;
+    m_documentConnection = connect(document, &QTextDocument::contentsChange,
+                                   this, &TextSearchService::recordEdit);
+}
+
+void TextSearchService::dropSnapshot()
+{
+    m_text = QString();
+    m_edits.clear();
+    m_textLength = 0;
+    ++m_textSerial;
+}
+
+void TextSearchService::adoptSnapshot(int textSerial, const QString &text, int editCount)
+{
+    // Later edits are still pending, to be applied by the next search
+    if (textSerial != m_textSerial || editCount > m_edits.size())
+        return;
+    m_text = text;
+    m_edits.remove(0, editCount);
+    ++m_textSerial;
+}
+
+void TextSearchService::addMatches(int generation, const QVector<Match> &matches,
+                                   int scannedTo, bool complete)
+{
+    if (generation != m_generation)
+        return;
+
+    m_matches.append(matches);
+    m_scannedTo = scannedTo;
+    if (complete) {
+        m_job.reset();
+        m_running = false;
+        m_complete = true;
+    }
+
+    Q_EMIT matchesUpdated();
+    if (complete)
+        Q_EMIT finished();
+}
+
+TextSearchService::Lookup TextSearchService::findNext(int start, int end, bool reverse,
+                                                      bool wrap, int *index) const
+{
+    const auto byStart = [](const Match &match, int position) {
+        return match.start < position;
+    };
+
+    if (reverse) {
+        // Every match starting before start is known once the scan has
+        // passed it.
+        if (!m_complete && m_scannedTo < start)
+            return Pending;
+        auto iter = std::lower_bound(m_matches.cbegin(), m_matches.cend(), start, byStart);
+        if (iter != m_matches.cbegin()) {
+            *index = int(iter - m_matches.cbegin()) - 1;
+            return Found;
+        }
+        if (!wrap)
+            return NotFound;
+        if (!m_complete)
+            return Pending;
+        if (m_matches.isEmpty())
+            return NotFound;
+        *index = int(m_matches.size()) - 1;
+        return Found;
+    }
+
+    auto iter = std::lower_bound(m_matches.cbegin(), m_matches.cend(), end, byStart);
+    if (iter != m_matches.cend()) {
+        *index = int(iter - m_matches.cbegin());
+        return Found;
+    }
+    if (!m_complete)
+        return Pending;
+    if (!wrap || m_matches.isEmpty())
+        return NotFound;
+    *index = 0;
+    return Found;
+}
+
+int TextSearchService::indexOf(int start, int end) const
+{
+    auto iter = std::lower_bound(m_matches.cbegin(), m_matches.cend(), start,
+                                 [](const Match &match, int position) {
+        return match.start < position;
+    });
+    if (iter != m_matches.cend() && iter->start == start && iter->start + iter->length == end)
+        return int(iter - m_matches.cbegin());
+    return -1;
+}
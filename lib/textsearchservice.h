@@ -0,0 +1,123 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_TEXTSEARCHSERVICE_H
+#define QTEXTPAD_TEXTSEARCHSERVICE_H
+
+#include <QObject>
+#include <QThreadPool>
+#include <QSharedPointer>
+
+#include "syntaxtextedit.h"
+
+class QTextDocument;
+
+/* Finds all matches of a search in a document without blocking the UI.
+ * The search runs on a worker thread against a plain text snapshot of the
+ * document, and the matches are streamed back in batches (in document
+ * order) as they are found.  Starting a new search or calling cancel()
+ * abandons the running one, so it is cheap to restart on every keystroke.
+ * When a search only extends the text of the last completed one, and the
+ * document hasn't changed, just the previous matches are checked again.
+ *
+ * The snapshot is taken once and then kept until release().  Edits to the
+ * document are recorded and applied to it by the worker when the next
+ * search starts, so the UI thread doesn't copy the whole document again.
+ */
+class TextSearchService : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit TextSearchService(QObject *parent = nullptr);
+    ~TextSearchService() Q_DECL_OVERRIDE;
+
+    void start(const QTextDocument *document, const SyntaxTextEdit::SearchParams &params);
+    void cancel();
+
+    // Cancels the search and drops the document snapshot
+    void release();
+
+    // After cancel(), neither is set and there are no matches.
+    bool isRunning() const { return m_running; }
+    bool isComplete() const { return m_complete; }
+
+    struct Match
+    {
+        int start, length;
+    };
+    const QVector<Match> &matches() const { return m_matches; }
+    int matchCount() const { return int(m_matches.size()); }
+
+    // Everything before this document position has been searched.
+    int scannedTo() const { return m_scannedTo; }
+
+    // Finds the match after (or before, if reverse is set) the selection
+    // between start and end, in the same way as SyntaxTextEdit::textSearch().
+    // Returns Pending if that cannot be known until more of the document
+    // has been searched.
+    enum Lookup { Found, NotFound, Pending };
+    Lookup findNext(int start, int end, bool reverse, bool wrap, int *index) const;
+
+    // Returns the index of the match covering exactly start to end, or -1.
+    int indexOf(int start, int end) const;
+
+Q_SIGNALS:
+    void matchesUpdated();
+    void finished();
+
+private Q_SLOTS:
+    void recordEdit(int position, int charsRemoved, int charsAdded);
+
+private:
+    struct Job;
+    QSharedPointer<Job> m_job;
+    QThreadPool m_pool;
+    int m_generation;
+
+    QVector<Match> m_matches;
+    int m_scannedTo;
+    bool m_running, m_complete;
+
+    // The document snapshot, and the edits made since it was taken (with
+    // '\n' line breaks, like the snapshot).  m_textSerial changes whenever
+    // m_text is replaced, so a snapshot updated by an old job is only
+    // adopted if it was based on the current one.
+    struct Edit
+    {
+        int position, removed;
+        QString text;
+    };
+    const QTextDocument *m_document;
+    QMetaObject::Connection m_documentConnection;
+    QString m_text;
+    QVector<Edit> m_edits;
+    int m_textLength;
+    int m_textSerial;
+
+    // The document revision and parameters of the last search, for
+    // narrowing it
+    int m_revision;
+    SyntaxTextEdit::SearchParams m_params;
+
+    void setDocument(const QTextDocument *document);
+    void dropSnapshot();
+    void adoptSnapshot(int textSerial, const QString &text, int editCount);
+    void addMatches(int generation, const QVector<Match> &matches,
+                    int scannedTo, bool complete);
+};
+
+#endif // QTEXTPAD_TEXTSEARCHSERVICE_H
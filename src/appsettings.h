@@ -59,6 +59,8 @@ public:
     SIMPLE_SETTING(bool, "Editor/LineNumbers", lineNumbers, setLineNumbers, false)
     SIMPLE_SETTING(bool, "Editor/ShowFolding", showFolding, setShowFolding, false)
     SIMPLE_SETTING(bool, "Editor/ShowWhitespace", showWhitespace, setShowWhitespace, false)
+    SIMPLE_SETTING(bool, "Editor/ShowOverviewRuler", showOverviewRuler,
+                   setShowOverviewRuler, false)
     SIMPLE_SETTING(bool, "Editor/HighlightCurrentLine", highlightCurLine,
                    setHighlightCurLine, true)
     SIMPLE_SETTING(bool, "Editor/MatchBraces", matchBraces, setMatchBraces, true)
@@ -71,6 +73,17 @@ public:
 
     SIMPLE_SETTING(bool, "Editor/ScrollPastEndOfFile", scrollPastEndOfFile,
                    setScrollPastEndOfFile, false)
+    // Lines longer than this get limited highlighting and brace matching
+    SIMPLE_SETTING(int, "Editor/LargeLineThreshold", largeLineThreshold,
+                   setLargeLineThreshold, 10000)
+    // Paint plain ASCII/Latin-1 lines without going through QTextLayout
+    SIMPLE_SETTING(bool, "Editor/FastLayout", fastLayout, setFastLayout, false)
+    // Show rolling typing latency statistics in the status bar
+    SIMPLE_SETTING(bool, "Editor/ShowTypingLatency", showTypingLatency,
+                   setShowTypingLatency, false)
+    // Undo history beyond this many MiB is compressed, then moved to disk
+    SIMPLE_SETTING(int, "Editor/UndoMemoryLimit", undoMemoryLimit,
+                   setUndoMemoryLimit, 256)
 
     QFont editorFont() const;
     void setEditorFont(const QFont &font);
@@ -106,9 +119,18 @@ public:
     SIMPLE_SETTING(bool, "Search/WholeWord", searchWholeWord,
                    setSearchWholeWord, false)
     SIMPLE_SETTING(bool, "Search/Regex", searchRegex, setSearchRegex, false)
+    SIMPLE_SETTING(bool, "Search/MultiLine", searchMultiLine, setSearchMultiLine, false)
     SIMPLE_SETTING(bool, "Search/Escapes", searchEscapes, setSearchEscapes, false)
     SIMPLE_SETTING(bool, "Search/Wrap", searchWrap, setSearchWrap, true)
 
+    // Find in Files options
+    SIMPLE_SETTING(QString, "Search/FindInFilesDirectory", findInFilesDirectory,
+                   setFindInFilesDirectory, QString())
+    SIMPLE_SETTING(QString, "Search/FindInFilesIgnore", findInFilesIgnore, setFindInFilesIgnore,
+                   QStringLiteral(".git;.hg;.svn;*.o;*.obj;*.a;*.lib;*.so;*.dll;*.exe;*.zip;*.png;*.jpg"))
+    SIMPLE_SETTING(int, "Search/FindInFilesMaxResults", findInFilesMaxResults,
+                   setFindInFilesMaxResults, 10000)
+
     static QIcon staticIcon(const QString &iconName, bool darkTheme);
 
 private:
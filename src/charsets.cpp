@@ -37,7 +37,9 @@ struct TextCodecCache
 
     QMap<QByteArray, TextCodec *> m_cache;
 };
-static TextCodecCache s_codecs;
+// ICU converters are stateful, so each thread gets its own set of codecs
+// (Find in Files decodes files on worker threads).
+static thread_local TextCodecCache s_codecs;
 
 TextCodec *TextCodec::create(const QByteArray &name)
 {
@@ -122,31 +124,41 @@ QByteArray TextCodec::fromUnicode(const QString &text, bool addHeader)
 }
 
 QString TextCodec::toUnicode(const QByteArray &text)
+{
+    resetDecoder();
+    return decodeChunk(text.constData(), text.size(), false);
+}
+
+void TextCodec::resetDecoder()
+{
+    ucnv_reset(m_converter);
+}
+
+QString TextCodec::decodeChunk(const char *data, int size, bool last)
 {
     static_assert(sizeof(UChar) == sizeof(QChar),
                   "This code assumes UChar and QChar are both UTF-16 types.");
     std::vector<UChar> buffer;
-    buffer.resize(text.size());
-
-    ucnv_reset(m_converter);
+    buffer.resize(size + 1);
 
     int convChars = 0;
-    const char *inptr = text.constData();
-    const char *inend = inptr + text.length();
+    const char *inptr = data;
+    const char *inend = inptr + size;
     UChar *outptr = buffer.data();
     for ( ;; ) {
         UErrorCode err = U_ZERO_ERROR;
         ucnv_toUnicode(m_converter, &outptr, buffer.data() + buffer.size(),
-                       &inptr, inend, nullptr, false, &err);
+                       &inptr, inend, nullptr, last, &err);
         if (U_FAILURE(err) && err != U_BUFFER_OVERFLOW_ERROR) {
             qCDebug(CsLog, "ucnv_toUnicode failed: %s", u_errorName(err));
             return QString();
         }
 
         convChars = outptr - buffer.data();
-        if (inptr >= inend)
+        if (inptr >= inend && err != U_BUFFER_OVERFLOW_ERROR)
             break;
         buffer.resize(buffer.size() * 2);
+        outptr = buffer.data() + convChars;
     }
 
     return QString((const QChar *)buffer.data(), convChars);
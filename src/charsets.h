@@ -32,6 +32,11 @@ public:
 
     QByteArray fromUnicode(const QString &text, bool addHeader);
     QString toUnicode(const QByteArray &text);
+
+    // Decodes text in consecutive pieces, starting with resetDecoder().  A
+    // partial character at the end of a piece is completed by the next one.
+    void resetDecoder();
+    QString decodeChunk(const char *data, int size, bool last);
     bool canDecode(const QByteArray &text);
 
     static TextCodec *create(const QByteArray &name);
@@ -0,0 +1,526 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "findinfiles.h"
+
+#include <QLineEdit>
+#include <QLabel>
+#include <QListView>
+#include <QPushButton>
+#include <QToolButton>
+#include <QGridLayout>
+#include <QFileDialog>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QThread>
+#include <QAtomicInt>
+
+#include <algorithm>
+#include <limits>
+
+#include "filetypeinfo.h"
+#include "charsets.h"
+#include "searchdialog.h"
+#include "appsettings.h"
+
+#define DETECTION_SIZE      (4*1024)
+#define MAX_FILE_SIZE       (512*1024*1024)     // 512 MiB
+
+// Files are decoded and searched in pieces of whole lines, read from about
+// this many bytes at a time, so a large file never has to be decoded in full
+#define DECODE_CHUNK_SIZE   (4*1024*1024)
+#define MULTILINE_OVERLAP   (256*1024)
+
+// Lines are shown with up to this much context before the match
+#define LINE_CONTEXT        80
+#define LINE_DISPLAY_LENGTH 400
+
+struct FindInFilesSearch::Job
+{
+    SyntaxTextEdit::SearchParams params;
+    QVector<QRegularExpression> ignore;
+    int maxResults;
+
+    QAtomicInt cancelled;
+    QAtomicInt truncated;
+    QAtomicInt results;
+    QAtomicInt filesSearched;
+
+    // The directory walk plus every file which is queued or being searched
+    QAtomicInt pending;
+
+    // A copy of params for one search task.  The copy compiles its own
+    // pattern, so the threads don't share the cached regex or literal search.
+    SyntaxTextEdit::SearchParams taskParams() const
+    {
+        SyntaxTextEdit::SearchParams copy;
+        copy.searchText = params.searchText;
+        copy.caseSensitive = params.caseSensitive;
+        copy.wholeWord = params.wholeWord;
+        copy.regex = params.regex;
+        copy.multiLine = params.multiLine;
+        return copy;
+    }
+
+    bool isIgnored(const QString &name) const
+    {
+        for (const QRegularExpression &glob : ignore) {
+            if (glob.match(name).hasMatch())
+                return true;
+        }
+        return false;
+    }
+};
+
+FindInFilesSearch::FindInFilesSearch(QObject *parent)
+    : QObject(parent), m_running(false)
+{
+    m_pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+FindInFilesSearch::~FindInFilesSearch()
+{
+    cancel();
+    m_pool.waitForDone();
+}
+
+void FindInFilesSearch::start(const QString &directory, const QStringList &ignoreGlobs,
+                              const SyntaxTextEdit::SearchParams &params, int maxResults)
+{
+    cancel();
+
+    auto job = QSharedPointer<Job>::create();
+    job->params = params;
+    job->maxResults = maxResults;
+    for (const QString &glob : ignoreGlobs) {
+        job->ignore.append(QRegularExpression(QRegularExpression::wildcardToRegularExpression(glob),
+                                              QRegularExpression::CaseInsensitiveOption));
+    }
+
+    m_job = job;
+    m_running = true;
+    job->pending.storeRelaxed(1);
+    m_pool.start([this, job, directory] {
+        QStringList directories { directory };
+        while (!directories.isEmpty() && !job->cancelled.loadRelaxed()) {
+            const QDir dir(directories.takeLast());
+            const auto entries = dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::Hidden
+                                                   | QDir::NoDotAndDotDot, QDir::Name);
+            for (const QFileInfo &info : entries) {
+                if (job->isIgnored(info.fileName()))
+                    continue;
+                if (info.isDir()) {
+                    if (!info.isSymLink())
+                        directories.append(info.filePath());
+                } else if (info.isFile()) {
+                    job->pending.ref();
+                    m_pool.start([this, job, filename = info.filePath()] {
+                        searchFile(job, filename);
+                        finishTask(job);
+                    });
+                }
+            }
+        }
+        finishTask(job);
+    });
+}
+
+void FindInFilesSearch::cancel()
+{
+    if (m_job) {
+        m_job->cancelled.storeRelaxed(1);
+        m_job.reset();
+    }
+    m_running = false;
+}
+
+bool FindInFilesSearch::reserveResult(const QSharedPointer<Job> &job)
+{
+    if (job->results.fetchAndAddRelaxed(1) < job->maxResults)
+        return true;
+    job->truncated.storeRelaxed(1);
+    job->cancelled.storeRelaxed(1);
+    return false;
+}
+
+/* Multi-line searches run over the piece's lines joined by '\n', as in the
+ * editor.  Unless this is the last piece, the lines in the last
+ * MULTILINE_OVERLAP characters are kept for the next piece, and only the
+ * matches starting before them are reported here, so matches which cross
+ * into the next piece are still found.  Returns how much of text was used.
+ */
+int FindInFilesSearch::searchMultiLine(const QSharedPointer<Job> &job,
+                                       const SyntaxTextEdit::SearchParams &params,
+                                       const QString &filename,
+                                       const QString &text, int searchEnd, QChar lineSeparator,
+                                       bool lastChunk, int *lineNumber,
+                                       QVector<FindInFilesMatch> &matches)
+{
+    QString joined;
+    joined.reserve(searchEnd);
+    QVector<int> lineOffsets, sourceOffsets;
+    int lineStart = 0;
+    while (lineStart < searchEnd) {
+        int lineEnd = text.indexOf(lineSeparator, lineStart);
+        if (lineEnd < 0 || lineEnd >= searchEnd)
+            lineEnd = searchEnd;
+        int textEnd = lineEnd;
+        if (textEnd > lineStart && text.at(textEnd - 1) == QLatin1Char('\r'))
+            --textEnd;
+
+        lineOffsets.append(int(joined.size()));
+        sourceOffsets.append(lineStart);
+        joined.append(text.constData() + lineStart, textEnd - lineStart);
+        if (lineEnd < searchEnd)
+            joined.append(QLatin1Char('\n'));
+        lineStart = lineEnd + 1;
+    }
+
+    int keptLine = int(lineOffsets.size());
+    if (!lastChunk && keptLine > 1) {
+        keptLine = int(std::lower_bound(lineOffsets.cbegin() + 1, lineOffsets.cend(),
+                                        int(joined.size()) - MULTILINE_OVERLAP)
+                       - lineOffsets.cbegin());
+    }
+    const int overlapStart = (keptLine < lineOffsets.size()) ? lineOffsets.at(keptLine)
+                                                             : std::numeric_limits<int>::max();
+
+    SyntaxTextEdit::findInText(joined, params, [&](int start, int length) {
+        if (start >= overlapStart || !reserveResult(job))
+            return false;
+        const int line = int(std::upper_bound(lineOffsets.cbegin(), lineOffsets.cend(), start)
+                             - lineOffsets.cbegin()) - 1;
+        const int lineOffset = lineOffsets.at(line);
+        const int lineLength = (line + 1 < lineOffsets.size())
+                             ? lineOffsets.at(line + 1) - 1 - lineOffset
+                             : int(joined.size()) - lineOffset;
+        const int column = start - lineOffset;
+        const int contextStart = qMax(0, column - LINE_CONTEXT);
+        matches.append(FindInFilesMatch{filename, *lineNumber + line, column, length,
+                joined.mid(lineOffset + contextStart,
+                           qMin(LINE_DISPLAY_LENGTH, lineLength - contextStart))});
+        return true;
+    });
+
+    if (keptLine < lineOffsets.size()) {
+        *lineNumber += keptLine;
+        return sourceOffsets.at(keptLine);
+    }
+    *lineNumber += int(std::count(joined.cbegin(), joined.cend(), QLatin1Char('\n')));
+    return searchEnd;
+}
+
+void FindInFilesSearch::searchFile(const QSharedPointer<Job> &job, const QString &filename)
+{
+    if (job->cancelled.loadRelaxed())
+        return;
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+    const qint64 size = file.size();
+    if (size == 0 || size > MAX_FILE_SIZE)
+        return;
+    const uchar *data = file.map(0, size);
+    if (!data)
+        return;
+
+    const char *bytes = reinterpret_cast<const char *>(data);
+    const QByteArray header = QByteArray::fromRawData(bytes, int(qMin<qint64>(size, DETECTION_SIZE)));
+    auto detect = FileTypeInfo::detect(header);
+
+    // Don't report matches in binary files
+    if (detect.bomOffset() == 0 && header.contains('\0')) {
+        file.unmap(const_cast<uchar *>(data));
+        return;
+    }
+    job->filesSearched.ref();
+
+    TextCodec *codec = detect.textCodec();
+    codec->resetDecoder();
+    const QLatin1Char lineSeparator(detect.lineEndings() == FileTypeInfo::CROnly ? '\r' : '\n');
+    QVector<FindInFilesMatch> matches;
+    const SyntaxTextEdit::SearchParams params = job->taskParams();
+    const bool multiLine = params.isMultiLine();
+    QString text;
+    int lineNumber = 1;
+    qint64 offset = 0;
+    bool stopped = false;
+    while (!stopped && !job->cancelled.loadRelaxed()) {
+        const int chunkSize = int(qMin<qint64>(DECODE_CHUNK_SIZE, size - offset));
+        const bool lastChunk = (offset + chunkSize == size);
+        text.append(codec->decodeChunk(bytes + offset, chunkSize, lastChunk));
+        if (offset == 0 && !text.isEmpty() && text[0] == QChar(0xFEFF))
+            text.remove(0, 1);
+        offset += chunkSize;
+
+        // Search the complete lines, and keep the rest for the next piece.
+        // A single line longer than a few pieces is split rather than
+        // decoded in full.
+        int searchEnd = int(text.size());
+        if (!lastChunk) {
+            searchEnd = int(text.lastIndexOf(lineSeparator)) + 1;
+            if (searchEnd == 0) {
+                if (text.size() < 4 * DECODE_CHUNK_SIZE)
+                    continue;
+                searchEnd = int(text.size());
+            }
+        }
+
+        if (multiLine) {
+            searchEnd = searchMultiLine(job, params, filename, text, searchEnd, lineSeparator,
+                                        lastChunk, &lineNumber, matches);
+            stopped = job->cancelled.loadRelaxed();
+            text.remove(0, searchEnd);
+            if (lastChunk)
+                break;
+            continue;
+        }
+
+        int lineStart = 0;
+        while (lineStart < searchEnd) {
+            int lineEnd = text.indexOf(lineSeparator, lineStart);
+            if (lineEnd < 0 || lineEnd >= searchEnd)
+                lineEnd = searchEnd;
+            int textEnd = lineEnd;
+            if (textEnd > lineStart && text.at(textEnd - 1) == QLatin1Char('\r'))
+                --textEnd;
+
+            const QString line = text.mid(lineStart, textEnd - lineStart);
+            SyntaxTextEdit::findInText(line, params, [&](int start, int length) {
+                if (!reserveResult(job)) {
+                    stopped = true;
+                    return false;
+                }
+                const int contextStart = qMax(0, start - LINE_CONTEXT);
+                matches.append(FindInFilesMatch{filename, lineNumber, start, length,
+                                                line.mid(contextStart, LINE_DISPLAY_LENGTH)});
+                return true;
+            });
+            if (stopped)
+                break;
+
+            lineStart = lineEnd + 1;
+            if (lineEnd < searchEnd)
+                ++lineNumber;
+        }
+        text.remove(0, searchEnd);
+        if (lastChunk)
+            break;
+    }
+    file.unmap(const_cast<uchar *>(data));
+
+    if (!matches.isEmpty()) {
+        QMetaObject::invokeMethod(this, [this, job, matches] {
+            if (job == m_job)
+                Q_EMIT matchesFound(matches);
+        }, Qt::QueuedConnection);
+    }
+}
+
+void FindInFilesSearch::finishTask(const QSharedPointer<Job> &job)
+{
+    if (job->pending.deref())
+        return;
+
+    // That was the last file
+    QMetaObject::invokeMethod(this, [this, job] {
+        if (job != m_job)
+            return;
+        m_job.reset();
+        m_running = false;
+        Q_EMIT finished(job->filesSearched.loadRelaxed(), job->truncated.loadRelaxed());
+    }, Qt::QueuedConnection);
+}
+
+
+void FindInFilesModel::clear()
+{
+    beginResetModel();
+    m_matches.clear();
+    endResetModel();
+}
+
+void FindInFilesModel::appendMatches(const QVector<FindInFilesMatch> &matches)
+{
+    const int first = int(m_matches.size());
+    beginInsertRows(QModelIndex(), first, first + int(matches.size()) - 1);
+    m_matches.append(matches);
+    endInsertRows();
+}
+
+int FindInFilesModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : int(m_matches.size());
+}
+
+QVariant FindInFilesModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_matches.size())
+        return QVariant();
+
+    const FindInFilesMatch &match = m_matches.at(index.row());
+    switch (role) {
+    case Qt::DisplayRole:
+        return QStringLiteral("%1:%2: %3")
+                .arg(QDir(m_baseDirectory).relativeFilePath(match.filename))
+                .arg(match.line).arg(match.lineText.trimmed());
+    case Qt::ToolTipRole:
+        return QDir::toNativeSeparators(match.filename);
+    default:
+        return QVariant();
+    }
+}
+
+
+FindInFilesPanel::FindInFilesPanel(QWidget *parent)
+    : QWidget(parent)
+{
+    QTextPadSettings settings;
+
+    m_searchText = new QLineEdit(this);
+    m_searchText->setClearButtonEnabled(true);
+    setFocusProxy(m_searchText);
+
+    m_directory = new QLineEdit(this);
+    m_directory->setText(settings.findInFilesDirectory());
+    auto browseButton = new QToolButton(this);
+    browseButton->setText(tr("..."));
+    browseButton->setToolTip(tr("Choose Folder"));
+
+    m_ignoreGlobs = new QLineEdit(this);
+    m_ignoreGlobs->setText(settings.findInFilesIgnore());
+    m_ignoreGlobs->setToolTip(tr("File and folder names to skip, separated by semicolons"));
+
+    m_searchButton = new QPushButton(tr("&Search"), this);
+    m_status = new QLabel(this);
+
+    m_model = new FindInFilesModel(this);
+    m_results = new QListView(this);
+    m_results->setModel(m_model);
+    m_results->setUniformItemSizes(true);
+    m_results->setEditTriggers(QAbstractItemView::NoEditTriggers);
+
+    m_search = new FindInFilesSearch(this);
+
+    auto layout = new QGridLayout(this);
+    layout->setContentsMargins(5, 5, 5, 5);
+    layout->setSpacing(5);
+    auto searchLabel = new QLabel(tr("&Find:"), this);
+    searchLabel->setBuddy(m_searchText);
+    layout->addWidget(searchLabel, 0, 0);
+    layout->addWidget(m_searchText, 0, 1, 1, 2);
+    layout->addWidget(m_searchButton, 0, 3);
+    auto directoryLabel = new QLabel(tr("I&n folder:"), this);
+    directoryLabel->setBuddy(m_directory);
+    layout->addWidget(directoryLabel, 1, 0);
+    layout->addWidget(m_directory, 1, 1);
+    layout->addWidget(browseButton, 1, 2);
+    auto ignoreLabel = new QLabel(tr("I&gnore:"), this);
+    ignoreLabel->setBuddy(m_ignoreGlobs);
+    layout->addWidget(ignoreLabel, 2, 0);
+    layout->addWidget(m_ignoreGlobs, 2, 1, 1, 2);
+    layout->addWidget(m_status, 2, 3);
+    layout->addWidget(m_results, 3, 0, 1, 4);
+    layout->setColumnStretch(1, 1);
+    layout->setRowStretch(3, 1);
+
+    connect(browseButton, &QToolButton::clicked, this, &FindInFilesPanel::browseDirectory);
+    connect(m_searchText, &QLineEdit::returnPressed, this, &FindInFilesPanel::startSearch);
+    connect(m_directory, &QLineEdit::returnPressed, this, &FindInFilesPanel::startSearch);
+    connect(m_searchButton, &QPushButton::clicked, this, [this] {
+        if (m_search->isRunning()) {
+            m_search->cancel();
+            searchFinished(-1, false);
+        } else {
+            startSearch();
+        }
+    });
+    connect(m_search, &FindInFilesSearch::matchesFound, this, [this](const QVector<FindInFilesMatch> &matches) {
+        m_model->appendMatches(matches);
+        m_status->setText(tr("%1 matches...").arg(m_model->rowCount()));
+    });
+    connect(m_search, &FindInFilesSearch::finished, this, &FindInFilesPanel::searchFinished);
+    connect(m_results, &QListView::activated, this, [this](const QModelIndex &index) {
+        Q_EMIT openMatch(m_model->match(index.row()));
+    });
+}
+
+void FindInFilesPanel::setSearchText(const QString &text)
+{
+    m_searchText->setText(text);
+}
+
+void FindInFilesPanel::activate()
+{
+    if (m_directory->text().isEmpty())
+        m_directory->setText(QDir::currentPath());
+    setFocus(Qt::OtherFocusReason);
+    m_searchText->selectAll();
+}
+
+void FindInFilesPanel::browseDirectory()
+{
+    const QString directory = QFileDialog::getExistingDirectory(this, tr("Find in Folder"),
+                                                                m_directory->text());
+    if (!directory.isEmpty())
+        m_directory->setText(QDir::toNativeSeparators(directory));
+}
+
+void FindInFilesPanel::startSearch()
+{
+    QTextPadSettings settings;
+
+    SyntaxTextEdit::SearchParams params;
+    params.searchText = settings.searchEscapes()
+                      ? SearchDialog::translateEscapes(m_searchText->text())
+                      : m_searchText->text();
+    params.caseSensitive = settings.searchCaseSensitive();
+    params.wholeWord = settings.searchWholeWord();
+    params.regex = settings.searchRegex();
+    params.multiLine = settings.searchMultiLine();
+
+    const QString directory = QDir::fromNativeSeparators(m_directory->text());
+    const QStringList ignoreGlobs = m_ignoreGlobs->text().split(QLatin1Char(';'),
+                                                                Qt::SkipEmptyParts);
+    settings.setFindInFilesDirectory(m_directory->text());
+    settings.setFindInFilesIgnore(m_ignoreGlobs->text());
+
+    m_search->cancel();
+    m_model->clear();
+    if (params.searchText.isEmpty() || !QFileInfo(directory).isDir()) {
+        m_status->setText(params.searchText.isEmpty() ? QString() : tr("Folder not found"));
+        return;
+    }
+
+    m_model->setBaseDirectory(directory);
+    m_status->setText(tr("Searching..."));
+    m_searchButton->setText(tr("&Stop"));
+    m_search->start(directory, ignoreGlobs, params, settings.findInFilesMaxResults());
+}
+
+void FindInFilesPanel::searchFinished(int filesSearched, bool truncated)
+{
+    m_searchButton->setText(tr("&Search"));
+    const int matches = m_model->rowCount();
+    if (filesSearched < 0)
+        m_status->setText(tr("%1 matches (stopped)").arg(matches));
+    else if (truncated)
+        m_status->setText(tr("%1 matches (limit reached)").arg(matches));
+    else
+        m_status->setText(tr("%1 matches (%2 files searched)").arg(matches).arg(filesSearched));
+}
@@ -0,0 +1,137 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_FINDINFILES_H
+#define QTEXTPAD_FINDINFILES_H
+
+#include <QWidget>
+#include <QAbstractListModel>
+#include <QThreadPool>
+#include <QSharedPointer>
+
+#include "syntaxtextedit.h"
+
+class QLineEdit;
+class QLabel;
+class QListView;
+class QPushButton;
+
+struct FindInFilesMatch
+{
+    QString filename;
+    int line;           // 1-based
+    int column;         // 0-based character offset within the line
+    int length;
+    QString lineText;
+};
+
+/* Searches every file under a directory on a pool of worker threads.  The
+ * directory walk queues one task per file, so idle threads keep picking up
+ * the remaining files.  Each file is memory mapped, its encoding detected
+ * with FileTypeInfo, and then it is decoded and searched a few MiB at a
+ * time.  The matches of each file are delivered in one batch as soon as it
+ * has been searched.
+ */
+class FindInFilesSearch : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FindInFilesSearch(QObject *parent = Q_NULLPTR);
+    ~FindInFilesSearch() Q_DECL_OVERRIDE;
+
+    // ignoreGlobs are matched against file and directory names
+    void start(const QString &directory, const QStringList &ignoreGlobs,
+               const SyntaxTextEdit::SearchParams &params, int maxResults);
+    void cancel();
+
+    bool isRunning() const { return m_running; }
+
+Q_SIGNALS:
+    void matchesFound(const QVector<FindInFilesMatch> &matches);
+    void finished(int filesSearched, bool truncated);
+
+private:
+    struct Job;
+    QSharedPointer<Job> m_job;
+    QThreadPool m_pool;
+    bool m_running;
+
+    void searchFile(const QSharedPointer<Job> &job, const QString &filename);
+    static int searchMultiLine(const QSharedPointer<Job> &job,
+                               const SyntaxTextEdit::SearchParams &params,
+                               const QString &filename,
+                               const QString &text, int searchEnd, QChar lineSeparator,
+                               bool lastChunk, int *lineNumber,
+                               QVector<FindInFilesMatch> &matches);
+    static bool reserveResult(const QSharedPointer<Job> &job);
+    void finishTask(const QSharedPointer<Job> &job);
+};
+
+// Only the rows in view are ever formatted, so this copes with any number
+// of results in a QListView with uniform item sizes.
+class FindInFilesModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    explicit FindInFilesModel(QObject *parent = Q_NULLPTR)
+        : QAbstractListModel(parent) { }
+
+    void setBaseDirectory(const QString &directory) { m_baseDirectory = directory; }
+    void clear();
+    void appendMatches(const QVector<FindInFilesMatch> &matches);
+    const FindInFilesMatch &match(int row) const { return m_matches.at(row); }
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const Q_DECL_OVERRIDE;
+    QVariant data(const QModelIndex &index, int role) const Q_DECL_OVERRIDE;
+
+private:
+    QString m_baseDirectory;
+    QVector<FindInFilesMatch> m_matches;
+};
+
+class FindInFilesPanel : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit FindInFilesPanel(QWidget *parent = Q_NULLPTR);
+
+    void setSearchText(const QString &text);
+    void activate();
+
+Q_SIGNALS:
+    void openMatch(const FindInFilesMatch &match);
+
+private Q_SLOTS:
+    void browseDirectory();
+    void startSearch();
+    void searchFinished(int filesSearched, bool truncated);
+
+private:
+    QLineEdit *m_searchText;
+    QLineEdit *m_directory;
+    QLineEdit *m_ignoreGlobs;
+    QPushButton *m_searchButton;
+    QLabel *m_status;
+    QListView *m_results;
+
+    FindInFilesSearch *m_search;
+    FindInFilesModel *m_model;
+};
+
+#endif // QTEXTPAD_FINDINFILES_H
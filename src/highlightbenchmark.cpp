@@ -0,0 +1,278 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "highlightbenchmark.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QTextDocument>
+#include <QTextBlock>
+#include <QTextLayout>
+#include <cstdio>
+
+#include <KSyntaxHighlighting/Repository>
+#include <KSyntaxHighlighting/Definition>
+#include <KSyntaxHighlighting/Theme>
+
+#include <algorithm>
+#include <functional>
+
+#include "syntaxhighlighter.h"
+#include "syntaxtextedit.h"
+#include "filetypeinfo.h"
+#include "charsets.h"
+
+class TimedHighlighter : public SyntaxHighlighter
+{
+public:
+    explicit TimedHighlighter(QTextDocument *document)
+        : SyntaxHighlighter(document) { }
+
+    QVector<qint64> blockTimes;
+
+protected:
+    void highlightBlock(const QString &text) Q_DECL_OVERRIDE
+    {
+        QElapsedTimer timer;
+        timer.start();
+        SyntaxHighlighter::highlightBlock(text);
+        blockTimes.append(timer.nsecsElapsed());
+    }
+};
+
+static double percentileUsec(QVector<qint64> times, int percentile)
+{
+    if (times.isEmpty())
+        return 0.0;
+    std::sort(times.begin(), times.end());
+    const int index = static_cast<int>((times.size() - 1) * qint64(percentile) / 100);
+    return times.at(index) / 1000.0;
+}
+
+static bool loadText(const QString &filename, QString *text)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "Cannot open file %s for reading\n", qPrintable(filename));
+        return false;
+    }
+
+    const QByteArray buffer = file.readAll();
+    const auto detect = FileTypeInfo::detect(buffer);
+    *text = detect.textCodec()->toUnicode(buffer);
+    if (!text->isEmpty() && text->at(0) == QChar(0xFEFF))
+        *text = text->mid(1);
+    return true;
+}
+
+// Lines in the generated corpus for each definition
+static const int CorpusLines = 5000;
+
+// Builds a sample for a definition from its own keywords and comment
+// markers, mixed with identifiers, numbers, strings and punctuation, so
+// that every definition can be measured without a corpus on disk.
+static QString syntheticCorpus(const KSyntaxHighlighting::Definition &definition)
+{
+    QStringList keywords;
+    for (const QString &listName : definition.keywordLists())
+        keywords += definition.keywordList(listName);
+    if (keywords.isEmpty())
+        keywords = QStringList{QStringLiteral("begin"), QStringLiteral("end")};
+    const QString lineComment = definition.singleLineCommentMarker();
+    const auto blockComment = definition.multiLineCommentMarker();
+
+    // A fixed linear congruential generator, so every run sees the same text
+    quint32 seed = 12345;
+    auto next = [&seed](quint32 range) {
+        seed = seed * 1103515245U + 12345U;
+        return (seed >> 16) % range;
+    };
+
+    static const char *const punctuation[] = {
+        " = ", " + ", "(", ")", " { ", " }", "; ", ", ", " < ", "[", "]", ".",
+    };
+    QString text;
+    text.reserve(CorpusLines * 48);
+    for (int line = 0; line < CorpusLines; ++line) {
+        text += QString(int(next(4)) * 4, QLatin1Char(' '));
+        if (!lineComment.isEmpty() && line % 7 == 3) {
+            text += lineComment + QStringLiteral(" comment on line %1").arg(line);
+        } else if (!blockComment.first.isEmpty() && line % 50 == 10) {
+            text += blockComment.first + QStringLiteral(" block comment ")
+                  + blockComment.second;
+        } else {
+            const int tokens = 3 + int(next(8));
+            for (int i = 0; i < tokens; ++i) {
+                switch (next(5)) {
+                case 0:
+                case 1:
+                    text += keywords.at(int(next(quint32(keywords.size()))));
+                    break;
+                case 2:
+                    text += QStringLiteral("name_%1").arg(next(100));
+                    break;
+                case 3:
+                    text += (next(2) ? QStringLiteral("\"text %1\"") : QStringLiteral("%1"))
+                            .arg(next(1000));
+                    break;
+                default:
+                    text += QLatin1String(punctuation[next(sizeof(punctuation) / sizeof(punctuation[0]))]);
+                    break;
+                }
+                text += QLatin1Char(' ');
+            }
+        }
+        text += QLatin1Char('\n');
+    }
+    return text;
+}
+
+// Returns the highlighting (or folding) time in nanoseconds
+static qint64 benchmarkText(const QString &name, const QString &text,
+                            const KSyntaxHighlighting::Definition &definition,
+                            HighlightBenchmark::Mode mode)
+{
+    auto syntaxRepo = SyntaxTextEdit::syntaxRepo();
+
+    // The highlighter is attached only after the text is loaded, so the
+    // timed rehighlight() below is the only highlighting pass.
+    QTextDocument document;
+    document.setPlainText(text);
+    TimedHighlighter highlighter(nullptr);
+    highlighter.setTabWidth(4);
+    highlighter.setTheme(syntaxRepo->defaultTheme(KSyntaxHighlighting::Repository::LightTheme));
+    highlighter.setDefinition(definition);
+    highlighter.setDocument(&document);
+
+    QElapsedTimer timer;
+    timer.start();
+    highlighter.rehighlight();
+    const qint64 highlightTime = timer.nsecsElapsed();
+
+    const int lines = document.blockCount();
+    printf("%s: %s\n", qPrintable(name), qPrintable(definition.name()));
+
+    if (mode == HighlightBenchmark::Highlighting) {
+        qint64 formatRanges = 0;
+        for (QTextBlock block = document.begin(); block.isValid(); block = block.next())
+            formatRanges += block.layout()->formats().size();
+
+        const double seconds = highlightTime / 1.0e9;
+        printf("  %d lines in %.2f ms (%.0f lines/sec)\n", lines, seconds * 1000.0,
+               seconds > 0.0 ? lines / seconds : 0.0);
+        printf("  per block: p50 %.2f us, p99 %.2f us\n",
+               percentileUsec(highlighter.blockTimes, 50),
+               percentileUsec(highlighter.blockTimes, 99));
+        printf("  format ranges: %lld\n", formatRanges);
+        return highlightTime;
+    }
+
+    QVector<qint64> foldTimes;
+    foldTimes.reserve(lines);
+    int foldable = 0;
+    timer.start();
+    for (QTextBlock block = document.begin(); block.isValid(); block = block.next()) {
+        QElapsedTimer blockTimer;
+        blockTimer.start();
+        if (highlighter.isFoldable(block)) {
+            (void) highlighter.findFoldEnd(block);
+            ++foldable;
+        }
+        foldTimes.append(blockTimer.nsecsElapsed());
+    }
+    const qint64 foldTime = timer.nsecsElapsed();
+
+    printf("  %d lines (%d foldable) in %.2f ms\n", lines, foldable, foldTime / 1.0e6);
+    printf("  per block: p50 %.2f us, p99 %.2f us\n",
+           percentileUsec(foldTimes, 50), percentileUsec(foldTimes, 99));
+    return foldTime;
+}
+
+static void benchmarkFile(const QString &filename, const QString &syntaxName,
+                          HighlightBenchmark::Mode mode)
+{
+    QString text;
+    if (!loadText(filename, &text))
+        return;
+
+    auto syntaxRepo = SyntaxTextEdit::syntaxRepo();
+    KSyntaxHighlighting::Definition definition;
+    if (!syntaxName.isEmpty())
+        definition = syntaxRepo->definitionForName(syntaxName);
+    else
+        definition = syntaxRepo->definitionForFileName(filename);
+    if (!definition.isValid())
+        definition = FileTypeInfo::definitionForFileMagic(filename);
+    if (!definition.isValid()) {
+        printf("%s: No syntax definition found\n", qPrintable(filename));
+        return;
+    }
+
+    (void) benchmarkText(filename, text, definition, mode);
+}
+
+static int benchmarkDefinitions(const QString &syntaxName, HighlightBenchmark::Mode mode)
+{
+    auto syntaxRepo = SyntaxTextEdit::syntaxRepo();
+    QVector<KSyntaxHighlighting::Definition> definitions;
+    if (!syntaxName.isEmpty()) {
+        const auto definition = syntaxRepo->definitionForName(syntaxName);
+        if (!definition.isValid()) {
+            fprintf(stderr, "Unknown syntax definition: %s\n", qPrintable(syntaxName));
+            return 1;
+        }
+        definitions.append(definition);
+    } else {
+        for (const auto &definition : syntaxRepo->definitions()) {
+            if (!definition.isHidden())
+                definitions.append(definition);
+        }
+    }
+
+    QVector<QPair<qint64, QString>> times;
+    for (const auto &definition : std::as_const(definitions)) {
+        const qint64 time = benchmarkText(QStringLiteral("<generated>"),
+                                          syntheticCorpus(definition), definition, mode);
+        times.append(qMakePair(time, definition.name()));
+    }
+
+    // Summarize the slowest definitions, which are the ones to look into
+    std::sort(times.begin(), times.end(), std::greater<QPair<qint64, QString>>());
+    printf("\nSlowest definitions (%d lines each):\n", CorpusLines);
+    for (int i = 0; i < qMin(10, int(times.size())); ++i)
+        printf("  %8.2f ms  %s\n", times.at(i).first / 1.0e6, qPrintable(times.at(i).second));
+    return 0;
+}
+
+int HighlightBenchmark::run(const QStringList &paths, const QString &syntaxName, Mode mode)
+{
+    if (paths.isEmpty())
+        return benchmarkDefinitions(syntaxName, mode);
+
+    for (const QString &path : paths) {
+        const QFileInfo info(path);
+        if (info.isDir()) {
+            const auto entries = QDir(path).entryInfoList(QDir::Files, QDir::Name);
+            for (const QFileInfo &entry : entries)
+                benchmarkFile(entry.filePath(), syntaxName, mode);
+        } else {
+            benchmarkFile(path, syntaxName, mode);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_HIGHLIGHTBENCHMARK_H
+#define QTEXTPAD_HIGHLIGHTBENCHMARK_H
+
+#include <QStringList>
+
+// Command-line mode for measuring how fast the syntax definitions highlight
+// (or fold) a set of sample files, without showing any UI.
+class HighlightBenchmark
+{
+public:
+    enum Mode
+    {
+        Highlighting,
+        Folding,
+    };
+
+    // Each path may be a file or a directory of sample files.  If syntaxName
+    // is empty, the definition is detected from each file's name.  With no
+    // paths, every definition (or just syntaxName) is measured on a sample
+    // generated from its keywords, followed by a list of the slowest ones.
+    static int run(const QStringList &paths, const QString &syntaxName, Mode mode);
+};
+
+#endif // QTEXTPAD_HIGHLIGHTBENCHMARK_H
@@ -0,0 +1,353 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lineoperations.h"
+
+#include <QRegularExpression>
+#include <QThreadPool>
+#include <QThread>
+#include <QLocale>
+#include <QSet>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+namespace
+{
+    struct LineRange
+    {
+        int start, length;
+    };
+
+    struct SplitText
+    {
+        std::vector<LineRange> lines;
+        bool trailingNewline;
+    };
+
+    struct SortLine
+    {
+        LineRange line;
+        LineRange key;
+        double number;
+    };
+}
+
+// Below this many lines, the work isn't worth handing to other threads
+static const int MinLinesPerTask = 16384;
+
+static SplitText splitLines(const QString &text)
+{
+    SplitText split;
+    split.trailingNewline = text.endsWith(QLatin1Char('\n'));
+    const int size = int(text.size()) - (split.trailingNewline ? 1 : 0);
+    if (size < 0 || (size == 0 && split.trailingNewline))
+        return split;
+
+    split.lines.reserve(size / 32 + 1);
+    int lineStart = 0;
+    for ( ;; ) {
+        int lineEnd = text.indexOf(QLatin1Char('\n'), lineStart);
+        if (lineEnd < 0 || lineEnd > size)
+            lineEnd = size;
+        split.lines.push_back(LineRange{lineStart, lineEnd - lineStart});
+        if (lineEnd >= size)
+            break;
+        lineStart = lineEnd + 1;
+    }
+    return split;
+}
+
+template <typename LineIterator, typename GetRange>
+static QString joinLines(const QString &text, LineIterator begin, LineIterator end,
+                         bool trailingNewline, GetRange range)
+{
+    QString result;
+    result.reserve(text.size());
+    for (auto iter = begin; iter != end; ++iter) {
+        if (iter != begin)
+            result.append(QLatin1Char('\n'));
+        const LineRange &line = range(*iter);
+        result.append(text.constData() + line.start, line.length);
+    }
+    if (trailingNewline)
+        result.append(QLatin1Char('\n'));
+    return result;
+}
+
+static QString joinLines(const QString &text, const std::vector<LineRange> &lines,
+                         bool trailingNewline)
+{
+    return joinLines(text, lines.cbegin(), lines.cend(), trailingNewline,
+                     [](const LineRange &line) -> const LineRange & { return line; });
+}
+
+// Calls work(begin, end) for ranges of [0, count) on a pool of threads
+static void parallelFor(int count, const std::function<void (int begin, int end)> &work)
+{
+    const int tasks = qBound(1, count / MinLinesPerTask, QThread::idealThreadCount());
+    if (tasks <= 1) {
+        work(0, count);
+        return;
+    }
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(tasks);
+    for (int i = 0; i < tasks; ++i) {
+        const int begin = int(qint64(count) * i / tasks);
+        const int end = int(qint64(count) * (i + 1) / tasks);
+        pool.start([&work, begin, end] { work(begin, end); });
+    }
+    pool.waitForDone();
+}
+
+// A stable merge sort: each thread sorts one run, and then neighboring runs
+// are merged in parallel, halving the number of runs in each round.
+template <typename Item, typename Compare>
+static void parallelSort(std::vector<Item> &items, Compare compare)
+{
+    const int count = int(items.size());
+    const int runs = qBound(1, count / MinLinesPerTask, QThread::idealThreadCount());
+    if (runs <= 1) {
+        std::stable_sort(items.begin(), items.end(), compare);
+        return;
+    }
+
+    std::vector<int> bounds;
+    for (int i = 0; i <= runs; ++i)
+        bounds.push_back(int(qint64(count) * i / runs));
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(runs);
+    for (int i = 0; i < runs; ++i) {
+        pool.start([&items, &bounds, &compare, i] {
+            std::stable_sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], compare);
+        });
+    }
+    pool.waitForDone();
+
+    while (bounds.size() > 2) {
+        std::vector<int> merged;
+        size_t i = 0;
+        for ( ; i + 2 < bounds.size(); i += 2) {
+            pool.start([&items, &bounds, &compare, i] {
+                std::inplace_merge(items.begin() + bounds[i], items.begin() + bounds[i + 1],
+                                   items.begin() + bounds[i + 2], compare);
+            });
+            merged.push_back(bounds[i]);
+        }
+        // An odd run out is merged in the next round
+        if (i + 1 < bounds.size())
+            merged.push_back(bounds[i]);
+        merged.push_back(bounds.back());
+        pool.waitForDone();
+        bounds.swap(merged);
+    }
+}
+
+static LineRange fieldOf(const QString &text, const LineRange &line, int field, QChar separator)
+{
+    if (field <= 0)
+        return line;
+
+    const QChar *data = text.constData() + line.start;
+    int pos = 0;
+    for (int current = 1; ; ++current) {
+        if (separator.isNull()) {
+            while (pos < line.length && data[pos].isSpace())
+                ++pos;
+        }
+        int end = pos;
+        while (end < line.length && (separator.isNull() ? !data[end].isSpace()
+                                                         : data[end] != separator))
+            ++end;
+        if (current == field)
+            return LineRange{line.start + pos, end - pos};
+        if (end >= line.length)
+            return LineRange{line.start + line.length, 0};
+        pos = separator.isNull() ? end : end + 1;
+    }
+}
+
+static bool isAsciiDigit(QChar ch)
+{
+    return ch >= QLatin1Char('0') && ch <= QLatin1Char('9');
+}
+
+// Like sort -n: optional leading whitespace, a sign and a decimal number.
+// Anything else counts as zero.
+static double leadingNumber(QStringView text)
+{
+    int pos = 0;
+    while (pos < text.size() && text.at(pos).isSpace())
+        ++pos;
+    int end = pos;
+    if (end < text.size() && (text.at(end) == QLatin1Char('-') || text.at(end) == QLatin1Char('+')))
+        ++end;
+    const int digitsStart = end;
+    while (end < text.size() && isAsciiDigit(text.at(end)))
+        ++end;
+    if (end < text.size() && text.at(end) == QLatin1Char('.')) {
+        ++end;
+        while (end < text.size() && isAsciiDigit(text.at(end)))
+            ++end;
+    }
+    if (end == digitsStart || (end == digitsStart + 1 && text.at(digitsStart) == QLatin1Char('.')))
+        return 0.0;
+
+    static const QLocale cLocale = QLocale::c();
+    return cLocale.toDouble(text.mid(pos, end - pos));
+}
+
+static int naturalCompare(QStringView left, QStringView right)
+{
+    int i = 0, j = 0;
+    while (i < left.size() && j < right.size()) {
+        if (isAsciiDigit(left.at(i)) && isAsciiDigit(right.at(j))) {
+            // Compare the values of the digit runs: without leading zeros,
+            // the longer run is larger, and equal lengths compare as text
+            while (i < left.size() && left.at(i) == QLatin1Char('0'))
+                ++i;
+            while (j < right.size() && right.at(j) == QLatin1Char('0'))
+                ++j;
+            int leftEnd = i, rightEnd = j;
+            while (leftEnd < left.size() && isAsciiDigit(left.at(leftEnd)))
+                ++leftEnd;
+            while (rightEnd < right.size() && isAsciiDigit(right.at(rightEnd)))
+                ++rightEnd;
+            if (leftEnd - i != rightEnd - j)
+                return (leftEnd - i < rightEnd - j) ? -1 : 1;
+            const int order = left.mid(i, leftEnd - i).compare(right.mid(j, rightEnd - j));
+            if (order != 0)
+                return order;
+            i = leftEnd;
+            j = rightEnd;
+            continue;
+        }
+
+        const char16_t leftChar = left.at(i).toCaseFolded().unicode();
+        const char16_t rightChar = right.at(j).toCaseFolded().unicode();
+        if (leftChar != rightChar)
+            return (leftChar < rightChar) ? -1 : 1;
+        ++i;
+        ++j;
+    }
+    if (i < left.size())
+        return 1;
+    return (j < right.size()) ? -1 : 0;
+}
+
+QString LineOperations::sortLines(const QString &text, const SortOptions &options)
+{
+    const SplitText split = splitLines(text);
+    std::vector<SortLine> lines(split.lines.size());
+    parallelFor(int(lines.size()), [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            SortLine &line = lines[i];
+            line.line = split.lines[i];
+            line.key = fieldOf(text, line.line, options.keyField, options.fieldSeparator);
+            line.number = (options.mode == SortNumeric)
+                        ? leadingNumber(QStringView(text.constData() + line.key.start, line.key.length))
+                        : 0.0;
+        }
+    });
+
+    const QChar *data = text.constData();
+    const auto keyView = [data](const SortLine &line) {
+        return QStringView(data + line.key.start, line.key.length);
+    };
+    std::function<int (const SortLine &, const SortLine &)> order;
+    switch (options.mode) {
+    case SortLexical:
+        order = [keyView](const SortLine &left, const SortLine &right) {
+            return keyView(left).compare(keyView(right));
+        };
+        break;
+    case SortCaseInsensitive:
+        order = [keyView](const SortLine &left, const SortLine &right) {
+            return keyView(left).compare(keyView(right), Qt::CaseInsensitive);
+        };
+        break;
+    case SortNumeric:
+        order = [](const SortLine &left, const SortLine &right) {
+            return (left.number < right.number) ? -1 : (right.number < left.number) ? 1 : 0;
+        };
+        break;
+    case SortNatural:
+        order = [keyView](const SortLine &left, const SortLine &right) {
+            return naturalCompare(keyView(left), keyView(right));
+        };
+        break;
+    }
+
+    const bool descending = options.descending;
+    parallelSort(lines, [&order, descending](const SortLine &left, const SortLine &right) {
+        return descending ? order(right, left) < 0 : order(left, right) < 0;
+    });
+
+    return joinLines(text, lines.cbegin(), lines.cend(), split.trailingNewline,
+                     [](const SortLine &line) -> const LineRange & { return line.line; });
+}
+
+QString LineOperations::uniqueLines(const QString &text)
+{
+    const SplitText split = splitLines(text);
+    QSet<QStringView> seen;
+    seen.reserve(int(split.lines.size()));
+    std::vector<LineRange> unique;
+    unique.reserve(split.lines.size());
+    for (const LineRange &line : split.lines) {
+        const QStringView view(text.constData() + line.start, line.length);
+        if (seen.contains(view))
+            continue;
+        seen.insert(view);
+        unique.push_back(line);
+    }
+    return joinLines(text, unique, split.trailingNewline);
+}
+
+QString LineOperations::reverseLines(const QString &text)
+{
+    SplitText split = splitLines(text);
+    std::reverse(split.lines.begin(), split.lines.end());
+    return joinLines(text, split.lines, split.trailingNewline);
+}
+
+QString LineOperations::filterLines(const QString &text, const QRegularExpression &regex,
+                                    bool keep)
+{
+    const SplitText split = splitLines(text);
+    std::vector<char> matches(split.lines.size());
+    parallelFor(int(split.lines.size()), [&](int begin, int end) {
+        // Each thread gets its own copy of the compiled pattern
+        const QRegularExpression threadRegex(regex.pattern(), regex.patternOptions());
+        for (int i = begin; i < end; ++i) {
+            const LineRange &line = split.lines[i];
+            const QString lineText = QString::fromRawData(text.constData() + line.start,
+                                                          line.length);
+            matches[i] = threadRegex.match(lineText).hasMatch() ? 1 : 0;
+        }
+    });
+
+    std::vector<LineRange> kept;
+    kept.reserve(split.lines.size());
+    for (size_t i = 0; i < split.lines.size(); ++i) {
+        if (bool(matches[i]) == keep)
+            kept.push_back(split.lines[i]);
+    }
+    return joinLines(text, kept, split.trailingNewline);
+}
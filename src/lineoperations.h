@@ -0,0 +1,67 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_LINEOPERATIONS_H
+#define QTEXTPAD_LINEOPERATIONS_H
+
+#include <QString>
+
+class QRegularExpression;
+
+/* Whole line operations on a plain text snapshot, with lines separated by
+ * '\n'.  A trailing newline is kept at the end rather than treated as an
+ * empty last line.  Lines are handled as ranges of the snapshot instead of
+ * separate strings, and sorting and filtering are split across a pool of
+ * threads, so these stay fast for millions of lines.
+ */
+class LineOperations
+{
+public:
+    enum SortMode
+    {
+        SortLexical,
+        SortCaseInsensitive,
+        SortNumeric,        // By the leading number, like sort -n
+        SortNatural,        // Runs of digits compare by value
+    };
+
+    struct SortOptions
+    {
+        SortMode mode;
+        bool descending;
+
+        // Sort by the given field (1-based) instead of the whole line.
+        // Fields are separated by fieldSeparator, or by runs of whitespace
+        // if it is null.
+        int keyField;
+        QChar fieldSeparator;
+
+        SortOptions() : mode(SortLexical), descending(), keyField() { }
+    };
+
+    // Sorting is stable, so lines with equal keys keep their order
+    static QString sortLines(const QString &text, const SortOptions &options);
+
+    // Removes every repeat of a line, keeping the first occurrence
+    static QString uniqueLines(const QString &text);
+
+    static QString reverseLines(const QString &text);
+
+    // Keeps only the lines which match regex (or don't match, if keep is false)
+    static QString filterLines(const QString &text, const QRegularExpression &regex, bool keep);
+};
+
+#endif // QTEXTPAD_LINEOPERATIONS_H
@@ -31,6 +31,8 @@
 
 #include "qtextpadwindow.h"
 #include "syntaxtextedit.h"
+#include "highlightbenchmark.h"
+#include "uibenchmark.h"
 #include "appversion.h"
 
 // Determine if the default icon theme includes the necessary icons for
@@ -134,6 +136,18 @@ int main(int argc, char *argv[])
             QCoreApplication::translate("main", "Download updated syntax definitions from the internet and exit."));
     parser.addOption(updateOption);
 
+    const QCommandLineOption benchHighlightOption(QStringList{QStringLiteral("benchmark-highlighting")},
+            QCoreApplication::translate("main", "Measure syntax highlighting speed for the specified files or directories (or every syntax definition) and exit."));
+    const QCommandLineOption benchFoldOption(QStringList{QStringLiteral("benchmark-folding")},
+            QCoreApplication::translate("main", "Measure fold detection speed for the specified files or directories (or every syntax definition) and exit."));
+    const QCommandLineOption benchUiOption(QStringList{QStringLiteral("benchmark-ui")},
+            QCoreApplication::translate("main", "Measure editor paint time and input latency over synthetic documents "
+                                                "of the specified line counts, print the results as JSON and exit.  "
+                                                "Use with QT_QPA_PLATFORM=offscreen to run without a display."));
+    parser.addOption(benchHighlightOption);
+    parser.addOption(benchFoldOption);
+    parser.addOption(benchUiOption);
+
     parser.process(app);
 
     if (parser.isSet(updateOption)) {
@@ -150,6 +164,16 @@ int main(int argc, char *argv[])
         return QApplication::exec();
     }
 
+    if (parser.isSet(benchHighlightOption) || parser.isSet(benchFoldOption)) {
+        const auto mode = parser.isSet(benchFoldOption) ? HighlightBenchmark::Folding
+                                                        : HighlightBenchmark::Highlighting;
+        return HighlightBenchmark::run(parser.positionalArguments(),
+                                       parser.value(syntaxOption), mode);
+    }
+
+    if (parser.isSet(benchUiOption))
+        return UiBenchmark::run(parser.positionalArguments());
+
     setDefaultIconTheme();
 
     // TODO: Make a unique icon for QTextPad?
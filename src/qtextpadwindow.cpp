@@ -30,6 +30,8 @@
 #include <QMessageBox>
 #include <QFileDialog>
 #include <QInputDialog>
+#include <QLineEdit>
+#include <QRegularExpression>
 #include <QPrintDialog>
 #include <QPrintPreviewDialog>
 #include <QClipboard>
@@ -41,6 +43,7 @@
 #include <QDateTime>
 #include <QProcess>
 #include <QFileSystemWatcher>
+#include <QDockWidget>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QGuiApplication>
@@ -55,12 +58,15 @@
 #include "syntaxtextedit.h"
 #include "settingspopup.h"
 #include "searchdialog.h"
+#include "findinfiles.h"
 #include "definitiondownload.h"
 #include "indentsettings.h"
 #include "appsettings.h"
 #include "undocommands.h"
+#include "texthistory.h"
 #include "charsets.h"
 #include "aboutdialog.h"
+#include "lineoperations.h"
 
 #include <memory>
 
@@ -131,6 +137,15 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     m_searchWidget = new SearchWidget(this);
     showSearchBar(false);
 
+    m_findInFiles = new FindInFilesPanel(this);
+    m_findInFilesDock = new QDockWidget(tr("Find in Files"), this);
+    m_findInFilesDock->setObjectName(QStringLiteral("FindInFiles"));
+    m_findInFilesDock->setWidget(m_findInFiles);
+    addDockWidget(Qt::BottomDockWidgetArea, m_findInFilesDock);
+    m_findInFilesDock->hide();
+    connect(m_findInFiles, &FindInFilesPanel::openMatch,
+            this, &QTextPadWindow::openFindInFilesMatch);
+
     QTextPadSettings settings;
     m_editor->setShowLineNumbers(settings.lineNumbers());
     m_editor->setShowFolding(settings.showFolding());
@@ -140,6 +155,7 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     m_editor->setShowIndentGuides(settings.indentationGuides());
     m_editor->setShowLongLineEdge(settings.showLongLineMargin());
     m_editor->setShowWhitespace(settings.showWhitespace());
+    m_editor->setShowOverviewRuler(settings.showOverviewRuler());
     m_editor->setTabWidth(settings.tabWidth());
     m_editor->setIndentWidth(settings.indentWidth());
     m_editor->setLongLineWidth(settings.longLineWidth());
@@ -147,11 +163,19 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     m_editor->setWordWrap(settings.wordWrap());
     m_editor->setIndentationMode(settings.indentMode());
     m_editor->setScrollPastEndOfFile(settings.scrollPastEndOfFile());
+    m_editor->setLargeLineThreshold(settings.largeLineThreshold());
+    m_editor->setFastLayout(settings.fastLayout());
 
     m_editor->setExternalUndoRedo(true);
     m_undoStack = new QUndoStack(this);
-    connect(m_editor->document(), &QTextDocument::undoCommandAdded, this,
-            [this] { m_undoStack->push(new TextEditorUndoCommand(m_editor)); });
+
+    // Created after the undo stack, so it outlives the commands referring to it
+    m_textHistory = new TextHistory(m_editor, this);
+    m_textHistory->setMemoryBudget(qint64(settings.undoMemoryLimit()) * 1024 * 1024);
+    connect(m_textHistory, &TextHistory::changeRecorded, this,
+            [this](TextHistory::Change *change) {
+        m_undoStack->push(new TextEditorUndoCommand(m_textHistory, change));
+    });
     connect(m_editor, &SyntaxTextEdit::undoRequested, m_undoStack, &QUndoStack::undo);
     connect(m_editor, &SyntaxTextEdit::redoRequested, m_undoStack, &QUndoStack::redo);
 
@@ -220,6 +244,10 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     auto selectAllAction = editMenu->addAction(tr("Select &All"));
     selectAllAction->setShortcut(QKeySequence::SelectAll);
     m_editorContextActions << selectAllAction;
+    auto addCaretAboveAction = editMenu->addAction(tr("Add Caret A&bove"));
+    addCaretAboveAction->setShortcut(Qt::CTRL | Qt::ALT | Qt::Key_Up);
+    auto addCaretBelowAction = editMenu->addAction(tr("Add Caret Belo&w"));
+    addCaretBelowAction->setShortcut(Qt::CTRL | Qt::ALT | Qt::Key_Down);
     (void) editMenu->addSeparator();
     m_overwriteModeAction = editMenu->addAction(tr("&Overwrite Mode"));
     m_overwriteModeAction->setShortcut(Qt::Key_Insert);
@@ -233,6 +261,8 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     findPrevAction->setShortcut(Qt::SHIFT | Qt::Key_F3);
     auto replaceAction = editMenu->addAction(ICON("edit-find-replace"), tr("R&eplace..."));
     replaceAction->setShortcut(Qt::CTRL | Qt::Key_H);
+    auto findInFilesAction = editMenu->addAction(ICON("edit-find"), tr("Find in F&iles..."));
+    findInFilesAction->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_F);
     (void) editMenu->addSeparator();
     auto gotoAction = editMenu->addAction(ICON("go-jump"), tr("&Go to line..."));
     gotoAction->setShortcut(Qt::CTRL | Qt::Key_G);
@@ -245,6 +275,8 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     connect(clearAction, &QAction::triggered, m_editor, &SyntaxTextEdit::deleteSelection);
     connect(deleteLinesAction, &QAction::triggered, m_editor, &SyntaxTextEdit::deleteLines);
     connect(selectAllAction, &QAction::triggered, m_editor, &QPlainTextEdit::selectAll);
+    connect(addCaretAboveAction, &QAction::triggered, m_editor, &SyntaxTextEdit::addCaretAbove);
+    connect(addCaretBelowAction, &QAction::triggered, m_editor, &SyntaxTextEdit::addCaretBelow);
     connect(m_overwriteModeAction, &QAction::toggled,
             this, &QTextPadWindow::setOverwriteMode);
 
@@ -252,6 +284,7 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     connect(findNextAction, &QAction::triggered, this, [this] { m_searchWidget->searchNext(false); });
     connect(findPrevAction, &QAction::triggered, this, [this] { m_searchWidget->searchNext(true); });
     connect(replaceAction, &QAction::triggered, this, [this] { SearchDialog::create(this); });
+    connect(findInFilesAction, &QAction::triggered, this, &QTextPadWindow::showFindInFiles);
     connect(gotoAction, &QAction::triggered, this, &QTextPadWindow::navigateToLine);
 
     connect(m_undoStack, &QUndoStack::canUndoChanged, undoAction, &QAction::setEnabled);
@@ -297,6 +330,8 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     auto showWhitespaceAction = viewMenu->addAction(tr("Show White&space"));
     showWhitespaceAction->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_W);
     showWhitespaceAction->setCheckable(true);
+    auto showOverviewAction = viewMenu->addAction(tr("Search O&verview"));
+    showOverviewAction->setCheckable(true);
     (void) viewMenu->addSeparator();
     auto scrollPastEndOfFileAction = viewMenu->addAction(tr("Scroll &Past End of File"));
     scrollPastEndOfFileAction->setCheckable(true);
@@ -349,6 +384,11 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
                 m_editor->setShowWhitespace(show);
                 QTextPadSettings().setShowWhitespace(show);
             });
+    connect(showOverviewAction, &QAction::toggled, this,
+            [this](bool show) {
+                m_editor->setShowOverviewRuler(show);
+                QTextPadSettings().setShowOverviewRuler(show);
+            });
     connect(scrollPastEndOfFileAction, &QAction::toggled, this,
             [this](bool scroll) {
                 m_editor->setScrollPastEndOfFile(scroll);
@@ -386,6 +426,18 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     linesDownAction->setShortcut(Qt::CTRL | Qt::SHIFT | Qt::Key_Down);
     auto joinLinesAction = toolsMenu->addAction(tr("&Join Lines"));
     joinLinesAction->setShortcut(Qt::CTRL | Qt::Key_J);
+    QMenu *sortMenu = toolsMenu->addMenu(tr("&Sort Lines"));
+    auto sortAscendingAction = sortMenu->addAction(tr("&Ascending"));
+    auto sortDescendingAction = sortMenu->addAction(tr("&Descending"));
+    auto sortCaseInsensitiveAction = sortMenu->addAction(tr("Case &Insensitive"));
+    auto sortNumericAction = sortMenu->addAction(tr("&Numeric"));
+    auto sortNaturalAction = sortMenu->addAction(tr("N&atural"));
+    (void) sortMenu->addSeparator();
+    auto sortFieldAction = sortMenu->addAction(tr("By &Field..."));
+    auto uniqueLinesAction = toolsMenu->addAction(tr("Re&move Duplicate Lines"));
+    auto reverseLinesAction = toolsMenu->addAction(tr("&Reverse Lines"));
+    auto keepLinesAction = toolsMenu->addAction(tr("&Keep Matching Lines..."));
+    auto dropLinesAction = toolsMenu->addAction(tr("Dele&te Matching Lines..."));
     (void) toolsMenu->addSeparator();
     QMenu *foldMenu = toolsMenu->addMenu(tr("Code &Folding"));
     auto foldAction = foldMenu->addAction(tr("&Collapse"));
@@ -413,6 +465,30 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
         m_editor->moveLines(QTextCursor::NextBlock);
     });
     connect(joinLinesAction, &QAction::triggered, this, &QTextPadWindow::joinLines);
+    connect(sortAscendingAction, &QAction::triggered, this, [this](bool) {
+        sortLines(LineOperations::SortLexical, false);
+    });
+    connect(sortDescendingAction, &QAction::triggered, this, [this](bool) {
+        sortLines(LineOperations::SortLexical, true);
+    });
+    connect(sortCaseInsensitiveAction, &QAction::triggered, this, [this](bool) {
+        sortLines(LineOperations::SortCaseInsensitive, false);
+    });
+    connect(sortNumericAction, &QAction::triggered, this, [this](bool) {
+        sortLines(LineOperations::SortNumeric, false);
+    });
+    connect(sortNaturalAction, &QAction::triggered, this, [this](bool) {
+        sortLines(LineOperations::SortNatural, false);
+    });
+    connect(sortFieldAction, &QAction::triggered, this, &QTextPadWindow::promptSortByField);
+    connect(uniqueLinesAction, &QAction::triggered, this, &QTextPadWindow::uniqueLines);
+    connect(reverseLinesAction, &QAction::triggered, this, &QTextPadWindow::reverseLines);
+    connect(keepLinesAction, &QAction::triggered, this, [this](bool) {
+        filterLines(true);
+    });
+    connect(dropLinesAction, &QAction::triggered, this, [this](bool) {
+        filterLines(false);
+    });
     connect(foldAction, &QAction::triggered, m_editor, &SyntaxTextEdit::foldCurrentLine);
     connect(unfoldAction, &QAction::triggered, m_editor, &SyntaxTextEdit::unfoldCurrentLine);
     connect(foldAllAction, &QAction::triggered, m_editor, &SyntaxTextEdit::foldAll);
@@ -495,6 +571,30 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
 
     m_positionLabel = new ActivationLabel(this);
     statusBar()->addWidget(m_positionLabel, 1);
+    m_largeLineLabel = new QLabel(tr("Long Line"), this);
+    m_largeLineLabel->setToolTip(tr("Highlighting and brace matching are limited on this line"));
+    m_largeLineLabel->setVisible(false);
+    statusBar()->addPermanentWidget(m_largeLineLabel);
+    m_latencyLabel = new QLabel(this);
+    m_latencyLabel->setToolTip(tr("Typing latency: median / 95th / 99th percentile"));
+    m_latencyLabel->setVisible(false);
+    statusBar()->addPermanentWidget(m_latencyLabel);
+    m_undoUsageLabel = new QLabel(this);
+    m_undoUsageLabel->setVisible(false);
+    statusBar()->addPermanentWidget(m_undoUsageLabel);
+    connect(m_textHistory, &TextHistory::usageChanged,
+            this, &QTextPadWindow::updateUndoUsage);
+    if (settings.showTypingLatency()) {
+        m_editor->setTrackTypingLatency(true);
+        connect(m_editor, &SyntaxTextEdit::typingLatencyUpdated, this, [this] {
+            const auto latency = m_editor->typingLatency();
+            m_latencyLabel->setText(tr("%1 / %2 / %3 ms")
+                                    .arg(latency.p50, 0, 'f', 1)
+                                    .arg(latency.p95, 0, 'f', 1)
+                                    .arg(latency.p99, 0, 'f', 1));
+            m_latencyLabel->setVisible(true);
+        });
+    }
     m_insertLabel = new ActivationLabel(this);
     statusBar()->addPermanentWidget(m_insertLabel);
     m_crlfLabel = new ActivationLabel(this);
@@ -533,6 +633,7 @@ QTextPadWindow::QTextPadWindow(QWidget *parent)
     showLineNumbersAction->setChecked(m_editor->showLineNumbers());
     showFoldingAction->setChecked(m_editor->showFolding());
     showWhitespaceAction->setChecked(m_editor->showWhitespace());
+    showOverviewAction->setChecked(m_editor->showOverviewRuler());
     scrollPastEndOfFileAction->setChecked(m_editor->scrollPastEndOfFile());
     showCurrentLineAction->setChecked(m_editor->highlightCurrentLine());
     showMatchingBraces->setChecked(m_editor->matchBraces());
@@ -641,6 +742,31 @@ void QTextPadWindow::showSearchBar(bool show)
     }
 }
 
+void QTextPadWindow::showFindInFiles()
+{
+    const QTextCursor cursor = m_editor->textCursor();
+    if (cursor.hasSelection())
+        m_findInFiles->setSearchText(cursor.selectedText());
+    m_findInFilesDock->show();
+    m_findInFiles->activate();
+}
+
+void QTextPadWindow::openFindInFilesMatch(const FindInFilesMatch &match)
+{
+    if (QFileInfo(match.filename) != QFileInfo(m_openFilename)) {
+        if (!promptForSave() || !loadDocumentFrom(match.filename))
+            return;
+    }
+
+    gotoLine(match.line);
+    QTextCursor cursor = m_editor->textCursor();
+    const int blockStart = cursor.block().position();
+    cursor.setPosition(blockStart + match.column);
+    cursor.setPosition(blockStart + match.column + match.length, QTextCursor::KeepAnchor);
+    m_editor->setTextCursor(cursor);
+    m_editor->setFocus(Qt::OtherFocusReason);
+}
+
 void QTextPadWindow::setSyntax(const KSyntaxHighlighting::Definition &syntax)
 {
     m_editor->setSyntax(syntax);
@@ -891,10 +1017,11 @@ bool QTextPadWindow::loadDocumentFrom(const QString &filename, const QString &te
     showSearchBar(false);
 
     // Don't let the syntax highlighter hinder us while setting the new content
+    m_textHistory->beginReset();
     m_editor->clear();
     setSyntax(SyntaxTextEdit::nullSyntax());
     m_editor->setPlainText(document);
-    m_editor->document()->clearUndoRedoStacks();
+    m_textHistory->endReset();
 
     KSyntaxHighlighting::Definition definition;
     if (!fileModes.syntax.isEmpty())
@@ -926,6 +1053,26 @@ bool QTextPadWindow::loadDocumentFrom(const QString &filename, const QString &te
     return true;
 }
 
+void QTextPadWindow::updateUndoUsage()
+{
+    const qint64 memoryUsage = m_textHistory->memoryUsage();
+    const qint64 diskUsage = m_textHistory->diskUsage();
+    if (memoryUsage == 0 && diskUsage == 0) {
+        m_undoUsageLabel->setVisible(false);
+        return;
+    }
+
+    QLocale locale;
+    m_undoUsageLabel->setText(tr("Undo: %1").arg(locale.formattedDataSize(memoryUsage)));
+    m_undoUsageLabel->setToolTip(tr("Undo history: %1 in memory (%2 compressed), %3 on disk\n"
+                                    "Older history is compressed past %4")
+                                 .arg(locale.formattedDataSize(memoryUsage),
+                                      locale.formattedDataSize(m_textHistory->compressedSize()),
+                                      locale.formattedDataSize(diskUsage),
+                                      locale.formattedDataSize(m_textHistory->memoryBudget())));
+    m_undoUsageLabel->setVisible(true);
+}
+
 bool QTextPadWindow::isDocumentModified() const
 {
     return !m_undoStack->isClean();
@@ -1029,8 +1176,9 @@ void QTextPadWindow::newDocument()
 
 void QTextPadWindow::resetEditor()
 {
+    m_textHistory->beginReset();
     m_editor->clear();
-    m_editor->document()->clearUndoRedoStacks();
+    m_textHistory->endReset();
 
     setSyntax(SyntaxTextEdit::nullSyntax());
     setEncoding(QStringLiteral("UTF-8"));
@@ -1179,7 +1327,8 @@ void QTextPadWindow::editorContextMenu(const QPoint &pos)
 void QTextPadWindow::updateCursorPosition()
 {
     const QTextCursor cursor = m_editor->textCursor();
-    const int column = m_editor->textColumn(cursor.block().text(), cursor.positionInBlock());
+    const int column = m_editor->textColumn(cursor);
+    m_largeLineLabel->setVisible(m_editor->isLargeLine(cursor.block()));
     const int selectedChars = std::abs(cursor.selectionEnd() - cursor.selectionStart());
     QString positionText = tr("Line %1, Col %2")
                                 .arg(cursor.blockNumber() + 1)
@@ -1518,13 +1667,12 @@ void QTextPadWindow::joinLines()
         joinText(joined, block.text().trimmed());
     joinText(joined, trimLeft(endBlock.text()));
 
-    cursor.beginEditBlock();
-    cursor.removeSelectedText();
-    cursor.insertText(joined);
-    cursor.endEditBlock();
+    const int startLine = startBlock.blockNumber();
+    m_editor->replaceLines(startLine, endBlock.blockNumber(), QStringList(joined));
 
     // TODO: Not perfect, but easier than adjusting the cursor based on
     // reformatted line content...
+    cursor = QTextCursor(m_editor->document()->findBlockByNumber(startLine));
     if (startPos == endPos) {
         cursor.setPosition(startPos);
     } else if (startPos > endPos) {
@@ -1537,6 +1685,134 @@ void QTextPadWindow::joinLines()
     m_editor->setTextCursor(cursor);
 }
 
+/* Like modifySelection, but operates on whole lines: the lines touched by
+ * the selection, or the whole document if nothing is selected.  The text is
+ * passed with '\n' line separators, and the result replaces those lines in a
+ * single edit.
+ */
+template <typename Modify>
+void modifyLines(SyntaxTextEdit *editor, Modify &&modify)
+{
+    auto cursor = editor->textCursor();
+    const bool wholeDocument = !cursor.hasSelection();
+    if (wholeDocument) {
+        cursor.select(QTextCursor::Document);
+    } else {
+        const int start = cursor.selectionStart();
+        int end = cursor.selectionEnd();
+
+        // A selection ending at the start of a line doesn't include that line
+        cursor.setPosition(end);
+        if (cursor.atBlockStart() && end > start)
+            --end;
+        cursor.setPosition(start);
+        cursor.movePosition(QTextCursor::StartOfBlock);
+        cursor.setPosition(end, QTextCursor::KeepAnchor);
+        cursor.movePosition(QTextCursor::EndOfBlock, QTextCursor::KeepAnchor);
+    }
+
+    QString text = cursor.selectedText();
+    text.replace(QChar::ParagraphSeparator, QLatin1Char('\n'));
+
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    const QString newText = modify(text);
+    QApplication::restoreOverrideCursor();
+    if (newText == text)
+        return;
+
+    // replaceLines() only touches the span that actually changed, so small
+    // edits to a large selection don't rebuild every block in it.
+    const QTextDocument *document = editor->document();
+    const int selectStart = cursor.selectionStart();
+    editor->replaceLines(document->findBlock(selectStart).blockNumber(),
+                         document->findBlock(cursor.selectionEnd()).blockNumber(),
+                         newText);
+
+    if (!wholeDocument) {
+        cursor.setPosition(selectStart);
+        cursor.setPosition(selectStart + int(newText.size()), QTextCursor::KeepAnchor);
+    } else {
+        cursor.movePosition(QTextCursor::Start);
+    }
+    editor->setTextCursor(cursor);
+}
+
+void QTextPadWindow::sortLines(int mode, bool descending)
+{
+    LineOperations::SortOptions options;
+    options.mode = static_cast<LineOperations::SortMode>(mode);
+    options.descending = descending;
+    modifyLines(m_editor, [&options](const QString &text) {
+        return LineOperations::sortLines(text, options);
+    });
+}
+
+void QTextPadWindow::promptSortByField()
+{
+    bool ok = false;
+    const int field = QInputDialog::getInt(this, tr("Sort by Field"),
+                                           tr("Sort lines by field number:"),
+                                           1, 1, 1000, 1, &ok);
+    if (!ok)
+        return;
+
+    const QStringList separators {
+        tr("Whitespace"), tr("Comma"), tr("Tab"), tr("Semicolon"), tr("Vertical Bar"),
+    };
+    const QString separator = QInputDialog::getItem(this, tr("Sort by Field"),
+                                                    tr("Fields are separated by:"),
+                                                    separators, 0, false, &ok);
+    if (!ok)
+        return;
+
+    static const QChar separatorChars[] = {
+        QChar(), QLatin1Char(','), QLatin1Char('\t'), QLatin1Char(';'), QLatin1Char('|'),
+    };
+
+    LineOperations::SortOptions options;
+    options.mode = LineOperations::SortNatural;
+    options.keyField = field;
+    options.fieldSeparator = separatorChars[qMax(0, separators.indexOf(separator))];
+    modifyLines(m_editor, [&options](const QString &text) {
+        return LineOperations::sortLines(text, options);
+    });
+}
+
+void QTextPadWindow::uniqueLines()
+{
+    modifyLines(m_editor, [](const QString &text) {
+        return LineOperations::uniqueLines(text);
+    });
+}
+
+void QTextPadWindow::reverseLines()
+{
+    modifyLines(m_editor, [](const QString &text) {
+        return LineOperations::reverseLines(text);
+    });
+}
+
+void QTextPadWindow::filterLines(bool keep)
+{
+    bool ok = false;
+    const QString pattern = QInputDialog::getText(this,
+                keep ? tr("Keep Matching Lines") : tr("Delete Matching Lines"),
+                tr("Regular expression:"), QLineEdit::Normal, QString(), &ok);
+    if (!ok || pattern.isEmpty())
+        return;
+
+    const QRegularExpression regex(pattern);
+    if (!regex.isValid()) {
+        QMessageBox::critical(this, QString(),
+                              tr("Invalid regular expression: %1").arg(regex.errorString()));
+        return;
+    }
+
+    modifyLines(m_editor, [&regex, keep](const QString &text) {
+        return LineOperations::filterLines(text, regex, keep);
+    });
+}
+
 void QTextPadWindow::resizeEvent(QResizeEvent *event)
 {
     if (event)
@@ -1675,6 +1951,20 @@ void QTextPadWindow::populateThemeMenu()
         item->setData(QVariant::fromValue(theme));
         connect(item, &QAction::triggered, this, [this, theme] { setEditorTheme(theme); });
     }
+
+    // Preview themes while they are hovered in the menu.  Switching themes
+    // doesn't re-highlight the document, so this only costs a repaint.
+    connect(m_themeMenu, &QMenu::hovered, this, [this](QAction *action) {
+        if (action->data().canConvert<KSyntaxHighlighting::Theme>())
+            m_editor->setTheme(action->data().value<KSyntaxHighlighting::Theme>());
+    });
+    connect(m_themeMenu, &QMenu::aboutToHide, this, [this] {
+        QAction *current = m_themeActions->checkedAction();
+        if (current == m_defaultThemeAction)
+            m_editor->setDefaultTheme();
+        else if (current && current->data().canConvert<KSyntaxHighlighting::Theme>())
+            m_editor->setTheme(current->data().value<KSyntaxHighlighting::Theme>());
+    });
 }
 
 void QTextPadWindow::populateEncodingMenu()
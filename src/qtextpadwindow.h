@@ -24,14 +24,19 @@
 #include "filetypeinfo.h"
 
 class SyntaxTextEdit;
+class TextHistory;
 class SearchWidget;
+class FindInFilesPanel;
+struct FindInFilesMatch;
 class ActivationLabel;
 
 class QToolButton;
+class QLabel;
 class QMenu;
 class QActionGroup;
 class QUndoStack;
 class QUndoCommand;
+class QDockWidget;
 class QFileSystemWatcher;
 
 namespace KSyntaxHighlighting
@@ -103,10 +108,17 @@ public Q_SLOTS:
     void upcaseSelection();
     void downcaseSelection();
     void joinLines();
+    void sortLines(int mode, bool descending);
+    void promptSortByField();
+    void uniqueLines();
+    void reverseLines();
+    void filterLines(bool keep);
 
     void showAbout();
     void toggleFullScreen(bool fullScreen);
     void showSearchBar(bool show);
+    void showFindInFiles();
+    void openFindInFilesMatch(const FindInFilesMatch &match);
 
     // User-triggered actions that store commands in the Undo stack
     void changeEncoding(const QString &encoding);
@@ -129,6 +141,8 @@ private:
 
     SyntaxTextEdit *m_editor;
     SearchWidget *m_searchWidget;
+    QDockWidget *m_findInFilesDock;
+    FindInFilesPanel *m_findInFiles;
     QString m_textEncoding;
 
     QString m_openFilename;
@@ -161,6 +175,9 @@ private:
     QList<QAction *> m_editorContextActions;
 
     ActivationLabel *m_positionLabel;
+    QLabel *m_largeLineLabel;
+    QLabel *m_latencyLabel;
+    QLabel *m_undoUsageLabel;
     ActivationLabel *m_crlfLabel;
     ActivationLabel *m_insertLabel;
     QToolButton *m_indentButton;
@@ -170,9 +187,11 @@ private:
 
     // Custom Undo Stack for adding non-editor undo items
     QUndoStack *m_undoStack;
+    TextHistory *m_textHistory;
 
     QString documentTitle();
     void updateTitle();
+    void updateUndoUsage();
     void populateRecentFiles();
     void populateThemeMenu();
     void populateSyntaxMenu();
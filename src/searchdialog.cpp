@@ -30,6 +30,8 @@
 #include <QMessageBox>
 #include <QPainter>
 #include <QStringView>
+#include <QTimer>
+#include <QTextDocument>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
 #include <QGuiApplication>
@@ -38,11 +40,12 @@
 
 #include "qtextpadwindow.h"
 #include "appsettings.h"
+#include "textsearchservice.h"
 
 static SearchDialog *s_instance = Q_NULLPTR;
 
 SearchWidget::SearchWidget(QTextPadWindow *parent)
-    : QWidget(parent), m_editor(parent->editor())
+    : QWidget(parent), m_editor(parent->editor()), m_pendingSearch(NoPendingSearch)
 {
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
     const bool darkTheme = (QGuiApplication::styleHints()->colorScheme() == Qt::ColorScheme::Dark);
@@ -63,6 +66,8 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
     m_wholeWord->setCheckable(true);
     m_regex = settingsMenu->addAction(tr("Regular e&xpressions"));
     m_regex->setCheckable(true);
+    m_multiLine = settingsMenu->addAction(tr("Multi-&line regular expressions"));
+    m_multiLine->setCheckable(true);
     m_escapes = settingsMenu->addAction(tr("&Escape sequences"));
     m_escapes->setCheckable(true);
     m_wrapSearch = settingsMenu->addAction(tr("Wrap Aro&und"));
@@ -73,6 +78,7 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
     connect(m_caseSensitive, &QAction::triggered, this, &SearchWidget::updateSettings);
     connect(m_wholeWord, &QAction::triggered, this, &SearchWidget::updateSettings);
     connect(m_regex, &QAction::triggered, this, &SearchWidget::updateSettings);
+    connect(m_multiLine, &QAction::triggered, this, &SearchWidget::updateSettings);
     connect(m_escapes, &QAction::triggered, this, &SearchWidget::updateSettings);
     connect(m_wrapSearch, &QAction::triggered, this, &SearchWidget::updateSettings);
 
@@ -80,6 +86,9 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
     m_searchText->setClearButtonEnabled(true);
     setFocusProxy(m_searchText);
 
+    m_matchStatus = new QLabel(this);
+    m_matchStatus->setForegroundRole(QPalette::PlaceholderText);
+
     auto tbNext = new QToolButton(this);
     tbNext->setAutoRaise(true);
     tbNext->setIcon(QTextPadSettings::staticIcon(QStringLiteral("go-down"), darkTheme));
@@ -95,20 +104,44 @@ SearchWidget::SearchWidget(QTextPadWindow *parent)
     layout->setSpacing(5);
     layout->addWidget(tbMenu);
     layout->addWidget(m_searchText);
+    layout->addWidget(m_matchStatus);
     layout->addWidget(tbNext);
     layout->addWidget(tbPrev);
     setLayout(layout);
 
-    connect(m_searchText, &QLineEdit::textChanged, this, [this](const QString &text) {
-        m_searchParams.searchText = m_escapes->isChecked()
-                                  ? SearchDialog::translateEscapes(text)
-                                  : text;
-        m_editor->setLiveSearch(m_searchParams);
-    });
+    // Wait for a short pause in typing before searching.  Each search then
+    // usually only extends the previous one, which is much cheaper than
+    // searching the whole document (see SearchParams::narrows()).
+    m_typingTimer = new QTimer(this);
+    m_typingTimer->setSingleShot(true);
+    m_typingTimer->setInterval(60);
+    connect(m_typingTimer, &QTimer::timeout, this, &SearchWidget::updateSearchText);
+    connect(m_searchText, &QLineEdit::textChanged, m_typingTimer, qOverload<>(&QTimer::start));
     connect(m_searchText, &QLineEdit::returnPressed, this, [this] { searchNext(false); });
     connect(tbNext, &QToolButton::clicked, this, [this] { searchNext(false); });
     connect(tbPrev, &QToolButton::clicked, this, [this] { searchNext(true); });
 
+    m_searchService = new TextSearchService(this);
+    connect(m_searchService, &TextSearchService::matchesUpdated,
+            this, &SearchWidget::searchResultsUpdated);
+    connect(m_editor, &QPlainTextEdit::cursorPositionChanged,
+            this, &SearchWidget::updateMatchStatus);
+
+    // Edits invalidate the match positions, but restarting the search on
+    // every keystroke in the editor would be wasteful.
+    m_restartTimer = new QTimer(this);
+    m_restartTimer->setSingleShot(true);
+    m_restartTimer->setInterval(250);
+    connect(m_restartTimer, &QTimer::timeout, this, &SearchWidget::restartSearch);
+    connect(m_editor->document(), &QTextDocument::contentsChange,
+            this, [this](int, int removed, int added) {
+                if (!isVisible() || (removed == 0 && added == 0))
+                    return;
+                m_searchService->cancel();
+                m_restartTimer->start();
+                updateMatchStatus();
+            });
+
 #if QT_VERSION >= QT_VERSION_CHECK(6, 5, 0)
     connect(QGuiApplication::styleHints(), &QStyleHints::colorSchemeChanged,
             this, [=](Qt::ColorScheme colorScheme) {
@@ -131,16 +164,19 @@ void SearchWidget::activate()
     m_caseSensitive->setChecked(settings.searchCaseSensitive());
     m_wholeWord->setChecked(settings.searchWholeWord());
     m_regex->setChecked(settings.searchRegex());
+    m_multiLine->setChecked(settings.searchMultiLine());
+    m_multiLine->setEnabled(m_regex->isChecked());
     m_escapes->setChecked(settings.searchEscapes());
     m_wrapSearch->setChecked(settings.searchWrap());
 
     m_searchParams.caseSensitive = m_caseSensitive->isChecked();
     m_searchParams.wholeWord = m_wholeWord->isChecked();
     m_searchParams.regex = m_regex->isChecked();
+    m_searchParams.multiLine = m_multiLine->isChecked();
 
     setFocus(Qt::OtherFocusReason);
     m_searchText->selectAll();
-    m_editor->setLiveSearch(m_searchParams);
+    updateSearchText();
 }
 
 void SearchWidget::searchNext(bool reverse)
@@ -150,22 +186,106 @@ void SearchWidget::searchNext(bool reverse)
         setEnabled(true);
         activate();
     }
+    if (m_typingTimer->isActive())
+        updateSearchText();
     if (m_searchParams.searchText.isEmpty())
         return;
 
-    auto searchCursor = m_editor->textSearch(m_editor->textCursor(),
-                                             m_searchParams, false, reverse);
-    if (searchCursor.isNull() && m_wrapSearch->isChecked()) {
-        QTextCursor wrapCursor = m_editor->textCursor();
-        wrapCursor.movePosition(reverse ? QTextCursor::End : QTextCursor::Start);
-        searchCursor = m_editor->textSearch(wrapCursor, m_searchParams,
-                                            true, reverse);
+    // The document was edited since the last search was started
+    if (m_restartTimer->isActive())
+        restartSearch();
+
+    m_pendingSearch = NoPendingSearch;
+    if (!gotoNextMatch(reverse)) {
+        m_pendingSearch = reverse ? PendingPrevious : PendingNext;
+        updateMatchStatus();
     }
+}
 
-    if (searchCursor.isNull())
+bool SearchWidget::gotoNextMatch(bool reverse)
+{
+    const QTextCursor cursor = m_editor->textCursor();
+    int index = -1;
+    switch (m_searchService->findNext(cursor.selectionStart(), cursor.selectionEnd(),
+                                      reverse, m_wrapSearch->isChecked(), &index)) {
+    case TextSearchService::Pending:
+        return false;
+    case TextSearchService::NotFound:
         QMessageBox::information(this, QString(), tr("The specified text was not found"));
+        return true;
+    case TextSearchService::Found:
+        break;
+    }
+
+    const auto &match = m_searchService->matches().at(index);
+    QTextCursor matchCursor(m_editor->document());
+    matchCursor.setPosition(match.start);
+    matchCursor.setPosition(match.start + match.length, QTextCursor::KeepAnchor);
+    m_editor->setTextCursor(matchCursor);
+    return true;
+}
+
+void SearchWidget::updateSearchText()
+{
+    m_typingTimer->stop();
+    const QString text = m_searchText->text();
+    m_searchParams.searchText = m_escapes->isChecked()
+                              ? SearchDialog::translateEscapes(text)
+                              : text;
+    m_editor->setLiveSearch(m_searchParams);
+    restartSearch();
+}
+
+void SearchWidget::restartSearch()
+{
+    m_restartTimer->stop();
+    if (isVisible())
+        m_searchService->start(m_editor->document(), m_searchParams);
     else
-        m_editor->setTextCursor(searchCursor);
+        m_searchService->release();
+    updateMatchStatus();
+}
+
+void SearchWidget::searchResultsUpdated()
+{
+    if (m_pendingSearch != NoPendingSearch && gotoNextMatch(m_pendingSearch == PendingPrevious))
+        m_pendingSearch = NoPendingSearch;
+    updateMatchStatus();
+}
+
+void SearchWidget::updateMatchStatus()
+{
+    // A cancelled search (e.g. after an edit) leaves the count unknown
+    // until it is restarted
+    if (m_searchParams.searchText.isEmpty() || !isVisible()
+            || (!m_searchService->isRunning() && !m_searchService->isComplete())) {
+        m_matchStatus->clear();
+        return;
+    }
+
+    const int count = m_searchService->matchCount();
+    const bool counting = !m_searchService->isComplete();
+    if (count == 0 && !counting) {
+        m_matchStatus->setText(tr("No matches"));
+        return;
+    }
+
+    const QTextCursor cursor = m_editor->textCursor();
+    const int index = m_searchService->indexOf(cursor.selectionStart(), cursor.selectionEnd());
+    QString status = (index >= 0) ? tr("Match %1 of %2").arg(index + 1).arg(count)
+                                  : tr("%1 matches").arg(count);
+    if (counting)
+        status = tr("%1 (counting...)").arg(status);
+    m_matchStatus->setText(status);
+}
+
+void SearchWidget::hideEvent(QHideEvent *event)
+{
+    m_typingTimer->stop();
+    m_restartTimer->stop();
+    m_searchService->release();
+    m_pendingSearch = NoPendingSearch;
+    QWidget::hideEvent(event);
 }
 
 void SearchWidget::paintEvent(QPaintEvent *)
@@ -199,14 +319,18 @@ void SearchWidget::updateSettings()
     m_searchParams.caseSensitive = m_caseSensitive->isChecked();
     m_searchParams.wholeWord = m_wholeWord->isChecked();
     m_searchParams.regex = m_regex->isChecked();
+    m_searchParams.multiLine = m_multiLine->isChecked();
+    m_multiLine->setEnabled(m_regex->isChecked());
 
     settings.setSearchCaseSensitive(m_caseSensitive->isChecked());
     settings.setSearchWholeWord(m_wholeWord->isChecked());
     settings.setSearchRegex(m_regex->isChecked());
+    settings.setSearchMultiLine(m_multiLine->isChecked());
     settings.setSearchEscapes(m_escapes->isChecked());
     settings.setSearchWrap(m_wrapSearch->isChecked());
 
-    m_editor->setLiveSearch(m_searchParams);
+    // Toggling escapes changes the search text
+    updateSearchText();
 }
 
 /* Just sets some more sane defaults for QComboBox:
@@ -252,6 +376,10 @@ SearchDialog::SearchDialog(QWidget *parent)
     m_wholeWord->setChecked(settings.searchWholeWord());
     m_regex = new QCheckBox(tr("Regular e&xpressions"), this);
     m_regex->setChecked(settings.searchRegex());
+    m_multiLine = new QCheckBox(tr("Multi-&line"), this);
+    m_multiLine->setChecked(settings.searchMultiLine());
+    m_multiLine->setEnabled(m_regex->isChecked());
+    connect(m_regex, &QCheckBox::toggled, m_multiLine, &QWidget::setEnabled);
     m_escapes = new QCheckBox(tr("&Escape sequences"), this);
     m_escapes->setChecked(settings.searchEscapes());
     m_wrapSearch = new QCheckBox(tr("Wrap Aro&und"), this);
@@ -309,6 +437,7 @@ SearchDialog::SearchDialog(QWidget *parent)
     layout->addWidget(m_regex, 5, 1);
     layout->addWidget(m_escapes, 6, 1);
     layout->addWidget(m_wrapSearch, 3, 2);
+    layout->addWidget(m_multiLine, 5, 2);
     layout->addItem(new QSpacerItem(0, 0, QSizePolicy::Minimum, QSizePolicy::Expanding),
                     layout->rowCount(), 0, 1, 3);
     layout->addWidget(buttonBox, 0, layout->columnCount(), layout->rowCount(), 1);
@@ -476,37 +605,58 @@ QString SearchDialog::translateEscapes(const QString &text)
     return result;
 }
 
-QString SearchDialog::regexReplace(const QString &text,
-                                   const QRegularExpressionMatch &regexMatch)
+RegexReplacement::RegexReplacement(const QString &text)
 {
-    QString result;
-    result.reserve(text.size());
     int start = 0;
+    QString literal;
     for ( ;; ) {
         int pos = text.indexOf(QLatin1Char('\\'), start);
         if (pos < 0 || pos + 1 >= text.size())
             break;
 
-        result.append(QStringView(text).mid(start, pos - start));
+        literal.append(QStringView(text).mid(start, pos - start));
         QChar next = text.at(pos + 1);
         if (next.unicode() >= '0' && next.unicode() <= '9') {
             // We support up to 99 replacements...
             QByteArray number = QStringView(text).mid(pos + 1, 2).toLatin1();
             char *end;
             ulong ref = strtoul(number.constData(), &end, 10);
-            result.append(regexMatch.captured(ref));
+            if (!literal.isEmpty()) {
+                m_parts.append(Part{literal, -1});
+                literal.clear();
+            }
+            m_parts.append(Part{QString(), int(ref)});
             start = pos + 1 + (end - number.constData());
         } else {
-            result.append(QLatin1Char('\\'));
-            result.append(next);
+            literal.append(QLatin1Char('\\'));
+            literal.append(next);
             start = pos + 2;
         }
     }
 
-    result.append(QStringView(text).mid(start));
+    literal.append(QStringView(text).mid(start));
+    if (!literal.isEmpty())
+        m_parts.append(Part{literal, -1});
+}
+
+QString RegexReplacement::apply(const QRegularExpressionMatch &regexMatch) const
+{
+    QString result;
+    for (const Part &part : m_parts) {
+        if (part.capture < 0)
+            result.append(part.text);
+        else
+            result.append(regexMatch.captured(part.capture));
+    }
     return result;
 }
 
+QString SearchDialog::regexReplace(const QString &text,
+                                   const QRegularExpressionMatch &regexMatch)
+{
+    return RegexReplacement(text).apply(regexMatch);
+}
+
 void SearchDialog::syncSearchSettings(bool saveRecent)
 {
     QTextPadSettings settings;
@@ -533,10 +683,12 @@ void SearchDialog::syncSearchSettings(bool saveRecent)
     m_searchParams.caseSensitive = m_caseSensitive->isChecked();
     m_searchParams.wholeWord = m_wholeWord->isChecked();
     m_searchParams.regex = m_regex->isChecked();
+    m_searchParams.multiLine = m_multiLine->isChecked();
 
     settings.setSearchCaseSensitive(m_caseSensitive->isChecked());
     settings.setSearchWholeWord(m_wholeWord->isChecked());
     settings.setSearchRegex(m_regex->isChecked());
+    settings.setSearchMultiLine(m_multiLine->isChecked());
     settings.setSearchEscapes(m_escapes->isChecked());
     settings.setSearchWrap(m_wrapSearch->isChecked());
 }
@@ -615,42 +767,42 @@ void SearchDialog::performReplaceAll(ReplaceAllMode mode)
     if (searchText.isEmpty())
         return;
 
-    auto searchCursor = m_editor->textCursor();
-    if (mode == InSelection)
-        searchCursor.setPosition(m_editor->textCursor().selectionStart());
-    else
-        searchCursor.movePosition(QTextCursor::Start);
-    searchCursor = m_editor->textSearch(searchCursor, m_searchParams, true,
-                                        false, &m_regexMatch);
-    if (searchCursor.isNull()) {
-        QMessageBox::information(this, QString(), tr("The specified text was not found"));
-        return;
-    } else if (mode == InSelection && searchCursor.selectionEnd() > m_editor->textCursor().selectionEnd()) {
-        QMessageBox::information(this, QString(), tr("The specified text was not found in the selection"));
-        return;
+    const QTextCursor editorCursor = m_editor->textCursor();
+    int start = 0, end = m_editor->document()->characterCount();
+    if (mode == InSelection) {
+        start = editorCursor.selectionStart();
+        end = editorCursor.selectionEnd();
     }
 
     QString replaceText = m_replaceText->currentText();
     if (m_escapes->isChecked())
         replaceText = translateEscapes(replaceText);
 
-    searchCursor.beginEditBlock();
-    auto replaceCursor = searchCursor;
-    int replacements = 0;
-    while (!replaceCursor.isNull()) {
-        if (mode == InSelection && replaceCursor.selectionEnd() > m_editor->textCursor().selectionEnd())
-            break;
+    // Parse the replacement template once, rather than once per match
+    SyntaxTextEdit::Replacer replacer;
+    if (m_regex->isChecked()) {
+        const RegexReplacement replacement(replaceText);
+        replacer = [replacement](const QRegularExpressionMatch &match) {
+            return replacement.apply(match);
+        };
+    } else {
+        replacer = [replaceText](const QRegularExpressionMatch &) {
+            return replaceText;
+        };
+    }
 
-        replaceCursor.removeSelectedText();
-        if (m_regex->isChecked())
-            replaceCursor.insertText(regexReplace(replaceText, m_regexMatch));
+    int replacements = 0;
+    const auto blockReplacements = m_editor->findReplacements(m_searchParams, start, end,
+                                                              replacer, &replacements);
+    if (replacements == 0) {
+        if (mode == InSelection)
+            QMessageBox::information(this, QString(), tr("The specified text was not found in the selection"));
         else
-            replaceCursor.insertText(replaceText);
-        replaceCursor = m_editor->textSearch(replaceCursor, m_searchParams,
-                                             false, false, &m_regexMatch);
-        ++replacements;
+            QMessageBox::information(this, QString(), tr("The specified text was not found"));
+        return;
     }
-    searchCursor.endEditBlock();
+
+    m_editor->applyReplacements(blockReplacements);
 
     QMessageBox::information(this, QString(), tr("Successfully replaced %1 matches").arg(replacements));
 }
@@ -25,12 +25,15 @@
 #include "syntaxtextedit.h"
 
 class QLineEdit;
+class QLabel;
+class QTimer;
 class QComboBox;
 class QCheckBox;
 class QPushButton;
 class QTextCursor;
 class SyntaxTextEdit;
 class QTextPadWindow;
+class TextSearchService;
 
 class SearchWidget : public QWidget
 {
@@ -54,20 +57,56 @@ public Q_SLOTS:
 
 protected:
     void paintEvent(QPaintEvent *event) override;
+    void hideEvent(QHideEvent *event) override;
 
 private Q_SLOTS:
     void updateSettings();
+    void updateSearchText();
+    void restartSearch();
+    void searchResultsUpdated();
+    void updateMatchStatus();
 
 private:
     QLineEdit *m_searchText;
+    QLabel *m_matchStatus;
     QAction *m_caseSensitive;
     QAction *m_wholeWord;
     QAction *m_regex;
+    QAction *m_multiLine;
     QAction *m_escapes;
     QAction *m_wrapSearch;
 
     SyntaxTextEdit *m_editor;
     SyntaxTextEdit::SearchParams m_searchParams;
+
+    // Finds and counts matches in the background.  A Find Next/Previous
+    // which can't be answered yet is remembered and completed when the
+    // search reaches it.
+    TextSearchService *m_searchService;
+    QTimer *m_typingTimer;
+    QTimer *m_restartTimer;
+    enum PendingSearch { NoPendingSearch, PendingNext, PendingPrevious };
+    PendingSearch m_pendingSearch;
+
+    bool gotoNextMatch(bool reverse);
+};
+
+// A regex replacement string, parsed once into literal text and capture
+// group references (\0 through \99)
+class RegexReplacement
+{
+public:
+    explicit RegexReplacement(const QString &text);
+
+    QString apply(const QRegularExpressionMatch &regexMatch) const;
+
+private:
+    struct Part
+    {
+        QString text;
+        int capture;    // -1 for literal text
+    };
+    QVector<Part> m_parts;
 };
 
 class SearchDialog : public QDialog
@@ -104,6 +143,7 @@ private:
     QCheckBox *m_caseSensitive;
     QCheckBox *m_wholeWord;
     QCheckBox *m_regex;
+    QCheckBox *m_multiLine;
     QCheckBox *m_escapes;
     QCheckBox *m_wrapSearch;
     QPushButton *m_replaceSelectionButton;
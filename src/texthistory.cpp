@@ -0,0 +1,662 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "texthistory.h"
+
+#include <QPlainTextEdit>
+#include <QTextDocument>
+#include <QTextCursor>
+#include <QTemporaryFile>
+#include <QScopedValueRollback>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <numeric>
+
+#include "syntaxtextedit.h"
+
+class TextHistory::Change
+{
+public:
+    enum Storage
+    {
+        InMemory,
+        Compressed,
+        OnDisk,
+    };
+
+    std::list<Change>::iterator self;
+    Storage storage;
+    int position;
+    int removedLength, insertedLength;
+
+    // An edit block with separate parts (such as Replace All) is one change
+    // with a piece for each part, in the order they were made, and their
+    // text concatenated.  A change with a single part has no pieces.
+    QVector<Piece> pieces;
+
+    // InMemory.  Compressing moves this into packed a chunk at a time, and
+    // packedChars counts how much of it (removed, then inserted) is done.
+    QString removed, inserted;
+    int packedChars;
+
+    // Compressed: the removed text, followed by the inserted text, in
+    // separately compressed chunks.  OnDisk keeps only the chunk sizes.
+    QVector<QByteArray> packed;
+    QVector<int> packedSizes;
+    int removedChunks;
+    qint64 fileOffset;
+
+    // The number of undos and redos before this change was recorded
+    int undoSerial;
+
+    Change()
+        : storage(InMemory), position(), removedLength(), insertedLength(),
+          packedChars(), removedChunks(), fileOffset(), undoSerial() { }
+
+    QVector<Piece> allPieces() const
+    {
+        if (pieces.isEmpty())
+            return QVector<Piece>{Piece{position, removedLength, insertedLength}};
+        return pieces;
+    }
+
+    qint64 packedSize() const
+    {
+        return std::accumulate(packedSizes.cbegin(), packedSizes.cend(), qint64(0));
+    }
+
+    qint64 memoryCost() const
+    {
+        qint64 cost = sizeof(Change) + packedSizes.size() * qint64(sizeof(int))
+                     + pieces.size() * qint64(sizeof(Piece));
+        if (storage == InMemory)
+            cost += (removed.size() + inserted.size()) * qint64(sizeof(QChar));
+        if (storage != OnDisk)
+            cost += packedSize();
+        return cost;
+    }
+};
+
+// Text is compressed in chunks of this many characters, which keeps the
+// temporary buffers small for very large changes
+static const int PackChunkSize = 1 << 20;
+
+// Trimming waits this long after the history goes over budget, so a burst
+// of edits isn't interrupted, and then runs in slices of about TrimSlice
+static const int TrimDelay = 500;  // ms
+static const int TrimSlice = 20;   // ms
+
+// Unchanged text at either end of a change is compared in chunks of this
+// many characters, so it is never copied out of the document all at once
+static const int CompareChunkSize = 64 * 1024;
+
+TextHistory::TextHistory(QPlainTextEdit *editor, QObject *parent)
+    : QObject(parent), m_editor(editor), m_resetting(), m_applying(),
+      m_piecesLost(), m_undoSerial(),
+      m_usagePending(), m_memoryBudget(256 * 1024 * 1024), m_memoryBytes(),
+      m_compressedBytes(), m_diskBytes(), m_spillFile(), m_spilledChanges()
+{
+    QTextDocument *document = m_editor->document();
+    document->setUndoRedoEnabled(false);
+    resync();
+
+    m_trimTimer = new QTimer(this);
+    m_trimTimer->setSingleShot(true);
+    connect(m_trimTimer, &QTimer::timeout, this, &TextHistory::trimMemory);
+
+    connect(document, &QTextDocument::contentsChange, this, &TextHistory::recordChange);
+    if (auto syntaxEditor = qobject_cast<SyntaxTextEdit *>(editor)) {
+        connect(syntaxEditor, &SyntaxTextEdit::partialEdit,
+                this, &TextHistory::recordPartialEdit);
+    }
+}
+
+TextHistory::~TextHistory()
+{
+}
+
+void TextHistory::setMemoryBudget(qint64 bytes)
+{
+    m_memoryBudget = bytes;
+    scheduleTrim();
+}
+
+void TextHistory::beginReset()
+{
+    ++m_resetting;
+}
+
+void TextHistory::endReset()
+{
+    if (--m_resetting == 0)
+        resync();
+}
+
+void TextHistory::undo(Change *change)
+{
+    apply(*change, true);
+    ++m_undoSerial;
+}
+
+void TextHistory::redo(Change *change)
+{
+    apply(*change, false);
+    ++m_undoSerial;
+}
+
+static bool isLineBreak(QChar ch)
+{
+    return ch == QChar::ParagraphSeparator || ch == QChar::LineSeparator;
+}
+
+bool TextHistory::merge(Change *change, const Change *next)
+{
+    if (change->storage != Change::InMemory || next->storage != Change::InMemory
+            || change->packedChars != 0 || !change->pieces.isEmpty() || !next->pieces.isEmpty())
+        return false;
+
+    // After an undo, QUndoStack offers the command below its index, which
+    // the new change doesn't follow on from
+    if (change->undoSerial != m_undoSerial)
+        return false;
+
+    // Only single keystrokes (possibly a surrogate pair) are merged, as
+    // QTextDocument does, so pastes and other edits stay separate steps
+    const qint64 oldCost = change->memoryCost();
+    if (next->removed.isEmpty() && !change->inserted.isEmpty()
+            && !next->inserted.isEmpty() && next->inserted.size() <= 2 && !isLineBreak(next->inserted.at(0))
+            && next->position == change->position + change->inserted.size()) {
+        // Typing
+        change->inserted += next->inserted;
+    } else if (next->inserted.isEmpty() && change->inserted.isEmpty()
+            && next->removed.size() <= 2
+            && next->position + next->removed.size() == change->position) {
+        // Backspace
+        change->removed.prepend(next->removed);
+        change->position = next->position;
+    } else if (next->inserted.isEmpty() && change->inserted.isEmpty()
+            && next->removed.size() <= 2 && next->position == change->position) {
+        // Delete
+        change->removed += next->removed;
+    } else {
+        return false;
+    }
+
+    change->removedLength = change->removed.size();
+    change->insertedLength = change->inserted.size();
+    m_memoryBytes += change->memoryCost() - oldCost;
+    scheduleUsageChanged();
+    return true;
+}
+
+void TextHistory::release(Change *change)
+{
+    m_memoryBytes -= change->memoryCost();
+    if (change->storage == Change::Compressed) {
+        m_compressedBytes -= change->packedSize();
+    } else if (change->storage == Change::OnDisk) {
+        m_diskBytes -= change->packedSize();
+        // Nothing else refers to the file's contents, so it can start over
+        if (--m_spilledChanges == 0)
+            m_spillFile->resize(0);
+    }
+    m_changes.erase(change->self);
+    scheduleUsageChanged();
+}
+
+void TextHistory::recordChange(int position, int charsRemoved, int charsAdded)
+{
+    if (m_resetting)
+        return;
+
+    // QTextDocument's change ranges may include the document's final
+    // paragraph separator, which isn't part of the text
+    const int documentLength = m_editor->document()->characterCount() - 1;
+    if (m_applying || !m_pieces.isEmpty() || m_piecesLost) {
+        // The text was already updated piece by piece
+        if (m_piecesLost || m_text.size() != documentLength) {
+            qWarning("TextHistory: Lost track of the document text");
+            resync();
+        } else if (!m_applying) {
+            recordPieces();
+        }
+        m_pieces.clear();
+        m_piecesRemoved.clear();
+        m_piecesInserted.clear();
+        m_piecesLost = false;
+        return;
+    }
+
+    const bool inRange = position >= 0 && position <= qMin(m_text.size(), documentLength);
+    int removed = inRange ? qBound(0, charsRemoved, m_text.size() - position) : 0;
+    int added = inRange ? qBound(0, charsAdded, documentLength - position) : 0;
+    if (!inRange || m_text.size() - removed + added != documentLength) {
+        qWarning("TextHistory: Lost track of the document text");
+        resync();
+        return;
+    }
+
+    // An edit block is reported as one range covering all of its edits, so
+    // skip the unchanged text at either end rather than copying all of it
+    const int common = qMin(removed, added);
+    int prefix = 0;
+    while (prefix < common) {
+        const int length = qMin(CompareChunkSize, common - prefix);
+        const int same = m_text.commonPrefix(position + prefix,
+                                             documentText(position + prefix, length));
+        prefix += same;
+        if (same < length)
+            break;
+    }
+    if (prefix == removed && prefix == added) {
+        // Only the formatting changed
+        return;
+    }
+    int suffix = 0;
+    while (suffix < common - prefix) {
+        const int length = qMin(CompareChunkSize, common - prefix - suffix);
+        const int same = m_text.commonSuffix(position + removed - suffix,
+                documentText(position + added - suffix - length, length));
+        suffix += same;
+        if (same < length)
+            break;
+    }
+
+    // Don't split surrogate pairs
+    if (prefix > 0 && m_text.at(position + prefix - 1).isHighSurrogate())
+        --prefix;
+    if (suffix > 0 && m_text.at(position + removed - suffix).isLowSurrogate())
+        --suffix;
+    position += prefix;
+    removed -= prefix + suffix;
+    added -= prefix + suffix;
+
+    m_changes.emplace_back();
+    Change &change = m_changes.back();
+    change.self = std::prev(m_changes.end());
+    change.position = position;
+    change.removed = m_text.mid(position, removed);
+    change.inserted = documentText(position, added);
+    change.removedLength = removed;
+    change.insertedLength = added;
+    change.undoSerial = m_undoSerial;
+    m_text.replace(position, removed, change.inserted);
+    m_memoryBytes += change.memoryCost();
+
+    // This may merge the change into the previous one and release it
+    Q_EMIT changeRecorded(&change);
+
+    scheduleTrim();
+    scheduleUsageChanged();
+}
+
+void TextHistory::recordPartialEdit(int position, int charsRemoved, int charsAdded)
+{
+    if (m_resetting || m_applying || m_piecesLost)
+        return;
+
+    // The document is in the middle of an edit block, but already holds
+    // this part's text
+    const int documentLength = m_editor->document()->characterCount() - 1;
+    if (position < 0 || charsRemoved < 0 || charsAdded < 0
+            || position + charsRemoved > m_text.size()
+            || position + charsAdded > documentLength) {
+        m_piecesLost = true;
+        return;
+    }
+
+    QString removedText = m_text.mid(position, charsRemoved);
+    QString addedText = documentText(position, charsAdded);
+
+    // Replace All hands over whole lines, so trim them down to what changed
+    const int common = int(qMin(removedText.size(), addedText.size()));
+    int prefix = 0;
+    while (prefix < common && removedText.at(prefix) == addedText.at(prefix))
+        ++prefix;
+    if (prefix > 0 && removedText.at(prefix - 1).isHighSurrogate())
+        --prefix;
+    int suffix = 0;
+    while (suffix < common - prefix
+           && removedText.at(removedText.size() - suffix - 1)
+              == addedText.at(addedText.size() - suffix - 1))
+        ++suffix;
+    if (suffix > 0 && removedText.at(removedText.size() - suffix).isLowSurrogate())
+        --suffix;
+    if (prefix == removedText.size() && prefix == addedText.size())
+        return;
+
+    removedText = removedText.mid(prefix, removedText.size() - prefix - suffix);
+    addedText = addedText.mid(prefix, addedText.size() - prefix - suffix);
+    m_text.replace(position + prefix, int(removedText.size()), addedText);
+    m_pieces.append(Piece{position + prefix, int(removedText.size()),
+                                  int(addedText.size())});
+    m_piecesRemoved += removedText;
+    m_piecesInserted += addedText;
+}
+
+void TextHistory::recordPieces()
+{
+    m_changes.emplace_back();
+    Change &change = m_changes.back();
+    change.self = std::prev(m_changes.end());
+    change.removed = std::move(m_piecesRemoved);
+    change.inserted = std::move(m_piecesInserted);
+    change.removedLength = int(change.removed.size());
+    change.insertedLength = int(change.inserted.size());
+    change.undoSerial = m_undoSerial;
+    if (m_pieces.size() == 1)
+        change.position = m_pieces.first().position;
+    else
+        change.pieces = std::move(m_pieces);
+    m_memoryBytes += change.memoryCost();
+
+    Q_EMIT changeRecorded(&change);
+
+    scheduleTrim();
+    scheduleUsageChanged();
+}
+
+QString TextHistory::documentText(int position, int length) const
+{
+    // Unlike toPlainText(), selectedText() leaves non-breaking spaces and
+    // paragraph separators as they are in the document
+    QTextCursor cursor(m_editor->document());
+    cursor.setPosition(position);
+    cursor.setPosition(position + length, QTextCursor::KeepAnchor);
+    return cursor.selectedText();
+}
+
+void TextHistory::resync()
+{
+    m_text.setText(documentText(0, m_editor->document()->characterCount() - 1));
+}
+
+void TextHistory::apply(const Change &change, bool undo)
+{
+    QString removed, inserted;
+    loadText(change, &removed, &inserted);
+
+    const QVector<Piece> pieces = change.allPieces();
+    QVector<int> removedOffsets, insertedOffsets;
+    removedOffsets.reserve(pieces.size());
+    insertedOffsets.reserve(pieces.size());
+    int removedOffset = 0, insertedOffset = 0;
+    for (const auto &piece : pieces) {
+        removedOffsets.append(removedOffset);
+        insertedOffsets.append(insertedOffset);
+        removedOffset += piece.removedLength;
+        insertedOffset += piece.insertedLength;
+    }
+
+    // Each piece's position is in the document as it was when that piece
+    // was made, so undo goes through them in reverse.  The text copy is
+    // updated here, rather than from the single contentsChange at the end.
+    QScopedValueRollback<bool> applying(m_applying, true);
+    QTextCursor cursor(m_editor->document());
+    cursor.beginEditBlock();
+    for (int n = 0; n < pieces.size(); ++n) {
+        const int i = undo ? int(pieces.size()) - 1 - n : n;
+        const Piece &piece = pieces.at(i);
+        const int length = undo ? piece.insertedLength : piece.removedLength;
+        const QString text = undo ? removed.mid(removedOffsets.at(i), piece.removedLength)
+                                  : inserted.mid(insertedOffsets.at(i), piece.insertedLength);
+        cursor.setPosition(piece.position);
+        cursor.setPosition(piece.position + length, QTextCursor::KeepAnchor);
+        cursor.insertText(text);
+        m_text.replace(piece.position, length, text);
+    }
+    cursor.endEditBlock();
+    m_editor->setTextCursor(cursor);
+}
+
+void TextHistory::loadText(const Change &change, QString *removed, QString *inserted) const
+{
+    if (change.storage == Change::InMemory) {
+        *removed = change.removed;
+        *inserted = change.inserted;
+        return;
+    }
+
+    removed->reserve(change.removedLength);
+    inserted->reserve(change.insertedLength);
+    if (change.storage == Change::OnDisk)
+        m_spillFile->seek(change.fileOffset);
+    for (int i = 0; i < change.packedSizes.size(); ++i) {
+        const QByteArray packed = (change.storage == Change::OnDisk)
+                                ? m_spillFile->read(change.packedSizes.at(i))
+                                : change.packed.at(i);
+        const QByteArray chunk = qUncompress(packed);
+        QString *text = (i < change.removedChunks) ? removed : inserted;
+        text->append(reinterpret_cast<const QChar *>(chunk.constData()),
+                     int(chunk.size() / sizeof(QChar)));
+    }
+    if (removed->size() != change.removedLength || inserted->size() != change.insertedLength)
+        qWarning("TextHistory: Could not restore a change from the undo history");
+}
+
+void TextHistory::scheduleTrim()
+{
+    // Not restarted if already running, so steady typing can't postpone it
+    if (m_memoryBytes > m_memoryBudget && !m_trimTimer->isActive())
+        m_trimTimer->start(TrimDelay);
+}
+
+void TextHistory::trimMemory()
+{
+    if (m_memoryBytes <= m_memoryBudget || m_changes.size() < 2)
+        return;
+
+    // Trim to somewhat below the budget, so this isn't repeated for every
+    // change.  The latest change is left alone, since typing may still be
+    // merged into it.  Large changes are compressed a chunk at a time, so
+    // they may take several slices.
+    const qint64 target = m_memoryBudget - m_memoryBudget / 4;
+    const auto latest = std::prev(m_changes.end());
+    QElapsedTimer sliceTimer;
+    sliceTimer.start();
+    bool done = true;
+    for (auto iter = m_changes.begin(); iter != latest && m_memoryBytes > target; ) {
+        if (sliceTimer.elapsed() >= TrimSlice) {
+            done = false;
+            break;
+        }
+        if (iter->storage == Change::InMemory && !compressChunk(*iter))
+            continue;
+        ++iter;
+    }
+    for (auto iter = m_changes.begin(); done && iter != latest && m_memoryBytes > target; ++iter) {
+        if (sliceTimer.elapsed() >= TrimSlice) {
+            done = false;
+            break;
+        }
+        if (iter->storage == Change::Compressed && !spill(*iter))
+            break;
+    }
+
+    // Let the event loop run before continuing
+    if (!done)
+        m_trimTimer->start(0);
+    scheduleUsageChanged();
+}
+
+// Compresses the next chunk of the change's text, and returns true once
+// all of it has been compressed
+bool TextHistory::compressChunk(Change &change)
+{
+    m_memoryBytes -= change.memoryCost();
+
+    const int removedSize = int(change.removed.size());
+    const bool packingRemoved = change.packedChars < removedSize;
+    const QString &text = packingRemoved ? change.removed : change.inserted;
+    const int start = packingRemoved ? change.packedChars : change.packedChars - removedSize;
+    const int length = qMin(PackChunkSize, int(text.size()) - start);
+    if (length > 0) {
+        const QByteArray chunk = qCompress(reinterpret_cast<const uchar *>(text.constData() + start),
+                                           length * int(sizeof(QChar)), 1);
+        change.packed.append(chunk);
+        change.packedSizes.append(int(chunk.size()));
+        change.packedChars += length;
+    }
+
+    const bool finished = change.packedChars >= removedSize + change.inserted.size();
+    if (finished) {
+        // Every chunk of the removed text is full except the last
+        change.removedChunks = (removedSize + PackChunkSize - 1) / PackChunkSize;
+        change.removed.clear();
+        change.inserted.clear();
+        change.packedChars = 0;
+        change.storage = Change::Compressed;
+        m_compressedBytes += change.packedSize();
+    }
+
+    m_memoryBytes += change.memoryCost();
+    return finished;
+}
+
+bool TextHistory::spill(Change &change)
+{
+    if (!m_spillFile) {
+        m_spillFile = new QTemporaryFile(this);
+        if (!m_spillFile->open()) {
+            qWarning("TextHistory: Could not create a temporary file for the undo history: %s",
+                     qPrintable(m_spillFile->errorString()));
+            delete m_spillFile;
+            m_spillFile = Q_NULLPTR;
+            return false;
+        }
+    }
+
+    const qint64 fileOffset = m_spillFile->size();
+    m_spillFile->seek(fileOffset);
+    for (const QByteArray &chunk : std::as_const(change.packed)) {
+        if (m_spillFile->write(chunk) != chunk.size()) {
+            qWarning("TextHistory: Could not write to the undo history file: %s",
+                     qPrintable(m_spillFile->errorString()));
+            m_spillFile->resize(fileOffset);
+            return false;
+        }
+    }
+
+    const qint64 packedSize = change.packedSize();
+    m_memoryBytes -= change.memoryCost();
+    m_compressedBytes -= packedSize;
+    change.packed.clear();
+    change.storage = Change::OnDisk;
+    change.fileOffset = fileOffset;
+    m_memoryBytes += change.memoryCost();
+    m_diskBytes += packedSize;
+    ++m_spilledChanges;
+    return true;
+}
+
+void TextHistory::scheduleUsageChanged()
+{
+    // Clearing a long history releases each change separately
+    if (m_usagePending)
+        return;
+    m_usagePending = true;
+    QTimer::singleShot(0, this, [this] {
+        m_usagePending = false;
+        Q_EMIT usageChanged();
+    });
+}
+
+
+void TextHistory::DocumentText::setText(const QString &text)
+{
+    m_buffer.assign(text.cbegin(), text.cend());
+    m_gapStart = m_gapEnd = int(m_buffer.size());
+}
+
+QString TextHistory::DocumentText::mid(int position, int length) const
+{
+    QString text;
+    text.reserve(length);
+    const QChar *data = m_buffer.data();
+    if (position < m_gapStart) {
+        const int before = qMin(length, m_gapStart - position);
+        text.append(data + position, before);
+        position += before;
+        length -= before;
+    }
+    if (length > 0)
+        text.append(data + m_gapEnd + (position - m_gapStart), length);
+    return text;
+}
+
+QChar TextHistory::DocumentText::at(int position) const
+{
+    return m_buffer[size_t(position < m_gapStart ? position : position + (m_gapEnd - m_gapStart))];
+}
+
+int TextHistory::DocumentText::commonPrefix(int position, const QString &text) const
+{
+    int count = 0;
+    while (count < text.size() && at(position + count) == text.at(count))
+        ++count;
+    return count;
+}
+
+int TextHistory::DocumentText::commonSuffix(int end, const QString &text) const
+{
+    int count = 0;
+    while (count < text.size() && at(end - count - 1) == text.at(text.size() - count - 1))
+        ++count;
+    return count;
+}
+
+void TextHistory::DocumentText::replace(int position, int length, const QString &text)
+{
+    moveGap(position);
+    m_gapEnd += length;
+
+    const int insertLength = int(text.size());
+    if (m_gapEnd - m_gapStart < insertLength) {
+        // Grow with plenty of spare room, so the buffer isn't reallocated
+        // again for the next few edits
+        const int textSize = size();
+        const int gapSize = insertLength + textSize / 16 + 4096;
+        const int afterGap = int(m_buffer.size()) - m_gapEnd;
+        std::vector<QChar> buffer(size_t(textSize) + gapSize);
+        std::copy_n(m_buffer.cbegin(), m_gapStart, buffer.begin());
+        std::copy_n(m_buffer.cbegin() + m_gapEnd, afterGap,
+                    buffer.end() - afterGap);
+        m_buffer.swap(buffer);
+        m_gapEnd = int(m_buffer.size()) - afterGap;
+    }
+    std::copy_n(text.constData(), insertLength, m_buffer.begin() + m_gapStart);
+    m_gapStart += insertLength;
+}
+
+void TextHistory::DocumentText::moveGap(int position)
+{
+    if (position < m_gapStart) {
+        const int count = m_gapStart - position;
+        std::move_backward(m_buffer.begin() + position, m_buffer.begin() + m_gapStart,
+                           m_buffer.begin() + m_gapEnd);
+        m_gapStart -= count;
+        m_gapEnd -= count;
+    } else if (position > m_gapStart) {
+        const int count = position - m_gapStart;
+        std::move(m_buffer.begin() + m_gapEnd, m_buffer.begin() + m_gapEnd + count,
+                  m_buffer.begin() + m_gapStart);
+        m_gapStart += count;
+        m_gapEnd += count;
+    }
+}
@@ -0,0 +1,153 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_TEXTHISTORY_H
+#define QTEXTPAD_TEXTHISTORY_H
+
+#include <QObject>
+#include <QString>
+#include <QVector>
+
+#include <list>
+#include <vector>
+
+class QPlainTextEdit;
+class QTemporaryFile;
+class QTimer;
+
+/* Records the edits made to a QPlainTextEdit's document for undo and redo,
+ * in place of QTextDocument's own undo stack.  QTextDocument keeps every
+ * removed fragment for as long as its undo stack lives, with no way to limit
+ * it.  Here, each change accounts for the memory it holds, and once the
+ * history is over its budget, the oldest changes are compressed and then
+ * moved out to a temporary file, to be read back if they are undone or
+ * redone.  That happens on a timer, in short slices, rather than while the
+ * document is being edited.
+ *
+ * The document doesn't report what text an edit removed, so a copy of the
+ * document's text is kept up to date alongside it.  Only the text which
+ * actually changed is recorded: an edit block made of separate parts (see
+ * SyntaxTextEdit::partialEdit) is recorded part by part, and otherwise the
+ * unchanged text at either end of the reported range is skipped.
+ */
+class TextHistory : public QObject
+{
+    Q_OBJECT
+
+public:
+    class Change;
+
+    explicit TextHistory(QPlainTextEdit *editor, QObject *parent = Q_NULLPTR);
+    ~TextHistory() Q_DECL_OVERRIDE;
+
+    void setMemoryBudget(qint64 bytes);
+    qint64 memoryBudget() const { return m_memoryBudget; }
+
+    // Memory held by the recorded changes, including those which have been
+    // compressed, and the space used by changes moved out to disk
+    qint64 memoryUsage() const { return m_memoryBytes; }
+    qint64 compressedSize() const { return m_compressedBytes; }
+    qint64 diskUsage() const { return m_diskBytes; }
+
+    // Changes to the document between these (such as loading a new file)
+    // are not recorded
+    void beginReset();
+    void endReset();
+
+    void undo(Change *change);
+    void redo(Change *change);
+
+    // Appends next onto change if both are part of the same run of typing
+    // or deleting, with no undo or redo in between.  next still needs to be
+    // released afterward.
+    bool merge(Change *change, const Change *next);
+    void release(Change *change);
+
+Q_SIGNALS:
+    void changeRecorded(TextHistory::Change *change);
+    void usageChanged();
+
+private Q_SLOTS:
+    void recordChange(int position, int charsRemoved, int charsAdded);
+    void recordPartialEdit(int position, int charsRemoved, int charsAdded);
+    void trimMemory();
+
+private:
+    // A gap buffer, so edits near the previous one are cheap no matter how
+    // large the document is
+    class DocumentText
+    {
+    public:
+        DocumentText() : m_gapStart(), m_gapEnd() { }
+
+        int size() const { return int(m_buffer.size()) - (m_gapEnd - m_gapStart); }
+        void setText(const QString &text);
+        QString mid(int position, int length) const;
+        QChar at(int position) const;
+
+        // The number of characters of text which match from position
+        // onward, or (for commonSuffix) backward from just before end
+        int commonPrefix(int position, const QString &text) const;
+        int commonSuffix(int end, const QString &text) const;
+        void replace(int position, int length, const QString &text);
+
+    private:
+        std::vector<QChar> m_buffer;
+        int m_gapStart, m_gapEnd;
+
+        void moveGap(int position);
+    };
+
+    // One part of an edit block, as reported by SyntaxTextEdit::partialEdit
+    struct Piece
+    {
+        int position;
+        int removedLength, insertedLength;
+    };
+
+    QPlainTextEdit *m_editor;
+    DocumentText m_text;
+    std::list<Change> m_changes;
+    int m_resetting;
+    bool m_applying;
+
+    // The parts of the current edit block so far, with their text
+    QVector<Piece> m_pieces;
+    QString m_piecesRemoved, m_piecesInserted;
+    bool m_piecesLost;
+    int m_undoSerial;
+    bool m_usagePending;
+
+    qint64 m_memoryBudget;
+    qint64 m_memoryBytes;
+    qint64 m_compressedBytes;
+    qint64 m_diskBytes;
+    QTemporaryFile *m_spillFile;
+    int m_spilledChanges;
+    QTimer *m_trimTimer;
+
+    QString documentText(int position, int length) const;
+    void resync();
+    void apply(const Change &change, bool undo);
+    void recordPieces();
+    void loadText(const Change &change, QString *removed, QString *inserted) const;
+    void scheduleTrim();
+    bool compressChunk(Change &change);
+    bool spill(Change &change);
+    void scheduleUsageChanged();
+};
+
+#endif // QTEXTPAD_TEXTHISTORY_H
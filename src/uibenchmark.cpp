@@ -0,0 +1,377 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uibenchmark.h"
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QKeyEvent>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextBlock>
+
+#include <KSyntaxHighlighting/Repository>
+#include <KSyntaxHighlighting/Definition>
+#include <KSyntaxHighlighting/Theme>
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+
+#include "syntaxtextedit.h"
+
+// Number of scripted events in each scenario
+static const int ScenarioSteps = 100;
+
+// Give up waiting for a repaint after this many milliseconds
+static const int PaintTimeout = 500;
+
+// Size of the single-line document, and how long to wait for it to be
+// loaded and painted
+static const int LongLineChars = 50 * 1024 * 1024;
+static const int LoadTimeout = 120000;
+
+class TimedEditor : public SyntaxTextEdit
+{
+public:
+    TimedEditor() : paintCount() { }
+
+    QVector<qint64> paintTimes;
+    int paintCount;
+
+protected:
+    void paintEvent(QPaintEvent *e) Q_DECL_OVERRIDE
+    {
+        QElapsedTimer timer;
+        timer.start();
+        SyntaxTextEdit::paintEvent(e);
+        paintTimes.append(timer.nsecsElapsed());
+        ++paintCount;
+    }
+};
+
+static QString syntheticDocument(int lines)
+{
+    // A small C++ function, repeated to fill the requested number of lines
+    static const char *const chunk[] = {
+        "int function_%1(int value)",
+        "{",
+        "    int total = 0;",
+        "    if (value > %1) {",
+        "        for (int i = 0; i < value; ++i)",
+        "            total += i * %1;",
+        "    }",
+        "    // Return the accumulated total for %1",
+        "    return total;",
+        "}",
+    };
+    static const int chunkLines = int(sizeof(chunk) / sizeof(chunk[0]));
+
+    QString text;
+    text.reserve(lines * 32);
+    for (int i = 0; i < lines; ++i) {
+        text += QString::fromLatin1(chunk[i % chunkLines]).arg(i / chunkLines);
+        text += QLatin1Char('\n');
+    }
+    return text;
+}
+
+static QString longLineDocument(int chars)
+{
+    // A minified statement, repeated to fill a single line
+    static const QString statement =
+            QStringLiteral("if(value>7){total+=value*7;}else{total=0;}");
+
+    QString text;
+    text.reserve(chars + statement.size());
+    while (text.size() < chars)
+        text += statement;
+    text.truncate(chars);
+    return text;
+}
+
+static QJsonObject timingStats(QVector<qint64> times)
+{
+    // Upper bounds of the histogram buckets, in microseconds
+    static const int buckets[] = {
+        100, 250, 500, 1000, 2000, 4000, 8000, 16000, 33000, 66000, 133000,
+    };
+
+    QJsonObject stats;
+    stats[QStringLiteral("count")] = times.size();
+    if (times.isEmpty())
+        return stats;
+
+    std::sort(times.begin(), times.end());
+    auto percentile = [&times](int pct) {
+        return times.at(static_cast<int>((times.size() - 1) * qint64(pct) / 100)) / 1000.0;
+    };
+    stats[QStringLiteral("p50_us")] = percentile(50);
+    stats[QStringLiteral("p95_us")] = percentile(95);
+    stats[QStringLiteral("p99_us")] = percentile(99);
+    stats[QStringLiteral("max_us")] = times.last() / 1000.0;
+
+    QJsonArray histogram;
+    int index = 0;
+    for (int bound : buckets) {
+        int count = 0;
+        while (index < times.size() && times.at(index) <= qint64(bound) * 1000) {
+            ++count;
+            ++index;
+        }
+        QJsonObject bucket;
+        bucket[QStringLiteral("le_us")] = bound;
+        bucket[QStringLiteral("count")] = count;
+        histogram.append(bucket);
+    }
+    QJsonObject overflow;
+    overflow[QStringLiteral("le_us")] = QStringLiteral("inf");
+    overflow[QStringLiteral("count")] = int(times.size() - index);
+    histogram.append(overflow);
+    stats[QStringLiteral("histogram")] = histogram;
+
+    return stats;
+}
+
+static void sendKey(QWidget *widget, int key, const QString &text = QString(),
+                    bool autoRepeat = false)
+{
+    QKeyEvent press(QEvent::KeyPress, key, Qt::NoModifier, text, autoRepeat);
+    QApplication::sendEvent(widget, &press);
+    QKeyEvent release(QEvent::KeyRelease, key, Qt::NoModifier, text, autoRepeat);
+    QApplication::sendEvent(widget, &release);
+}
+
+struct Scenario
+{
+    const char *name;
+    std::function<void (SyntaxTextEdit *)> setup;
+    std::function<void (SyntaxTextEdit *, int step)> step;
+};
+
+static void setupEditor(TimedEditor *editor, bool features, bool fastLayout)
+{
+    editor->resize(1200, 900);
+    editor->setSyntax(SyntaxTextEdit::syntaxRepo()->definitionForName(QStringLiteral("C++")));
+    editor->setFastLayout(fastLayout);
+    editor->setShowLineNumbers(features);
+    editor->setShowIndentGuides(features);
+    editor->setShowFolding(features);
+    editor->setHighlightCurrentLine(features);
+    editor->setMatchBraces(features);
+    if (features) {
+        SyntaxTextEdit::SearchParams params;
+        params.searchText = QStringLiteral("total");
+        editor->setLiveSearch(params);
+    }
+}
+
+static QVector<qint64> stepLatencies(TimedEditor *editor,
+                                     const std::function<void (SyntaxTextEdit *, int step)> &step)
+{
+    QVector<qint64> latencies;
+    for (int i = 0; i < ScenarioSteps; ++i) {
+        const int paints = editor->paintCount;
+        QElapsedTimer timer;
+        timer.start();
+        step(editor, i);
+
+        // Deliver the resulting update requests, and wait for them to be
+        // painted before the next event
+        do {
+            QApplication::processEvents();
+        } while (editor->paintCount == paints && timer.elapsed() < PaintTimeout);
+        if (editor->paintCount != paints)
+            latencies.append(timer.nsecsElapsed());
+    }
+    return latencies;
+}
+
+static QJsonObject runScenario(const Scenario &scenario, int lines, bool features,
+                               bool fastLayout)
+{
+    TimedEditor editor;
+    setupEditor(&editor, features, fastLayout);
+
+    QElapsedTimer loadTimer;
+    loadTimer.start();
+    editor.setPlainText(syntheticDocument(lines));
+    editor.show();
+    QApplication::processEvents();
+    const qint64 loadTime = loadTimer.nsecsElapsed();
+
+    scenario.setup(&editor);
+    QApplication::processEvents();
+    editor.paintTimes.clear();
+
+    const QVector<qint64> latencies = stepLatencies(&editor, scenario.step);
+
+    QJsonObject result;
+    result[QStringLiteral("scenario")] = QString::fromLatin1(scenario.name);
+    result[QStringLiteral("lines")] = lines;
+    result[QStringLiteral("features")] = features;
+    result[QStringLiteral("fast_layout")] = fastLayout;
+    result[QStringLiteral("load_ms")] = loadTime / 1.0e6;
+    result[QStringLiteral("paint")] = timingStats(editor.paintTimes);
+    result[QStringLiteral("latency")] = timingStats(latencies);
+    return result;
+}
+
+static QJsonObject runLongLine(bool fastLayout)
+{
+    TimedEditor editor;
+    setupEditor(&editor, true, fastLayout);
+    const QString text = longLineDocument(LongLineChars);
+
+    // Time to interactive: from loading the text until it is first painted
+    QElapsedTimer loadTimer;
+    loadTimer.start();
+    editor.setPlainText(text);
+    editor.show();
+    do {
+        QApplication::processEvents();
+    } while (editor.paintCount == 0 && loadTimer.elapsed() < LoadTimeout);
+    const double firstPaintTime = (editor.paintCount != 0)
+                                ? loadTimer.nsecsElapsed() / 1.0e6 : -1.0;
+
+    // Move and type in the middle of the line, well past the part which is
+    // highlighted
+    QTextCursor cursor = editor.textCursor();
+    cursor.setPosition(LongLineChars / 2);
+    editor.setTextCursor(cursor);
+    QApplication::processEvents();
+    editor.paintTimes.clear();
+
+    const QVector<qint64> cursorLatencies = stepLatencies(&editor,
+            [](SyntaxTextEdit *editor, int) {
+                sendKey(editor, Qt::Key_Right, QString(), true);
+            });
+    const QVector<qint64> typingLatencies = stepLatencies(&editor,
+            [](SyntaxTextEdit *editor, int step) {
+                const QChar ch = QLatin1Char(char('a' + (step % 26)));
+                sendKey(editor, Qt::Key_A + (step % 26), QString(ch));
+            });
+
+    QJsonObject result;
+    result[QStringLiteral("scenario")] = QStringLiteral("long-line");
+    result[QStringLiteral("chars")] = LongLineChars;
+    result[QStringLiteral("features")] = true;
+    result[QStringLiteral("fast_layout")] = fastLayout;
+    result[QStringLiteral("first_paint_ms")] = firstPaintTime;
+    result[QStringLiteral("paint")] = timingStats(editor.paintTimes);
+    result[QStringLiteral("cursor_latency")] = timingStats(cursorLatencies);
+    result[QStringLiteral("typing_latency")] = timingStats(typingLatencies);
+    return result;
+}
+
+int UiBenchmark::run(const QStringList &args)
+{
+    QVector<int> sizes;
+    for (const QString &arg : args) {
+        bool ok;
+        const int lines = arg.toInt(&ok);
+        if (!ok || lines <= 0) {
+            fprintf(stderr, "Invalid document size: %s\n", qPrintable(arg));
+            return 1;
+        }
+        sizes.append(lines);
+    }
+    if (sizes.isEmpty())
+        sizes = QVector<int>{1000, 10000, 100000, 1000000};
+
+    auto syntaxRepo = SyntaxTextEdit::syntaxRepo();
+    const auto lightTheme = syntaxRepo->defaultTheme(KSyntaxHighlighting::Repository::LightTheme);
+    const auto darkTheme = syntaxRepo->defaultTheme(KSyntaxHighlighting::Repository::DarkTheme);
+    const Scenario scenarios[] = {
+        {
+            "page-down",
+            [](SyntaxTextEdit *editor) { editor->moveCursor(QTextCursor::Start); },
+            [](SyntaxTextEdit *editor, int) { sendKey(editor, Qt::Key_PageDown); },
+        },
+        {
+            "hold-key",
+            [](SyntaxTextEdit *editor) { editor->moveCursor(QTextCursor::Start); },
+            [](SyntaxTextEdit *editor, int) {
+                sendKey(editor, Qt::Key_Down, QString(), true);
+            },
+        },
+        {
+            "type-at-end",
+            [](SyntaxTextEdit *editor) { editor->moveCursor(QTextCursor::End); },
+            [](SyntaxTextEdit *editor, int step) {
+                const QChar ch = QLatin1Char(char('a' + (step % 26)));
+                sendKey(editor, Qt::Key_A + (step % 26), QString(ch));
+            },
+        },
+        {
+            // Every visible line is laid out again in the new font size.
+            // Word wrap stays off, so the fast layout path still applies.
+            "zoom",
+            [](SyntaxTextEdit *editor) { editor->zoomReset(); },
+            [](SyntaxTextEdit *editor, int step) {
+                if (step % 2)
+                    editor->zoomOut();
+                else
+                    editor->zoomIn();
+            },
+        },
+        {
+            "toggle-folding",
+            [](SyntaxTextEdit *editor) { editor->setShowFolding(true); },
+            [](SyntaxTextEdit *editor, int step) {
+                if (step % 2)
+                    editor->unfoldAll();
+                else
+                    editor->foldAll();
+            },
+        },
+        {
+            "switch-theme",
+            [](SyntaxTextEdit *) { },
+            [&lightTheme, &darkTheme](SyntaxTextEdit *editor, int step) {
+                editor->setTheme((step % 2) ? lightTheme : darkTheme);
+            },
+        },
+    };
+
+    QJsonArray results;
+    for (int lines : sizes) {
+        for (const bool features : {false, true}) {
+            // Each scenario is run with and without the fast layout path,
+            // so the two can be compared directly
+            for (const bool fastLayout : {false, true}) {
+                for (const Scenario &scenario : scenarios) {
+                    fprintf(stderr, "%s: %d lines%s%s\n", scenario.name, lines,
+                            features ? " (all features)" : "",
+                            fastLayout ? " (fast layout)" : "");
+                    results.append(runScenario(scenario, lines, features, fastLayout));
+                }
+            }
+        }
+    }
+
+    // A single 50 MB line, as in a minified script or a JSON dump
+    for (const bool fastLayout : {false, true}) {
+        fprintf(stderr, "long-line: %d chars%s\n", LongLineChars,
+                fastLayout ? " (fast layout)" : "");
+        results.append(runLongLine(fastLayout));
+    }
+
+    const QByteArray json = QJsonDocument(results).toJson(QJsonDocument::Indented);
+    fwrite(json.constData(), 1, json.size(), stdout);
+    return 0;
+}
@@ -0,0 +1,35 @@
+/* This file is part of QTextPad.
+ *
+ * QTextPad is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QTextPad is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QTextPad.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QTEXTPAD_UIBENCHMARK_H
+#define QTEXTPAD_UIBENCHMARK_H
+
+#include <QStringList>
+
+// Scripted scroll, typing and relayout scenarios for measuring editor paint
+// time and event-to-paint latency, each with fast layout off and on.
+// A single 50 MB line is also loaded, to measure the time to its first
+// paint and the cursor and typing latency on it.  Results are written to
+// stdout as JSON.  This is intended to be run with QT_QPA_PLATFORM=offscreen.
+class UiBenchmark
+{
+public:
+    // Each argument is a document size in lines.  If none are given, a
+    // default range of 1k to 1M lines is used.
+    static int run(const QStringList &args);
+};
+
+#endif // QTEXTPAD_UIBENCHMARK_H
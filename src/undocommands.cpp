@@ -16,17 +16,33 @@
 
 #include "undocommands.h"
 
-#include "syntaxtextedit.h"
 #include "qtextpadwindow.h"
 
+TextEditorUndoCommand::~TextEditorUndoCommand()
+{
+    m_history->release(m_change);
+}
+
 void TextEditorUndoCommand::undo()
 {
-    m_editor->undo();
+    m_history->undo(m_change);
 }
 
 void TextEditorUndoCommand::redo()
 {
-    m_editor->redo();
+    if (m_pushed) {
+        m_pushed = false;
+        return;
+    }
+    m_history->redo(m_change);
+}
+
+bool TextEditorUndoCommand::mergeWith(const QUndoCommand *cmd)
+{
+    if (cmd->id() != id())
+        return false;
+
+    return m_history->merge(m_change, static_cast<const TextEditorUndoCommand*>(cmd)->m_change);
 }
 
 
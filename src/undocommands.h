@@ -19,20 +19,29 @@
 
 #include <QUndoCommand>
 
-class SyntaxTextEdit;
+#include "texthistory.h"
+
 class QTextPadWindow;
 
 class TextEditorUndoCommand : public QUndoCommand
 {
 public:
-    explicit TextEditorUndoCommand(SyntaxTextEdit *editor)
-        : m_editor(editor) { }
+    TextEditorUndoCommand(TextHistory *history, TextHistory::Change *change)
+        : m_history(history), m_change(change), m_pushed(true) { }
+    ~TextEditorUndoCommand() Q_DECL_OVERRIDE;
 
     void undo() Q_DECL_OVERRIDE;
     void redo() Q_DECL_OVERRIDE;
 
+    int id() const Q_DECL_OVERRIDE { return 100; }
+    bool mergeWith(const QUndoCommand *cmd) Q_DECL_OVERRIDE;
+
 private:
-    SyntaxTextEdit *m_editor;
+    TextHistory *m_history;
+    TextHistory::Change *m_change;
+
+    // The change has already been made to the document when it is pushed
+    bool m_pushed;
 };
 
 class ChangeLineEndingCommand : public QUndoCommand